@@ -0,0 +1,33 @@
+#!/bin/sh
+# Writes a benchmark for XEQ of a global label, with the given number of
+# programs loaded (default 500), to standard output. See README.
+
+n=${1:-500}
+
+echo 'LBL "XT"'
+echo 'RTN'
+echo 'END'
+i=2
+while [ $i -lt $n ]; do
+    echo "LBL \"X$i\""
+    echo 'RTN'
+    echo 'END'
+    i=`expr $i + 1`
+done
+cat <<'END_OF_BENCH'
+LBL "XBENCH"
+STO 00
+TIME
+STO 01
+LBL 01
+XEQ "XT"
+DSE 00
+GTO 01
+TIME
+RCL 01
+HMS-
+HR
+3600
+*
+END
+END_OF_BENCH
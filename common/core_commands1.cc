@@ -21,6 +21,7 @@
 #include "core_commands2.h"
 #include "core_display.h"
 #include "core_helpers.h"
+#include "core_linalg1.h"
 #include "core_main.h"
 #include "core_math1.h"
 #include "core_sto_rcl.h"
@@ -115,13 +116,54 @@ int docmd_chs(arg_struct *arg) {
     return ERR_NONE;
 }
 
+/* Scalar operands, at least one of them complex, after the real-real case
+ * has been handled: the same arithmetic map_binary() does, but the result
+ * goes through binary_complex_result(), so no objects are allocated.
+ */
+static bool scalar_operands() {
+    return (reg_x->type == TYPE_REAL || reg_x->type == TYPE_COMPLEX)
+        && (reg_y->type == TYPE_REAL || reg_y->type == TYPE_COMPLEX);
+}
+
+static int binary_complex_op(mappable_rc mrc, mappable_cr mcr,
+                             mappable_cc mcc) {
+    phloat re, im;
+    int error;
+    if (reg_x->type == TYPE_REAL)
+        error = mrc(((vartype_real *) reg_x)->x,
+                    ((vartype_complex *) reg_y)->re,
+                    ((vartype_complex *) reg_y)->im, &re, &im);
+    else if (reg_y->type == TYPE_REAL)
+        error = mcr(((vartype_complex *) reg_x)->re,
+                    ((vartype_complex *) reg_x)->im,
+                    ((vartype_real *) reg_y)->x, &re, &im);
+    else
+        error = mcc(((vartype_complex *) reg_x)->re,
+                    ((vartype_complex *) reg_x)->im,
+                    ((vartype_complex *) reg_y)->re,
+                    ((vartype_complex *) reg_y)->im, &re, &im);
+    if (error == ERR_NONE)
+        error = binary_complex_result(re, im);
+    return error;
+}
+
 static void docmd_div_completion(int error, vartype *res) {
     if (error == ERR_NONE)
         binary_result(res);
 }
 
 int docmd_div(arg_struct *arg) {
-    return generic_div(reg_x, reg_y, docmd_div_completion);
+    if (reg_x->type == TYPE_REAL && reg_y->type == TYPE_REAL) {
+        phloat r;
+        int error = div_rr(((vartype_real *) reg_x)->x,
+                           ((vartype_real *) reg_y)->x, &r);
+        if (error == ERR_NONE)
+            error = binary_real_result(r);
+        return error;
+    }
+    if (scalar_operands())
+        return binary_complex_op(div_rc, div_cr, div_cc);
+    return generic_div(reg_x, reg_y, docmd_div_completion, true);
 }
 
 static void docmd_mul_completion(int error, vartype *res) {
@@ -130,20 +172,50 @@ static void docmd_mul_completion(int error, vartype *res) {
 }
 
 int docmd_mul(arg_struct *arg) {
-    return generic_mul(reg_x, reg_y, docmd_mul_completion);
+    if (reg_x->type == TYPE_REAL && reg_y->type == TYPE_REAL) {
+        phloat r;
+        int error = mul_rr(((vartype_real *) reg_x)->x,
+                           ((vartype_real *) reg_y)->x, &r);
+        if (error == ERR_NONE)
+            error = binary_real_result(r);
+        return error;
+    }
+    if (scalar_operands())
+        return binary_complex_op(mul_rc, mul_cr, mul_cc);
+    return generic_mul(reg_x, reg_y, docmd_mul_completion, true);
 }
 
 int docmd_sub(arg_struct *arg) {
+    if (reg_x->type == TYPE_REAL && reg_y->type == TYPE_REAL) {
+        phloat r;
+        int error = sub_rr(((vartype_real *) reg_x)->x,
+                           ((vartype_real *) reg_y)->x, &r);
+        if (error == ERR_NONE)
+            error = binary_real_result(r);
+        return error;
+    }
+    if (scalar_operands())
+        return binary_complex_op(sub_rc, sub_cr, sub_cc);
     vartype *res;
-    int error = generic_sub(reg_x, reg_y, &res);
+    int error = generic_sub(reg_x, reg_y, &res, true);
     if (error == ERR_NONE)
         binary_result(res);
     return error;
 }
 
 int docmd_add(arg_struct *arg) {
+    if (reg_x->type == TYPE_REAL && reg_y->type == TYPE_REAL) {
+        phloat r;
+        int error = add_rr(((vartype_real *) reg_x)->x,
+                           ((vartype_real *) reg_y)->x, &r);
+        if (error == ERR_NONE)
+            error = binary_real_result(r);
+        return error;
+    }
+    if (scalar_operands())
+        return binary_complex_op(add_rc, add_cr, add_cc);
     vartype *res;
-    int error = generic_add(reg_x, reg_y, &res);
+    int error = generic_add(reg_x, reg_y, &res, true);
     if (error == ERR_NONE)
         binary_result(res);
     return error;
@@ -352,7 +424,7 @@ int docmd_rcl(arg_struct *arg) {
 }
 
 /* Temporary for use by docmd_rcl_div() & docmd_rcl_mul() */
-static vartype *temp_v;
+static CORE_THREAD vartype *temp_v;
 
 static void docmd_rcl_div_completion(int error, vartype *res) {
     free_vartype(temp_v);
@@ -661,6 +733,7 @@ int docmd_clsigma(arg_struct *arg) {
     size = r->rows * r->columns;
     if (last > size)
         return ERR_SIZE_ERROR;
+    linalg_cache_invalidate(regs);
     for (i = first; i < last; i++) {
         r->array->is_string[i] = 0;
         r->array->data[i] = 0;
@@ -1156,7 +1229,7 @@ int docmd_fp(arg_struct *arg) {
         return ERR_INVALID_TYPE;
 }
 
-static phloat rnd_multiplier;
+static CORE_THREAD phloat rnd_multiplier;
 
 static int mappable_rnd_r(phloat x, phloat *y) {
     if (flags.f.fix_or_all) {
@@ -158,6 +158,40 @@ int docmd_fcc_t(arg_struct *arg) {
     }
 }
 
+/* FACT and PERM tend to be called with small integer arguments, often in
+ * loops. N! is remembered the first time it is computed, using the same
+ * descending product as always, so the results don't change.
+ */
+#ifdef BCD_MATH
+#define FACT_MAX 2123
+#else
+#define FACT_MAX 170
+#endif
+
+static CORE_THREAD phloat fact_table[FACT_MAX + 1];
+static CORE_THREAD bool fact_known[FACT_MAX + 1];
+
+static phloat fact_loop(phloat x) {
+    phloat f = 1;
+    while (x > 1) {
+        f *= x--;
+        if (p_isinf(f))
+            break;
+    }
+    return f;
+}
+
+static phloat fact(phloat x) {
+    if (x > FACT_MAX)
+        return fact_loop(x);
+    int n = to_int(x);
+    if (!fact_known[n]) {
+        fact_table[n] = fact_loop(x);
+        fact_known[n] = true;
+    }
+    return fact_table[n];
+}
+
 int docmd_comb(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL && reg_y->type == TYPE_REAL) {
         phloat y = ((vartype_real *) reg_y)->x;
@@ -206,6 +240,17 @@ int docmd_perm(arg_struct *arg) {
             return ERR_INVALID_DATA;
         if (y < x)
             return ERR_INVALID_DATA;
+        if (x >= y - 1) {
+            /* Y*(Y-1)*...*2 is exactly how FACT computes Y! */
+            r = fact(y);
+            if (p_isinf(r)) {
+                if (flags.f.range_error_ignore)
+                    r = POS_HUGE_PHLOAT;
+                else
+                    return ERR_OUT_OF_RANGE;
+            }
+            x = 0;
+        }
         while (x > 0) {
             r *= y--;
             if (p_isinf(r)) {
@@ -233,18 +278,15 @@ int docmd_perm(arg_struct *arg) {
 }
 
 static int mappable_fact(phloat x, phloat *y) {
-    phloat f = 1;
     if (x < 0 || x != floor(x))
         return ERR_INVALID_DATA;
-    while (x > 1) {
-        f *= x--;
-        if (p_isinf(f)) {
-            if (flags.f.range_error_ignore) {
-                *y = POS_HUGE_PHLOAT;
-                return ERR_NONE;
-            } else
-                return ERR_OUT_OF_RANGE;
-        }
+    phloat f = fact(x);
+    if (p_isinf(f)) {
+        if (flags.f.range_error_ignore) {
+            *y = POS_HUGE_PHLOAT;
+            return ERR_NONE;
+        } else
+            return ERR_OUT_OF_RANGE;
     }
     *y = f;
     return ERR_NONE;
@@ -1248,8 +1290,8 @@ int docmd_prp(arg_struct *arg) {
     return print_program(prgm_index, -1, -1, 0);
 }
 
-static vartype *prv_var;
-static int4 prv_index;
+static CORE_THREAD vartype *prv_var;
+static CORE_THREAD int4 prv_index;
 static int prv_worker(int interrupted);
 
 int docmd_prv(arg_struct *arg) {
@@ -1433,8 +1475,8 @@ int docmd_prx(arg_struct *arg) {
     }
 }
 
-static int prusr_state;
-static int prusr_index;
+static CORE_THREAD int prusr_state;
+static CORE_THREAD int prusr_index;
 static int prusr_worker(int interrupted);
 
 int docmd_prusr(arg_struct *arg) {
@@ -1475,6 +1517,7 @@ static int prusr_worker(int interrupted) {
             string2buf(lbuf, 8, &llen, vars[prusr_index].name,
                                        vars[prusr_index].length);
             char2buf(lbuf, 8, &llen, '=');
+            finish_pending_copy();
             rlen = vartype2string(vars[prusr_index].value, rbuf, 100);
             print_wide(lbuf, llen, rbuf, rlen);
         }
@@ -24,6 +24,7 @@
 #include "core_display.h"
 #include "core_helpers.h"
 #include "core_linalg1.h"
+#include "core_linalg2.h"
 #include "core_main.h"
 #include "core_math2.h"
 #include "core_sto_rcl.h"
@@ -394,6 +395,7 @@ int docmd_delr(arg_struct *arg) {
     if (m->type != TYPE_REALMATRIX && m->type != TYPE_COMPLEXMATRIX)
         return ERR_INVALID_TYPE;
 
+    linalg_cache_release(m);
     if (m->type == TYPE_REALMATRIX) {
         rm = (vartype_realmatrix *) m;
         rows = rm->rows;
@@ -16,6 +16,7 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "core_commands2.h"
 #include "core_commands3.h"
@@ -23,6 +24,7 @@
 #include "core_display.h"
 #include "core_helpers.h"
 #include "core_linalg1.h"
+#include "core_linalg2.h"
 #include "core_math2.h"
 #include "core_sto_rcl.h"
 #include "core_variables.h"
@@ -64,6 +66,7 @@ int docmd_insr(arg_struct *arg) {
             return err;
     }
 
+    linalg_cache_release(m);
     if (m->type == TYPE_REALMATRIX) {
         rm = (vartype_realmatrix *) m;
         rows = rm->rows;
@@ -792,7 +795,7 @@ int docmd_stoel(arg_struct *arg) {
          */
         return ERR_INVALID_TYPE;
 
-    if (!disentangle(m))
+    if (!disentangle_row(m, matedit_i))
         return ERR_INSUFFICIENT_MEMORY;
 
     if (m->type == TYPE_REALMATRIX) {
@@ -963,23 +966,89 @@ int docmd_tanh(arg_struct *arg) {
         return ERR_ALPHA_DATA_IS_INVALID;
 }
 
+/* Cache-oblivious transpose of the sub-block [r0, r1) x [c0, c1) of a
+ * rows x columns matrix with W values per element: the longer side is
+ * split in half until the block is small enough that its rows and columns
+ * both stay in the cache, so neither the reads nor the writes stride
+ * through the whole matrix.
+ */
+#define TRANS_BLOCK 16
+
+template <class T, int W>
+static void transpose(const T *src, T *dst, int4 rows, int4 columns,
+                      int4 r0, int4 r1, int4 c0, int4 c1) {
+    if (r1 - r0 <= TRANS_BLOCK && c1 - c0 <= TRANS_BLOCK) {
+        for (int4 j = c0; j < c1; j++)
+            for (int4 i = r0; i < r1; i++)
+                for (int k = 0; k < W; k++)
+                    dst[(j * rows + i) * W + k] =
+                                    src[(i * columns + j) * W + k];
+    } else if (r1 - r0 >= c1 - c0) {
+        int4 rm = (r0 + r1) / 2;
+        transpose<T, W>(src, dst, rows, columns, r0, rm, c0, c1);
+        transpose<T, W>(src, dst, rows, columns, rm, r1, c0, c1);
+    } else {
+        int4 cm = (c0 + c1) / 2;
+        transpose<T, W>(src, dst, rows, columns, r0, r1, c0, cm);
+        transpose<T, W>(src, dst, rows, columns, r0, r1, cm, c1);
+    }
+}
+
+/* The result of TRANS cannot overwrite X, since X goes to LASTX; but the
+ * old LASTX is about to be discarded, and if it is an unshared matrix of
+ * the same type and size, its storage is reused for the result, so
+ * repeated transposes of a large matrix don't allocate a third copy.
+ */
+static vartype *trans_result(int type, int4 rows, int4 columns) {
+    if (reg_lastx->type == type) {
+        linalg_cache_release(reg_lastx);
+        if (type == TYPE_REALMATRIX) {
+            vartype_realmatrix *rm = (vartype_realmatrix *) reg_lastx;
+            if (rm->array->refcount == 1
+                    && rm->rows * rm->columns == rows * columns) {
+                rm->rows = rows;
+                rm->columns = columns;
+                reg_lastx = NULL;
+                return (vartype *) rm;
+            }
+        } else {
+            vartype_complexmatrix *cm = (vartype_complexmatrix *) reg_lastx;
+            if (cm->array->refcount == 1
+                    && cm->rows * cm->columns == rows * columns) {
+                cm->rows = rows;
+                cm->columns = columns;
+                reg_lastx = NULL;
+                return (vartype *) cm;
+            }
+        }
+    }
+    if (type == TYPE_REALMATRIX)
+        return new_realmatrix(rows, columns);
+    else
+        return new_complexmatrix(rows, columns);
+}
+
 int docmd_trans(arg_struct *arg) {
     if (reg_x->type == TYPE_REALMATRIX) {
         vartype_realmatrix *src = (vartype_realmatrix *) reg_x;
         vartype_realmatrix *dst;
         int4 rows = src->rows;
         int4 columns = src->columns;
-        int4 i, j;
-        dst = (vartype_realmatrix *) new_realmatrix(columns, rows);
+        int4 i, size = rows * columns;
+        dst = (vartype_realmatrix *)
+                        trans_result(TYPE_REALMATRIX, columns, rows);
         if (dst == NULL)
             return ERR_INSUFFICIENT_MEMORY;
-        for (i = 0; i < rows; i++)
-            for (j = 0; j < columns; j++) {
-                int4 n1 = i * columns + j;
-                int4 n2 = j * rows + i;
-                dst->array->is_string[n2] = src->array->is_string[n1];
-                dst->array->data[n2] = src->array->data[n1];
-            }
+        transpose<phloat, 1>(src->array->data, dst->array->data,
+                             rows, columns, 0, rows, 0, columns);
+        for (i = 0; i < size; i++)
+            if (src->array->is_string[i])
+                break;
+        if (i == size)
+            memset(dst->array->is_string, 0, size);
+        else
+            transpose<char, 1>(src->array->is_string, dst->array->is_string,
+                               rows, columns, 0, rows, 0, columns);
         unary_result((vartype *) dst);
         return ERR_NONE;
     } else if (reg_x->type == TYPE_COMPLEXMATRIX) {
@@ -987,17 +1056,12 @@ int docmd_trans(arg_struct *arg) {
         vartype_complexmatrix *dst;
         int4 rows = src->rows;
         int4 columns = src->columns;
-        int4 i, j;
-        dst = (vartype_complexmatrix *) new_complexmatrix(columns, rows);
+        dst = (vartype_complexmatrix *)
+                        trans_result(TYPE_COMPLEXMATRIX, columns, rows);
         if (dst == NULL)
             return ERR_INSUFFICIENT_MEMORY;
-        for (i = 0; i < rows; i++)
-            for (j = 0; j < columns; j++) {
-                int4 n1 = 2 * (i * columns + j);
-                int4 n2 = 2 * (j * rows + i);
-                dst->array->data[n2] = src->array->data[n1];
-                dst->array->data[n2 + 1] = src->array->data[n1 + 1];
-            }
+        transpose<phloat, 2>(src->array->data, dst->array->data,
+                             rows, columns, 0, rows, 0, columns);
         unary_result((vartype *) dst);
         return ERR_NONE;
     } else if (reg_x->type == TYPE_STRING)
@@ -1069,7 +1133,7 @@ static int matedit_move(int direction) {
     } else
         return ERR_INVALID_TYPE;
 
-    if (!disentangle(m))
+    if (!disentangle_row(m, matedit_i))
         return ERR_INSUFFICIENT_MEMORY;
 
     new_i = matedit_i;
@@ -1238,7 +1302,7 @@ int docmd_percent_ch(arg_struct *arg) {
     return ERR_NONE;
 }
 
-static vartype *matx_v;
+static CORE_THREAD vartype *matx_v;
 
 static void matx_completion(int error, vartype *res) {
     if (error != ERR_NONE) {
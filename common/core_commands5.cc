@@ -21,6 +21,7 @@
 #include "core_commands5.h"
 #include "core_display.h"
 #include "core_helpers.h"
+#include "core_linalg1.h"
 #include "core_main.h"
 #include "core_math1.h"
 #include "core_sto_rcl.h"
@@ -376,7 +377,7 @@ int docmd_basechs(arg_struct *arg) {
     return ERR_NONE;
 }
 
-static struct sum_struct {
+static CORE_THREAD struct sum_struct {
     phloat x;
     phloat x2;
     phloat y;
@@ -430,7 +431,7 @@ static int get_summation() {
     return ERR_NONE;
 }
     
-static struct model_struct {
+static CORE_THREAD struct model_struct {
     phloat x;
     phloat x2;
     phloat y;
@@ -1269,6 +1270,107 @@ static phloat sigma_helper_2(phloat *sigmaregs,
     return sigmaregs[5];
 }
 
+/* Σ+ and Σ- with a two-column matrix. Rather than updating the summation
+ * registers once per row, as sigma_helper_2() does, the rows are summed in
+ * blocks of SIGMA_BLOCK into local partial sums, and those are added to the
+ * register values with Neumaier compensation, which keeps the low-order bits
+ * that each addition rounds off. The registers are written once, at the
+ * end. This is faster, and long data sets lose much less precision than
+ * they would to the rounding of every intermediate register value.
+ * Returns false, without touching the registers or flags, if any sum
+ * overflows; the caller then falls back on sigma_helper_2(), which clamps
+ * overflows one row at a time.
+ */
+#define SIGMA_BLOCK 32
+
+static void sum_add(phloat *s, phloat *c, phloat t) {
+    phloat u = *s + t;
+    if (fabs(*s) >= fabs(t))
+        *c += (*s - u) + t;
+    else
+        *c += (t - u) + *s;
+    *s = u;
+}
+
+static bool sigma_bulk(phloat *sigmaregs, vartype_realmatrix *rm,
+                       int weight) {
+    int all = flags.f.all_sigma;
+    int nregs = all ? 13 : 6;
+    phloat s[13], c[13], b[13];
+    phloat *data = rm->array->data;
+    int4 rows = rm->rows;
+    bool x_nonpos = false, y_nonpos = false;
+    int4 i, j;
+    int k;
+
+    for (k = 0; k < nregs; k++) {
+        s[k] = sigmaregs[k];
+        c[k] = 0;
+    }
+    for (i = 0; i < rows; i += SIGMA_BLOCK) {
+        int4 end = i + SIGMA_BLOCK < rows ? i + SIGMA_BLOCK : rows;
+        for (k = 0; k < nregs; k++)
+            b[k] = 0;
+        for (j = i; j < end; j++) {
+            phloat x = data[j * 2];
+            phloat y = data[j * 2 + 1];
+            b[0] += x;
+            b[1] += x * x;
+            b[2] += y;
+            b[3] += y * y;
+            b[4] += x * y;
+            if (!all)
+                continue;
+            phloat lnx, lny;
+            if (x > 0) {
+                lnx = log(x);
+                b[6] += lnx;
+                b[7] += lnx * lnx;
+                b[12] += lnx * y;
+            } else
+                x_nonpos = true;
+            if (y > 0) {
+                lny = log(y);
+                b[8] += lny;
+                b[9] += lny * lny;
+                b[11] += x * lny;
+                if (x > 0)
+                    b[10] += lnx * lny;
+            } else
+                y_nonpos = true;
+        }
+        b[5] = end - i;
+        for (k = 0; k < nregs; k++) {
+            sum_add(&s[k], &c[k], weight == 1 ? b[k] : -b[k]);
+            if (p_isinf(s[k]) || p_isnan(s[k]))
+                return false;
+        }
+    }
+    for (k = 0; k < nregs; k++) {
+        s[k] += c[k];
+        if (p_isinf(s[k]))
+            return false;
+    }
+
+    for (k = 0; k < nregs; k++)
+        sigmaregs[k] = s[k];
+    if (!all) {
+        flags.f.log_fit_invalid = 1;
+        flags.f.exp_fit_invalid = 1;
+        flags.f.pwr_fit_invalid = 1;
+    } else {
+        if (x_nonpos) {
+            flags.f.log_fit_invalid = 1;
+            flags.f.pwr_fit_invalid = 1;
+        }
+        if (y_nonpos) {
+            flags.f.exp_fit_invalid = 1;
+            flags.f.pwr_fit_invalid = 1;
+        }
+    }
+    return true;
+}
+
 static int sigma_helper_1(int weight) {
     /* Check if summation registers are OK */
     int4 first = mode_sigma_reg;
@@ -1289,6 +1391,8 @@ static int sigma_helper_1(int weight) {
         if (r->array->is_string[i])
             return ERR_ALPHA_DATA_IS_INVALID;
     sigmaregs = r->array->data + first;
+    /* REGS is about to be modified in place */
+    linalg_cache_invalidate(regs);
 
     /* All summation registers present, real-valued, non-string. */
     switch (reg_x->type) {
@@ -1323,11 +1427,14 @@ static int sigma_helper_1(int weight) {
             x = (vartype_real *) new_real(0);
             if (x == NULL)
                 return ERR_INSUFFICIENT_MEMORY;
-            for (i = 0; i < rm->rows; i++)
-                x->x = sigma_helper_2(sigmaregs,
-                                      rm->array->data[i * 2],
-                                      rm->array->data[i * 2 + 1],
-                                      weight);
+            if (sigma_bulk(sigmaregs, rm, weight))
+                x->x = sigmaregs[5];
+            else
+                for (i = 0; i < rm->rows; i++)
+                    x->x = sigma_helper_2(sigmaregs,
+                                          rm->array->data[i * 2],
+                                          rm->array->data[i * 2 + 1],
+                                          weight);
             free_vartype(reg_lastx);
             reg_lastx = reg_x;
             reg_x = (vartype *) x;
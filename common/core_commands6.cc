@@ -636,6 +636,16 @@ static int mappable_sqrt_r(phloat x, phloat *y) {
     }
 }
 
+static int bulk_sqrt_r(const phloat *x, phloat *y, int4 n) {
+    int4 i;
+    for (i = 0; i < n; i++)
+        if (x[i] < 0)
+            return ERR_INVALID_DATA;
+    for (i = 0; i < n; i++)
+        y[i] = sqrt(x[i]);
+    return ERR_NONE;
+}
+
 static int mappable_sqrt_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
     if (xre == 0 && xim == 0) {
         *yre = 0;
@@ -673,22 +683,18 @@ static int mappable_sqrt_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
 int docmd_sqrt(arg_struct *arg) {
     if (reg_x->type == TYPE_REAL) {
         phloat x = ((vartype_real *) reg_x)->x;
-        vartype *v;
         if (x < 0) {
             if (flags.f.real_result_only)
                 return ERR_INVALID_DATA;
-            v = new_complex(0, sqrt(-x));
+            return unary_complex_result(0, sqrt(-x));
         } else
-            v = new_real(sqrt(x));
-        if (v == NULL)
-            return ERR_INSUFFICIENT_MEMORY;
-        unary_result(v);
-        return ERR_NONE;
+            return unary_real_result(sqrt(x));
     } else if (reg_x->type == TYPE_STRING) {
         return ERR_ALPHA_DATA_IS_INVALID;
     } else {
         vartype *v;
-        int err = map_unary(reg_x, &v, mappable_sqrt_r, mappable_sqrt_c);
+        int err = map_unary(reg_x, &v, mappable_sqrt_r, mappable_sqrt_c,
+                            bulk_sqrt_r);
         if (err != ERR_NONE)
             return err;
         unary_result(v);
@@ -709,6 +715,12 @@ static int mappable_square_r(phloat x, phloat *y) {
     return ERR_NONE;
 }
 
+static int bulk_square_r(const phloat *x, phloat *y, int4 n) {
+    for (int4 i = 0; i < n; i++)
+        y[i] = x[i] * x[i];
+    return ERR_NONE;
+}
+
 static int mappable_square_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
     phloat rre = xre * xre - xim * xim;
     phloat rim = 2 * xre * xim;
@@ -731,11 +743,18 @@ static int mappable_square_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
 }
 
 int docmd_square(arg_struct *arg) {
-    if (reg_x->type == TYPE_STRING)
+    if (reg_x->type == TYPE_REAL) {
+        phloat r;
+        int err = mappable_square_r(((vartype_real *) reg_x)->x, &r);
+        if (err == ERR_NONE)
+            err = unary_real_result(r);
+        return err;
+    } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else {
         vartype *v;
-        int err = map_unary(reg_x, &v, mappable_square_r, mappable_square_c);
+        int err = map_unary(reg_x, &v, mappable_square_r, mappable_square_c,
+                            bulk_square_r);
         if (err == ERR_NONE)
             unary_result(v);
         return err;
@@ -776,7 +795,13 @@ static int mappable_inv_c(phloat xre, phloat xim, phloat *yre, phloat *yim) {
 }
 
 int docmd_inv(arg_struct *arg) {
-    if (reg_x->type == TYPE_STRING)
+    if (reg_x->type == TYPE_REAL) {
+        phloat r;
+        int err = mappable_inv_r(((vartype_real *) reg_x)->x, &r);
+        if (err == ERR_NONE)
+            err = unary_real_result(r);
+        return err;
+    } else if (reg_x->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else {
         vartype *v;
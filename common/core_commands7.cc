@@ -714,7 +714,7 @@ int docmd_ymd(arg_struct *arg) {
 
 #ifdef FREE42_FPTEST
 
-static int tests_lineno;
+static CORE_THREAD int tests_lineno;
 extern const char *readtest_lines[];
 
 extern "C" {
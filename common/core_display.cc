@@ -524,25 +524,25 @@ static char smallchars_map[128] =
 
 
 
-static char display[272];
+static CORE_THREAD char display[272];
 
-static int is_dirty = 0;
-static int dirty_top, dirty_left, dirty_bottom, dirty_right;
+static CORE_THREAD int is_dirty = 0;
+static CORE_THREAD int dirty_top, dirty_left, dirty_bottom, dirty_right;
 
-static int catalogmenu_section[5];
-static int catalogmenu_rows[5];
-static int catalogmenu_row[5];
-static int catalogmenu_item[5][6];
+static CORE_THREAD int catalogmenu_section[5];
+static CORE_THREAD int catalogmenu_rows[5];
+static CORE_THREAD int catalogmenu_row[5];
+static CORE_THREAD int catalogmenu_item[5][6];
 
-static int custommenu_length[3][6];
-static char custommenu_label[3][6][7];
+static CORE_THREAD int custommenu_length[3][6];
+static CORE_THREAD char custommenu_label[3][6][7];
 
-static arg_struct progmenu_arg[9];
-static int progmenu_is_gto[9];
-static int progmenu_length[6];
-static char progmenu_label[6][7];
+static CORE_THREAD arg_struct progmenu_arg[9];
+static CORE_THREAD int progmenu_is_gto[9];
+static CORE_THREAD int progmenu_length[6];
+static CORE_THREAD char progmenu_label[6][7];
 
-static int appmenu_exitcallback;
+static CORE_THREAD int appmenu_exitcallback;
 
 
 /*******************************/
@@ -784,7 +784,7 @@ void draw_pattern(phloat dx, phloat dy, const char *pattern, int pattern_width){
 }
 
 void fly_goose() {
-    static uint4 lastgoosetime = 0;
+    static CORE_THREAD uint4 lastgoosetime = 0;
     uint4 goosetime = shell_milliseconds();
     if (goosetime < lastgoosetime)
         // shell_millisends() wrapped around
@@ -2214,7 +2214,7 @@ typedef struct {
     int normal;
 } prp_data_struct;
 
-static prp_data_struct *prp_data;
+static CORE_THREAD prp_data_struct *prp_data;
 static int print_program_worker(int interrupted);
 
 int print_program(int prgm_index, int4 pc, int4 lines, int normal) {
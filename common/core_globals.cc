@@ -40,7 +40,7 @@
 // File used for reading and writing the state file, and for importing and
 // exporting programs. Since only one of these operations can be active at one
 // time, having one FILE pointer for all of them is sufficient.
-FILE *gfile = NULL;
+CORE_THREAD FILE *gfile = NULL;
 
 error_spec errors[] = {
     { /* NONE */                   NULL,                       0 },
@@ -573,126 +573,126 @@ menu_spec menus[] = {
 #define LABELS_INCREMENT 10
 
 /* Registers */
-vartype *reg_x = NULL;
-vartype *reg_y = NULL;
-vartype *reg_z = NULL;
-vartype *reg_t = NULL;
-vartype *reg_lastx = NULL;
-int reg_alpha_length = 0;
-char reg_alpha[44];
+CORE_THREAD vartype *reg_x = NULL;
+CORE_THREAD vartype *reg_y = NULL;
+CORE_THREAD vartype *reg_z = NULL;
+CORE_THREAD vartype *reg_t = NULL;
+CORE_THREAD vartype *reg_lastx = NULL;
+CORE_THREAD int reg_alpha_length = 0;
+CORE_THREAD char reg_alpha[44];
 
 /* Flags */
-flags_struct flags;
+CORE_THREAD flags_struct flags;
 
 /* Variables */
-int vars_capacity = 0;
-int vars_count = 0;
-var_struct *vars = NULL;
+CORE_THREAD int vars_capacity = 0;
+CORE_THREAD int vars_count = 0;
+CORE_THREAD var_struct *vars = NULL;
 
 /* Programs */
-int prgms_capacity = 0;
-int prgms_count = 0;
-prgm_struct *prgms = NULL;
-int labels_capacity = 0;
-int labels_count = 0;
-label_struct *labels = NULL;
-
-int current_prgm = -1;
-int4 pc;
-int prgm_highlight_row = 0;
-
-int varmenu_length;
-char varmenu[7];
-int varmenu_rows;
-int varmenu_row;
-int varmenu_labellength[6];
-char varmenu_labeltext[6][7];
-int varmenu_role;
-
-bool mode_clall;
-int (*mode_interruptible)(int) = NULL;
-bool mode_stoppable;
-bool mode_command_entry;
-bool mode_number_entry;
-bool mode_alpha_entry;
-bool mode_shift;
-int mode_appmenu;
-int mode_plainmenu;
-bool mode_plainmenu_sticky;
-int mode_transientmenu;
-int mode_alphamenu;
-int mode_commandmenu;
-bool mode_running;
-bool mode_getkey;
-bool mode_pause = false;
-bool mode_disable_stack_lift; /* transient */
-bool mode_varmenu;
-bool mode_updown;
-int4 mode_sigma_reg;
-int mode_goose;
-bool mode_time_clktd;
-bool mode_time_clk24;
-int mode_wsize;
-
-phloat entered_number;
-int entered_string_length;
-char entered_string[15];
-
-int pending_command;
-arg_struct pending_command_arg;
-int xeq_invisible;
+CORE_THREAD int prgms_capacity = 0;
+CORE_THREAD int prgms_count = 0;
+CORE_THREAD prgm_struct *prgms = NULL;
+CORE_THREAD int labels_capacity = 0;
+CORE_THREAD int labels_count = 0;
+CORE_THREAD label_struct *labels = NULL;
+
+CORE_THREAD int current_prgm = -1;
+CORE_THREAD int4 pc;
+CORE_THREAD int prgm_highlight_row = 0;
+
+CORE_THREAD int varmenu_length;
+CORE_THREAD char varmenu[7];
+CORE_THREAD int varmenu_rows;
+CORE_THREAD int varmenu_row;
+CORE_THREAD int varmenu_labellength[6];
+CORE_THREAD char varmenu_labeltext[6][7];
+CORE_THREAD int varmenu_role;
+
+CORE_THREAD bool mode_clall;
+CORE_THREAD int (*mode_interruptible)(int) = NULL;
+CORE_THREAD bool mode_stoppable;
+CORE_THREAD bool mode_command_entry;
+CORE_THREAD bool mode_number_entry;
+CORE_THREAD bool mode_alpha_entry;
+CORE_THREAD bool mode_shift;
+CORE_THREAD int mode_appmenu;
+CORE_THREAD int mode_plainmenu;
+CORE_THREAD bool mode_plainmenu_sticky;
+CORE_THREAD int mode_transientmenu;
+CORE_THREAD int mode_alphamenu;
+CORE_THREAD int mode_commandmenu;
+CORE_THREAD bool mode_running;
+CORE_THREAD bool mode_getkey;
+CORE_THREAD bool mode_pause = false;
+CORE_THREAD bool mode_disable_stack_lift; /* transient */
+CORE_THREAD bool mode_varmenu;
+CORE_THREAD bool mode_updown;
+CORE_THREAD int4 mode_sigma_reg;
+CORE_THREAD int mode_goose;
+CORE_THREAD bool mode_time_clktd;
+CORE_THREAD bool mode_time_clk24;
+CORE_THREAD int mode_wsize;
+
+CORE_THREAD phloat entered_number;
+CORE_THREAD int entered_string_length;
+CORE_THREAD char entered_string[15];
+
+CORE_THREAD int pending_command;
+CORE_THREAD arg_struct pending_command_arg;
+CORE_THREAD int xeq_invisible;
 
 /* Multi-keystroke commands -- edit state */
 /* Relevant when mode_command_entry != 0 */
-int incomplete_command;
-int incomplete_ind;
-int incomplete_alpha;
-int incomplete_length;
-int incomplete_maxdigits;
-int incomplete_argtype;
-int incomplete_num;
-char incomplete_str[7];
-int4 incomplete_saved_pc;
-int4 incomplete_saved_highlight_row;
+CORE_THREAD int incomplete_command;
+CORE_THREAD int incomplete_ind;
+CORE_THREAD int incomplete_alpha;
+CORE_THREAD int incomplete_length;
+CORE_THREAD int incomplete_maxdigits;
+CORE_THREAD int incomplete_argtype;
+CORE_THREAD int incomplete_num;
+CORE_THREAD char incomplete_str[7];
+CORE_THREAD int4 incomplete_saved_pc;
+CORE_THREAD int4 incomplete_saved_highlight_row;
 
 /* Command line handling temporaries */
-char cmdline[100];
-int cmdline_length;
-int cmdline_row;
+CORE_THREAD char cmdline[100];
+CORE_THREAD int cmdline_length;
+CORE_THREAD int cmdline_row;
 
 /* Matrix editor / matrix indexing */
-int matedit_mode; /* 0=off, 1=index, 2=edit, 3=editn */
-char matedit_name[7];
-int matedit_length;
-vartype *matedit_x;
-int4 matedit_i;
-int4 matedit_j;
-int matedit_prev_appmenu;
+CORE_THREAD int matedit_mode; /* 0=off, 1=index, 2=edit, 3=editn */
+CORE_THREAD char matedit_name[7];
+CORE_THREAD int matedit_length;
+CORE_THREAD vartype *matedit_x;
+CORE_THREAD int4 matedit_i;
+CORE_THREAD int4 matedit_j;
+CORE_THREAD int matedit_prev_appmenu;
 
 /* INPUT */
-char input_name[11];
-int input_length;
-arg_struct input_arg;
+CORE_THREAD char input_name[11];
+CORE_THREAD int input_length;
+CORE_THREAD arg_struct input_arg;
 
 /* BASE application */
-int baseapp = 0;
+CORE_THREAD int baseapp = 0;
 
 /* Random number generator */
-int8 random_number_low, random_number_high;
+CORE_THREAD int8 random_number_low, random_number_high;
 
 /* NORM & TRACE mode: number waiting to be printed */
-int deferred_print = 0;
+CORE_THREAD int deferred_print = 0;
 
 /* Keystroke buffer - holds keystrokes received while
  * there is a program running.
  */
-int keybuf_head = 0;
-int keybuf_tail = 0;
-int keybuf[16];
+CORE_THREAD int keybuf_head = 0;
+CORE_THREAD int keybuf_tail = 0;
+CORE_THREAD int keybuf[16];
 
-int remove_program_catalog = 0;
+CORE_THREAD int remove_program_catalog = 0;
 
-int state_file_number_format;
+CORE_THREAD int state_file_number_format;
 
 /* No user interaction: we keep track of whether or not the user
  * has pressed any keys since powering up, and we don't allow
@@ -703,7 +703,7 @@ int state_file_number_format;
  *
  * from locking the user out.
  */
-bool no_keystrokes_yet;
+CORE_THREAD bool no_keystrokes_yet;
 
 
 /* Version number for the state file.
@@ -770,16 +770,17 @@ bool no_keystrokes_yet;
  * Version 29: 2.5.7  SOLVE: Tracking second best guess in order to be able to
  *                    report it accurately in Y, and to provide additional data
  *                    points for distinguishing between zeroes and poles.
+ * Version 30: 2.5.7  INTEG: Tanh-sinh quadrature state; SOLVE: Warm starts
  */
-#define FREE42_VERSION 29
+#define FREE42_VERSION 30
 
 
 /*******************/
 /* Private globals */
 /*******************/
 
-static bool state_bool_is_int;
-bool state_is_portable;
+static CORE_THREAD bool state_bool_is_int;
+CORE_THREAD bool state_is_portable;
 
 typedef struct {
     int4 prgm;
@@ -809,21 +810,21 @@ typedef struct {
  * be in sync, hence the need to track them separately.
  */
 #define MAX_RTN_LEVEL 1024
-static int rtn_sp = 0;
-static int rtn_stack_capacity = 0;
-static rtn_stack_entry *rtn_stack = NULL;
-static int rtn_level = 0;
-static bool rtn_level_0_has_matrix_entry;
-static int rtn_stop_level = -1;
-static bool rtn_solve_active = false;
-static bool rtn_integ_active = false;
+static CORE_THREAD int rtn_sp = 0;
+static CORE_THREAD int rtn_stack_capacity = 0;
+static CORE_THREAD rtn_stack_entry *rtn_stack = NULL;
+static CORE_THREAD int rtn_level = 0;
+static CORE_THREAD bool rtn_level_0_has_matrix_entry;
+static CORE_THREAD int rtn_stop_level = -1;
+static CORE_THREAD bool rtn_solve_active = false;
+static CORE_THREAD bool rtn_integ_active = false;
 
 #ifdef IPHONE
 /* For iPhone, we disable OFF by default, to satisfy App Store
  * policy, but we allow users to enable it using a magic value
  * in the X register. This flag determines OFF behavior.
  */
-bool off_enable_flag = false;
+CORE_THREAD bool off_enable_flag = false;
 #endif
 
 typedef struct {
@@ -832,9 +833,39 @@ typedef struct {
     int4 columns;
 } matrix_persister;
 
-static int array_count;
-static int array_list_capacity;
-static void **array_list;
+static CORE_THREAD int array_count;
+static CORE_THREAD int array_list_capacity;
+static CORE_THREAD void **array_list;
+
+/* Hash index over labels[], used by find_global_label(). The nodes don't
+ * hold label indices, since inserting or deleting one label would shift the
+ * indices of all the labels after it; instead, they hold the program index
+ * and the label's ordinal within that program. That way, a change to one
+ * program only touches that program's nodes. Chains are sorted by program
+ * and ordinal, in descending order, so the first match is the last
+ * definition of a label, as with the linear search this replaces. Unused
+ * nodes are kept on a free list, linked through 'next'.
+ * END is stored in labels[] as a label with an empty name. Those are left
+ * out of the index: they would all land in one chain, with one node per
+ * program, and every per-program update would have to walk it. The only
+ * lookup that matches an empty name finds the final .END., which is always
+ * the last entry in labels[].
+ * When label_hash_size is 0, there is no index (because we ran out of
+ * memory), and lookup_label() falls back on linear search.
+ */
+typedef struct {
+    unsigned char length;
+    char name[7];
+    int prgm;
+    int ordinal;
+    int next;
+} label_node;
+
+static CORE_THREAD int label_hash_size = 0;
+static CORE_THREAD int *label_hash_heads = NULL;
+static CORE_THREAD int label_nodes_capacity = 0;
+static CORE_THREAD label_node *label_nodes = NULL;
+static CORE_THREAD int label_nodes_free = -1;
 
 
 static bool array_list_grow();
@@ -842,7 +873,19 @@ static int array_list_search(void *array);
 static bool persist_vartype(vartype *v);
 static bool unpersist_vartype(vartype **v, bool padded);
 static void update_label_table(int prgm, int4 pc, int inserted);
+static void rescan_prgm_labels(int prgm_index);
+static void shift_label_prgms(int prgm_index, int delta);
+static void rebuild_label_hash();
+static void label_hash_unlink(int first, int last);
+static void label_hash_link(int first, int last);
+static void label_hash_shift_prgms(int prgm_index, int delta);
+static void label_hash_fit();
+static int label_prgm_start(int prgm_index);
+static int lookup_label(const char *name, int namelen);
 static void invalidate_lclbls(int prgm_index, bool force);
+static void store_lclbl_target(prgm_struct *prgm, int4 orig_pc, int4 target_pc);
+static void discard_lclbl_index(int prgm_index);
+static void update_lclbl_index(int prgm_index, int4 pc, int inserted);
 static int pc_line_convert(int4 loc, int loc_is_pc);
 static bool convert_programs(bool *clear_stack);
 #ifdef BCD_MATH
@@ -987,7 +1030,7 @@ struct fake_bcd {
 // should then clean up what has already been read, rewind the state file,
 // and try again in mode 2.
 
-int bug_mode;
+CORE_THREAD int bug_mode;
 
 static bool unpersist_vartype(vartype **v, bool padded) {
     if (state_is_portable) {
@@ -1562,7 +1605,7 @@ static bool persist_globals() {
     return ret;
 }
 
-static bool suppress_varmenu_update = false;
+static CORE_THREAD bool suppress_varmenu_update = false;
 
 static bool unpersist_globals(int4 ver) {
     int i;
@@ -1696,6 +1739,7 @@ static bool unpersist_globals(int4 ver) {
                 goto done;
             }
         vars_capacity = vars_count;
+        invalidate_var_index();
 
         // Purging zero-length var that may have been created by buggy INTEG
         purge_var("", 0);
@@ -1734,6 +1778,8 @@ static bool unpersist_globals(int4 ver) {
             prgms[i].capacity = prgms[i].size;
             prgms[i].text = (unsigned char *) malloc(prgms[i].size);
             // TODO - handle memory allocation failure
+            prgms[i].insns = NULL;
+            prgms[i].lclbls = NULL;
         }
         for (i = 0; i < prgms_count; i++) {
             if (fread(prgms[i].text, 1, prgms[i].size, gfile)
@@ -1791,6 +1837,7 @@ static bool unpersist_globals(int4 ver) {
             }
         }
         vars_capacity = vars_count;
+        invalidate_var_index();
     }
     
     if (!read_int(&varmenu_length)) {
@@ -1937,9 +1984,12 @@ static bool unpersist_globals(int4 ver) {
 void clear_all_prgms() {
     if (prgms != NULL) {
         int i;
-        for (i = 0; i < prgms_count; i++)
+        for (i = 0; i < prgms_count; i++) {
             if (prgms[i].text != NULL)
                 free(prgms[i].text);
+            discard_decoded_prgm(i);
+            discard_lclbl_index(i);
+        }
         free(prgms);
     }
     prgms = NULL;
@@ -1950,6 +2000,7 @@ void clear_all_prgms() {
     labels = NULL;
     labels_capacity = 0;
     labels_count = 0;
+    rebuild_label_hash();
 }
 
 int clear_prgm(const arg_struct *arg) {
@@ -1962,13 +2013,9 @@ int clear_prgm(const arg_struct *arg) {
                 return ERR_INTERNAL_ERROR;
             prgm_index = current_prgm;
         } else {
-            int i;
-            for (i = labels_count - 1; i >= 0; i--)
-                if (string_equals(arg->val.text, arg->length,
-                                 labels[i].name, labels[i].length))
-                    goto found;
-            return ERR_LABEL_NOT_FOUND;
-            found:
+            int i = lookup_label(arg->val.text, arg->length);
+            if (i == -1)
+                return ERR_LABEL_NOT_FOUND;
             prgm_index = labels[i].prgm;
         }
     }
@@ -1985,9 +2032,13 @@ int clear_prgm_by_index(int prgm_index) {
     else if (current_prgm > prgm_index)
         current_prgm--;
     free(prgms[prgm_index].text);
+    discard_decoded_prgm(prgm_index);
+    discard_lclbl_index(prgm_index);
     for (i = prgm_index; i < prgms_count - 1; i++)
         prgms[i] = prgms[i + 1];
     prgms_count--;
+    label_hash_unlink(label_prgm_start(prgm_index),
+                      label_prgm_start(prgm_index + 1));
     i = j = 0;
     while (j < labels_count) {
         if (j > i)
@@ -2000,6 +2051,8 @@ int clear_prgm_by_index(int prgm_index) {
             i++;
     }
     labels_count = i;
+    label_hash_shift_prgms(prgm_index + 1, -1);
+    label_hash_fit();
     if (prgms_count == 0 || prgm_index == prgms_count) {
         int saved_prgm = current_prgm;
         int saved_pc = pc;
@@ -2033,6 +2086,8 @@ void clear_prgm_lines(int4 count) {
     prgms[current_prgm].size -= deleted;
     pc = frompc;
 
+    int first = label_prgm_start(current_prgm);
+    label_hash_unlink(first, label_prgm_start(current_prgm + 1));
     i = j = 0;
     while (j < labels_count) {
         if (j > i)
@@ -2049,7 +2104,10 @@ void clear_prgm_lines(int4 count) {
             i++;
     }
     labels_count = i;
+    label_hash_link(first, label_prgm_start(current_prgm + 1));
+    label_hash_fit();
 
+    discard_lclbl_index(current_prgm);
     invalidate_lclbls(current_prgm, false);
     clear_all_rtns();
 }
@@ -2084,6 +2142,8 @@ void goto_dot_dot(bool force_new) {
     prgms[current_prgm].size = 0;
     prgms[current_prgm].lclbl_invalid = 1;
     prgms[current_prgm].text = NULL;
+    prgms[current_prgm].insns = NULL;
+    prgms[current_prgm].lclbls = NULL;
     command = CMD_END;
     arg.type = ARGTYPE_NONE;
     store_command(0, command, &arg);
@@ -2232,49 +2292,147 @@ void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target){
     if (find_target) {
         target_pc = find_local_label(arg);
         arg->target = target_pc;
-        for (i = 5; i >= 2; i--) {
-            prgm->text[orig_pc + i] = target_pc;
-            target_pc >>= 8;
+        store_lclbl_target(prgm, orig_pc, target_pc);
+    }
+}
+
+static void store_lclbl_target(prgm_struct *prgm, int4 orig_pc, int4 target_pc) {
+    for (int i = 5; i >= 2; i--) {
+        prgm->text[orig_pc + i] = target_pc;
+        target_pc >>= 8;
+    }
+    prgm->lclbl_invalid = 0;
+}
+
+static bool is_local_branch(int command, int argtype) {
+    return (command == CMD_GTO || command == CMD_XEQ)
+            && (argtype == ARGTYPE_NUM || argtype == ARGTYPE_STK
+                                       || argtype == ARGTYPE_LCLBL);
+}
+
+static bool decode_current_prgm() {
+    prgm_struct *prgm = prgms + current_prgm;
+    int4 count = 0;
+    int4 pc2 = 0;
+    while (pc2 < prgm->size) {
+        pc2 += get_command_length(current_prgm, pc2);
+        count++;
+    }
+    insn_struct *insns = (insn_struct *) malloc(count * sizeof(insn_struct));
+    if (insns == NULL)
+        return false;
+    pc2 = 0;
+    for (int4 i = 0; i < count; i++) {
+        insn_struct *insn = insns + i;
+        insn->pc = pc2;
+        get_next_command(&pc2, &insn->cmd, &insn->arg, 0);
+        if (is_local_branch(insn->cmd, insn->arg.type)) {
+            /* Copy the cached target, which may still be -1 ('unknown');
+             * get_next_decoded_command() resolves those lazily.
+             */
+            int4 target_pc = 0;
+            for (int j = 2; j < 6; j++)
+                target_pc = (target_pc << 8) | prgm->text[insn->pc + j];
+            insn->arg.target = target_pc;
         }
-        prgm->lclbl_invalid = 0;
+        insn->next_pc = pc2;
     }
+    prgm->insns = insns;
+    prgm->insns_count = count;
+    prgm->insns_next = 0;
+    return true;
 }
 
-void rebuild_label_table() {
-    /* TODO -- this is *not* efficient; inserting and deleting ENDs and
-     * global LBLs should not cause every single program to get rescanned!
-     * But, I don't feel like dealing with that at the moment, so just
-     * this ugly brute force approach for now.
+void get_next_decoded_command(int4 *pc, int *command, arg_struct *arg) {
+    /* Equivalent to get_next_command(pc, command, arg, 1), but working
+     * from the current program's decoded instruction cache.
      */
-    int prgm_index;
-    int4 pc;
-    labels_count = 0;
-    for (prgm_index = 0; prgm_index < prgms_count; prgm_index++) {
-        prgm_struct *prgm = prgms + prgm_index;
-        pc = 0;
-        while (pc < prgm->size) {
-            int command = prgm->text[pc];
-            int argtype = prgm->text[pc + 1];
-            command |= (argtype & 240) << 4;
-            argtype &= 15;
+    prgm_struct *prgm = prgms + current_prgm;
+    if (prgm->insns == NULL && !decode_current_prgm()) {
+        get_next_command(pc, command, arg, 1);
+        return;
+    }
 
-            if (command == CMD_END
-                        || (command == CMD_LBL && argtype == ARGTYPE_STR)) {
-                label_struct *newlabel;
-                if (labels_count == labels_capacity) {
-                    label_struct *newlabels;
-                    int i;
-                    labels_capacity += 50;
-                    newlabels = (label_struct *)
-                                malloc(labels_capacity * sizeof(label_struct));
-                    // TODO - handle memory allocation failure
-                    for (i = 0; i < labels_count; i++)
-                        newlabels[i] = labels[i];
-                    if (labels != NULL)
-                        free(labels);
-                    labels = newlabels;
-                }
-                newlabel = labels + labels_count++;
+    int4 i = prgm->insns_next;
+    if (i >= prgm->insns_count || prgm->insns[i].pc != *pc) {
+        /* Not simply the next line; this happens after branches and
+         * returns, so look up the instruction by its pc.
+         */
+        int4 lo = 0, hi = prgm->insns_count - 1;
+        i = -1;
+        while (lo <= hi) {
+            int4 mid = (lo + hi) / 2;
+            int4 mid_pc = prgm->insns[mid].pc;
+            if (mid_pc == *pc) {
+                i = mid;
+                break;
+            } else if (mid_pc < *pc)
+                lo = mid + 1;
+            else
+                hi = mid - 1;
+        }
+        if (i == -1) {
+            /* Not on an instruction boundary; shouldn't happen, but let
+             * get_next_command() deal with it the way it always has.
+             */
+            get_next_command(pc, command, arg, 1);
+            return;
+        }
+    }
+
+    insn_struct *insn = prgm->insns + i;
+    *pc = insn->next_pc;
+    *command = insn->cmd;
+    if (insn->arg.target == -1 && is_local_branch(insn->cmd, insn->arg.type)) {
+        int4 target_pc = find_local_label(&insn->arg);
+        insn->arg.target = target_pc;
+        store_lclbl_target(prgm, insn->pc, target_pc);
+    }
+    /* Copy, since command handlers are allowed to modify their argument */
+    *arg = insn->arg;
+    prgm->insns_next = i + 1;
+}
+
+void discard_decoded_prgm(int prgm_index) {
+    prgm_struct *prgm = prgms + prgm_index;
+    if (prgm->insns != NULL) {
+        free(prgm->insns);
+        prgm->insns = NULL;
+    }
+}
+
+static bool grow_labels(int needed) {
+    if (needed <= labels_capacity)
+        return true;
+    int new_capacity = labels_capacity + 50;
+    if (new_capacity < needed)
+        new_capacity = needed + 50;
+    label_struct *newlabels = (label_struct *)
+                realloc(labels, new_capacity * sizeof(label_struct));
+    if (newlabels == NULL)
+        return false;
+    labels = newlabels;
+    labels_capacity = new_capacity;
+    return true;
+}
+
+static int scan_prgm_labels(int prgm_index, label_struct *dest) {
+    /* Finds the ENDs and global LBLs in one program. If 'dest' is NULL,
+     * they're only counted.
+     */
+    prgm_struct *prgm = prgms + prgm_index;
+    int4 pc = 0;
+    int n = 0;
+    while (pc < prgm->size) {
+        int command = prgm->text[pc];
+        int argtype = prgm->text[pc + 1];
+        command |= (argtype & 240) << 4;
+        argtype &= 15;
+
+        if (command == CMD_END
+                    || (command == CMD_LBL && argtype == ARGTYPE_STR)) {
+            if (dest != NULL) {
+                label_struct *newlabel = dest + n;
                 if (command == CMD_END)
                     newlabel->length = 0;
                 else {
@@ -2286,11 +2444,249 @@ void rebuild_label_table() {
                 newlabel->prgm = prgm_index;
                 newlabel->pc = pc;
             }
-            pc += get_command_length(prgm_index, pc);
+            n++;
+        }
+        pc += get_command_length(prgm_index, pc);
+    }
+    return n;
+}
+
+void rebuild_label_table() {
+    int prgm_index;
+    labels_count = 0;
+    for (prgm_index = 0; prgm_index < prgms_count; prgm_index++) {
+        int n = scan_prgm_labels(prgm_index, NULL);
+        if (!grow_labels(labels_count + n))
+            /* Out of memory; the labels of the remaining programs will be
+             * missing, but labels[] and the index are consistent.
+             */
+            break;
+        scan_prgm_labels(prgm_index, labels + labels_count);
+        labels_count += n;
+    }
+    rebuild_label_hash();
+}
+
+static void rescan_prgm_labels(int prgm_index) {
+    /* Replaces the labels[] entries for one program, after an END or global
+     * LBL was inserted into or deleted from it. The labels for all other
+     * programs stay as they are; they only move within the array.
+     */
+    int first, last, i;
+    first = label_prgm_start(prgm_index);
+    last = label_prgm_start(prgm_index + 1);
+    int n = scan_prgm_labels(prgm_index, NULL);
+    int delta = n - (last - first);
+    if (!grow_labels(labels_count + delta))
+        /* Can't happen: an edit adds at most one label, and store_command()
+         * reserves room for it before it changes the program. Leaving
+         * labels[] and the index alone at least keeps them consistent
+         * with each other.
+         */
+        return;
+    label_hash_unlink(first, last);
+    if (delta != 0) {
+        if (delta > 0)
+            for (i = labels_count - 1; i >= last; i--)
+                labels[i + delta] = labels[i];
+        else
+            for (i = last; i < labels_count; i++)
+                labels[i + delta] = labels[i];
+        labels_count += delta;
+    }
+    scan_prgm_labels(prgm_index, labels + first);
+    label_hash_link(first, first + n);
+    label_hash_fit();
+}
+
+static void shift_label_prgms(int prgm_index, int delta) {
+    /* Adjusts the program indexes in labels[] after a program was inserted
+     * or removed in front of 'prgm_index'.
+     */
+    for (int i = labels_count - 1; i >= 0; i--) {
+        if (labels[i].prgm < prgm_index)
+            break;
+        labels[i].prgm += delta;
+    }
+    label_hash_shift_prgms(prgm_index, delta);
+}
+
+static int label_prgm_start(int prgm_index) {
+    /* Returns the index of the first label of the given program, or of the
+     * first label of the programs after it, if it has none. labels[] is
+     * sorted by program.
+     */
+    int lo = 0, hi = labels_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (labels[mid].prgm < prgm_index)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static unsigned int label_hash(const char *name, int namelen) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < namelen; i++)
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    return h;
+}
+
+static void drop_label_hash() {
+    free(label_hash_heads);
+    label_hash_heads = NULL;
+    label_hash_size = 0;
+    free(label_nodes);
+    label_nodes = NULL;
+    label_nodes_capacity = 0;
+    label_nodes_free = -1;
+}
+
+static void label_hash_insert(int index, int ordinal) {
+    label_struct *l = labels + index;
+    if (l->length == 0)
+        return;
+    if (label_nodes_free == -1) {
+        int newcap = label_nodes_capacity == 0 ? 64 : label_nodes_capacity * 2;
+        label_node *newnodes = (label_node *)
+                        realloc(label_nodes, newcap * sizeof(label_node));
+        if (newnodes == NULL) {
+            /* lookup_label() will fall back on linear search */
+            drop_label_hash();
+            return;
+        }
+        for (int i = newcap - 1; i >= label_nodes_capacity; i--) {
+            newnodes[i].next = label_nodes_free;
+            label_nodes_free = i;
+        }
+        label_nodes = newnodes;
+        label_nodes_capacity = newcap;
+    }
+    int n = label_nodes_free;
+    label_node *node = label_nodes + n;
+    label_nodes_free = node->next;
+    node->length = l->length;
+    memcpy(node->name, l->name, l->length);
+    node->prgm = l->prgm;
+    node->ordinal = ordinal;
+    int *pp = label_hash_heads + (label_hash(l->name, l->length)
+                                                & (label_hash_size - 1));
+    while (*pp != -1) {
+        label_node *other = label_nodes + *pp;
+        if (other->prgm < node->prgm || (other->prgm == node->prgm
+                                    && other->ordinal < node->ordinal))
+            break;
+        pp = &other->next;
+    }
+    node->next = *pp;
+    *pp = n;
+}
+
+static void label_hash_unlink(int first, int last) {
+    /* Removes the nodes for labels[first..last), which must be all of one
+     * program's labels. Nodes are matched by program and name only, not by
+     * ordinal, because after shift_label_prgms(), two programs' labels may
+     * briefly share one program index, while their nodes still have the
+     * ordinals from before.
+     */
+    if (label_hash_size == 0)
+        return;
+    for (int i = first; i < last; i++) {
+        label_struct *l = labels + i;
+        if (l->length == 0)
+            continue;
+        int *pp = label_hash_heads + (label_hash(l->name, l->length)
+                                                & (label_hash_size - 1));
+        while (*pp != -1) {
+            label_node *node = label_nodes + *pp;
+            if (node->prgm == l->prgm && string_equals(node->name,
+                                    node->length, l->name, l->length)) {
+                int n = *pp;
+                *pp = node->next;
+                node->next = label_nodes_free;
+                label_nodes_free = n;
+                break;
+            }
+            pp = &node->next;
         }
     }
 }
 
+static void label_hash_link(int first, int last) {
+    /* Adds nodes for labels[first..last), which must be all of one
+     * program's labels.
+     */
+    for (int i = first; i < last && label_hash_size != 0; i++)
+        label_hash_insert(i, i - first);
+}
+
+static void label_hash_shift_prgms(int prgm_index, int delta) {
+    /* Since the shift applies to all programs from prgm_index up, the
+     * order of the chains doesn't change. Free nodes get shifted too, but
+     * that doesn't matter.
+     */
+    for (int i = 0; i < label_nodes_capacity; i++)
+        if (label_nodes[i].prgm >= prgm_index)
+            label_nodes[i].prgm += delta;
+}
+
+static void label_hash_fit() {
+    /* Keeps the load factor at or below 1/2, and retries building the
+     * index if we had to drop it earlier.
+     */
+    if (label_hash_size == 0 || labels_count * 2 > label_hash_size)
+        rebuild_label_hash();
+}
+
+static void rebuild_label_hash() {
+    int size = 64;
+    while (size < labels_count * 2)
+        size <<= 1;
+    if (size != label_hash_size) {
+        free(label_hash_heads);
+        label_hash_heads = (int *) malloc(size * sizeof(int));
+        if (label_hash_heads == NULL) {
+            drop_label_hash();
+            return;
+        }
+        label_hash_size = size;
+    }
+    for (int i = 0; i < label_hash_size; i++)
+        label_hash_heads[i] = -1;
+    label_nodes_free = -1;
+    for (int i = label_nodes_capacity - 1; i >= 0; i--) {
+        label_nodes[i].next = label_nodes_free;
+        label_nodes_free = i;
+    }
+    int first = 0;
+    for (int i = 0; i < labels_count && label_hash_size != 0; i++) {
+        if (i > 0 && labels[i].prgm != labels[i - 1].prgm)
+            first = i;
+        label_hash_insert(i, i - first);
+    }
+}
+
+static int lookup_label(const char *name, int namelen) {
+    /* Returns the index of the last label with the given name, or -1 */
+    int i;
+    if (label_hash_size == 0 || namelen == 0) {
+        for (i = labels_count - 1; i >= 0; i--)
+            if (string_equals(name, namelen, labels[i].name, labels[i].length))
+                return i;
+        return -1;
+    }
+    i = label_hash_heads[label_hash(name, namelen) & (label_hash_size - 1)];
+    while (i != -1) {
+        label_node *node = label_nodes + i;
+        if (string_equals(name, namelen, node->name, node->length))
+            return label_prgm_start(node->prgm) + node->ordinal;
+        i = node->next;
+    }
+    return -1;
+}
+
 static void update_label_table(int prgm, int4 pc, int inserted) {
     int i;
     for (i = 0; i < labels_count; i++) {
@@ -2303,6 +2699,10 @@ static void update_label_table(int prgm, int4 pc, int inserted) {
 
 static void invalidate_lclbls(int prgm_index, bool force) {
     prgm_struct *prgm = prgms + prgm_index;
+    /* This gets called after every change to the program text, so this is
+     * also where the decoded instruction cache is thrown away.
+     */
+    discard_decoded_prgm(prgm_index);
     if (force || !prgm->lclbl_invalid) {
         int4 pc2 = 0;
         while (pc2 < prgm->size) {
@@ -2359,21 +2759,26 @@ void delete_command(int4 pc) {
         for (pos = 0; pos < nextprgm->size; pos++)
             prgm->text[prgm->size++] = nextprgm->text[pos];
         free(nextprgm->text);
+        discard_decoded_prgm(current_prgm + 1);
+        discard_lclbl_index(current_prgm + 1);
+        discard_lclbl_index(current_prgm);
         for (pos = current_prgm + 1; pos < prgms_count - 1; pos++)
             prgms[pos] = prgms[pos + 1];
         prgms_count--;
-        rebuild_label_table();
+        shift_label_prgms(current_prgm + 1, -1);
+        rescan_prgm_labels(current_prgm);
         invalidate_lclbls(current_prgm, true);
         clear_all_rtns();
         draw_varmenu();
         return;
     }
 
+    update_lclbl_index(current_prgm, pc, -length);
     for (pos = pc; pos < prgm->size - length; pos++)
         prgm->text[pos] = prgm->text[pos + length];
     prgm->size -= length;
     if (command == CMD_LBL && argtype == ARGTYPE_STR)
-        rebuild_label_table();
+        rescan_prgm_labels(current_prgm);
     else
         update_label_table(current_prgm, pc, -length);
     invalidate_lclbls(current_prgm, false);
@@ -2418,6 +2823,16 @@ void store_command(int4 pc, int command, arg_struct *arg) {
         arg->type = ARGTYPE_STR;
     }
 
+    /* An END or a global LBL adds one entry to labels[]. Make sure there's
+     * room for it before we touch the program, so rescan_prgm_labels()
+     * can't fail.
+     */
+    if ((command == CMD_END || (command == CMD_LBL && arg->type == ARGTYPE_STR))
+            && !grow_labels(labels_count + 1)) {
+        display_error(ERR_INSUFFICIENT_MEMORY, 0);
+        return;
+    }
+
     buf[bufptr++] = command & 255;
     buf[bufptr++] = arg->type | ((command & ~255) >> 4);
 
@@ -2451,6 +2866,12 @@ void store_command(int4 pc, int command, arg_struct *arg) {
         new_prgm->capacity = (new_prgm->size + 511) & ~511;
         new_prgm->text = (unsigned char *) malloc(new_prgm->capacity);
         // TODO - handle memory allocation failure
+        /* This slot is either fresh or a copy of the next program's
+         * struct, so don't free what its insns pointer refers to.
+         */
+        new_prgm->insns = NULL;
+        new_prgm->lclbls = NULL;
+        discard_lclbl_index(current_prgm);
         for (i = pc; i < prgm->size; i++)
             new_prgm->text[i - pc] = prgm->text[i];
         current_prgm++;
@@ -2466,7 +2887,9 @@ void store_command(int4 pc, int command, arg_struct *arg) {
         if (flags.f.printer_exists && (flags.f.trace_print || flags.f.normal_print))
             print_program_line(current_prgm - 1, pc);
 
-        rebuild_label_table();
+        shift_label_prgms(current_prgm, 1);
+        rescan_prgm_labels(current_prgm - 1);
+        rescan_prgm_labels(current_prgm);
         invalidate_lclbls(current_prgm, true);
         invalidate_lclbls(current_prgm - 1, true);
         clear_all_rtns();
@@ -2537,12 +2960,13 @@ void store_command(int4 pc, int command, arg_struct *arg) {
     for (pos = 0; pos < bufptr; pos++)
         prgm->text[pc + pos] = buf[pos];
     prgm->size += bufptr;
+    update_lclbl_index(current_prgm, pc, bufptr);
     if (command != CMD_END && flags.f.printer_exists && (flags.f.trace_print || flags.f.normal_print))
         print_program_line(current_prgm, pc);
     
     if (command == CMD_END ||
             (command == CMD_LBL && arg->type == ARGTYPE_STR))
-        rebuild_label_table();
+        rescan_prgm_labels(current_prgm);
     else
         update_label_table(current_prgm, pc, bufptr);
     invalidate_lclbls(current_prgm, false);
@@ -2593,7 +3017,8 @@ int4 line2pc(int4 line) {
         return pc_line_convert(line, 0);
 }
 
-int4 find_local_label(const arg_struct *arg) {
+static int4 scan_for_local_label(const arg_struct *arg) {
+    /* Used when the label index can't be allocated */
     int4 orig_pc = pc;
     int4 search_pc;
     int wrapped = 0;
@@ -2658,25 +3083,165 @@ int4 find_local_label(const arg_struct *arg) {
     return -2;
 }
 
-int find_global_label(const arg_struct *arg, int *prgm, int4 *pc) {
-    int i;
-    const char *name = arg->val.text;
-    int namelen = arg->length;
-    for (i = labels_count - 1; i >= 0; i--) {
-        int j;
-        char *labelname;
-        if (labels[i].length != namelen)
-            continue;
-        labelname = labels[i].name;
-        for (j = 0; j < namelen; j++)
-            if (labelname[j] != name[j])
-                goto nomatch;
-        *prgm = labels[i].prgm;
-        *pc = labels[i].pc;
-        return 1;
-        nomatch:;
+static bool decode_lclbl(prgm_struct *prgm, int4 pc, lclbl_struct *lbl) {
+    /* Returns 'true' if the line at 'pc' is a local LBL */
+    int command = prgm->text[pc];
+    int argtype = prgm->text[pc + 1];
+    command |= (argtype & 240) << 4;
+    argtype &= 15;
+    if (command != CMD_LBL)
+        return false;
+    lbl->pc = pc;
+    lbl->type = argtype;
+    lbl->num = 0;
+    lbl->lclbl = 0;
+    if (argtype == ARGTYPE_NUM) {
+        unsigned char c;
+        int4 pos = pc + 2;
+        do {
+            c = prgm->text[pos++];
+            lbl->num = (lbl->num << 7) | (c & 127);
+        } while ((c & 128) == 0);
+    } else if (argtype == ARGTYPE_STK) {
+        switch (prgm->text[pc + 2]) {
+            case 'T': lbl->num = 112; break;
+            case 'Z': lbl->num = 113; break;
+            case 'Y': lbl->num = 114; break;
+            case 'X': lbl->num = 115; break;
+            case 'L': lbl->num = 116; break;
+        }
+    } else if (argtype == ARGTYPE_LCLBL)
+        lbl->lclbl = prgm->text[pc + 2];
+    else
+        return false;
+    return true;
+}
+
+static bool lclbl_matches(const lclbl_struct *lbl, const arg_struct *arg) {
+    switch (arg->type) {
+        case ARGTYPE_NUM:
+            return (lbl->type == ARGTYPE_NUM || lbl->type == ARGTYPE_STK)
+                    && lbl->num == arg->val.num;
+        case ARGTYPE_STK:
+            // Synthetic GTO ST T etc. goes to any synthetic LBL ST
+            return lbl->type == ARGTYPE_STK && arg->val.stk != 0;
+        case ARGTYPE_LCLBL:
+            return lbl->type == ARGTYPE_LCLBL && lbl->lclbl == arg->val.lclbl;
+        default:
+            return false;
     }
-    return 0;
+}
+
+static bool build_lclbl_index(int prgm_index) {
+    prgm_struct *prgm = prgms + prgm_index;
+    lclbl_struct lbl;
+    int4 pc2 = 0;
+    int4 count = 0;
+    while (pc2 < prgm->size) {
+        if (decode_lclbl(prgm, pc2, &lbl))
+            count++;
+        pc2 += get_command_length(prgm_index, pc2);
+    }
+    int4 capacity = count + 10;
+    prgm->lclbls = (lclbl_struct *) malloc(capacity * sizeof(lclbl_struct));
+    if (prgm->lclbls == NULL)
+        return false;
+    prgm->lclbls_capacity = capacity;
+    prgm->lclbls_count = 0;
+    pc2 = 0;
+    while (pc2 < prgm->size) {
+        if (decode_lclbl(prgm, pc2, &lbl))
+            prgm->lclbls[prgm->lclbls_count++] = lbl;
+        pc2 += get_command_length(prgm_index, pc2);
+    }
+    return true;
+}
+
+static void discard_lclbl_index(int prgm_index) {
+    prgm_struct *prgm = prgms + prgm_index;
+    if (prgm->lclbls != NULL) {
+        free(prgm->lclbls);
+        prgm->lclbls = NULL;
+    }
+}
+
+static void update_lclbl_index(int prgm_index, int4 pc, int inserted) {
+    /* Called by store_command() after inserting a line at 'pc', and by
+     * delete_command() before deleting the line at 'pc'.
+     */
+    prgm_struct *prgm = prgms + prgm_index;
+    if (prgm->lclbls == NULL)
+        return;
+    lclbl_struct *lbls = prgm->lclbls;
+    int4 n = prgm->lclbls_count;
+    int4 i = 0;
+    while (i < n && lbls[i].pc < pc)
+        i++;
+    lclbl_struct lbl;
+    if (inserted < 0 && i < n && lbls[i].pc == pc) {
+        for (int4 j = i; j < n - 1; j++)
+            lbls[j] = lbls[j + 1];
+        n--;
+    } else if (inserted > 0 && decode_lclbl(prgm, pc, &lbl)) {
+        if (n == prgm->lclbls_capacity) {
+            int4 newcapacity = prgm->lclbls_capacity + 10;
+            lclbl_struct *newlbls = (lclbl_struct *)
+                    realloc(lbls, newcapacity * sizeof(lclbl_struct));
+            if (newlbls == NULL) {
+                discard_lclbl_index(prgm_index);
+                return;
+            }
+            lbls = prgm->lclbls = newlbls;
+            prgm->lclbls_capacity = newcapacity;
+        }
+        for (int4 j = n; j > i; j--)
+            lbls[j] = lbls[j - 1];
+        lbls[i++] = lbl;
+        n++;
+    }
+    prgm->lclbls_count = n;
+    for (; i < n; i++)
+        lbls[i].pc += inserted;
+}
+
+int4 find_local_label(const arg_struct *arg) {
+    /* Finds the first matching label after 'pc', wrapping around to the
+     * start of the program if necessary.
+     */
+    int4 orig_pc = pc;
+    prgm_struct *prgm = prgms + current_prgm;
+
+    if (prgm->lclbls == NULL && !build_lclbl_index(current_prgm))
+        return scan_for_local_label(arg);
+    if (orig_pc == -1)
+        orig_pc = 0;
+
+    lclbl_struct *lbls = prgm->lclbls;
+    int4 n = prgm->lclbls_count;
+    int4 lo = 0, hi = n;
+    while (lo < hi) {
+        int4 mid = (lo + hi) / 2;
+        if (lbls[mid].pc < orig_pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (int4 i = lo; i < n; i++)
+        if (lclbl_matches(lbls + i, arg))
+            return lbls[i].pc;
+    for (int4 i = 0; i < lo; i++)
+        if (lclbl_matches(lbls + i, arg))
+            return lbls[i].pc;
+    return -2;
+}
+
+int find_global_label(const arg_struct *arg, int *prgm, int4 *pc) {
+    int i = lookup_label(arg->val.text, arg->length);
+    if (i == -1)
+        return 0;
+    *prgm = labels[i].prgm;
+    *pc = labels[i].pc;
+    return 1;
 }
 
 int push_rtn_addr(int prgm, int4 pc) {
@@ -2776,47 +3341,8 @@ bool should_i_stop_at_this_level() {
     return stop;
 }
 
-static void remove_locals() {
-    int last = -1;
-    for (int i = vars_count - 1; i >= 0; i--) {
-        if (vars[i].level == -1)
-            continue;
-        if (vars[i].level < rtn_level)
-            break;
-        if ((matedit_mode == 1 || matedit_mode == 3)
-                && string_equals(vars[i].name, vars[i].length, matedit_name, matedit_length)) {
-            if (matedit_mode == 3) {
-                set_appmenu_exitcallback(0);
-                set_menu(MENULEVEL_APP, MENU_NONE);
-            }
-            matedit_mode = 0;
-        }
-        if (vars[i].hiding) {
-            for (int j = i - 1; j >= 0; j--)
-                if (vars[j].hidden && string_equals(vars[i].name, vars[i].length, vars[j].name, vars[j].length)) {
-                    vars[j].hidden = false;
-                    break;
-                }
-        }
-        free_vartype(vars[i].value);
-        vars[i].length = 100;
-        last = i;
-    }
-    if (last == -1)
-        return;
-    int from = last;
-    int to = last;
-    while (from < vars_count) {
-        if (vars[from].length != 100)
-            vars[to++] = vars[from];
-        from++;
-    }
-    vars_count -= from - to;
-    update_catalog();
-}
-
 void pop_rtn_addr(int *prgm, int4 *pc, bool *stop) {
-    remove_locals();
+    remove_local_vars(rtn_level);
     if (rtn_level == 0) {
         *prgm = -1;
         *pc = -1;
@@ -3580,6 +4106,7 @@ bool load_state(int4 ver, bool *clear, bool *too_new) {
 void save_state() {
     if (!write_int4(FREE42_MAGIC) || !write_int4(FREE42_VERSION))
         return;
+    finish_pending_copy();
 
     // Write app version and platform, for troubleshooting purposes
     const char *platform = shell_platform();
@@ -3723,6 +4250,7 @@ void hard_reset(int reason) {
         labels_capacity = 0;
         labels_count = 0;
     }
+    rebuild_label_hash();
     goto_dot_dot(false);
 
     pending_command = CMD_NONE;
@@ -27,7 +27,7 @@
 #include "core_phloat.h"
 #include "core_tables.h"
 
-extern FILE *gfile;
+extern CORE_THREAD FILE *gfile;
 
 /**********/
 /* Errors */
@@ -311,13 +311,13 @@ typedef union {
 /******************/
 
 /* Registers */
-extern vartype *reg_x;
-extern vartype *reg_y;
-extern vartype *reg_z;
-extern vartype *reg_t;
-extern vartype *reg_lastx;
-extern int reg_alpha_length;
-extern char reg_alpha[44];
+extern CORE_THREAD vartype *reg_x;
+extern CORE_THREAD vartype *reg_y;
+extern CORE_THREAD vartype *reg_z;
+extern CORE_THREAD vartype *reg_t;
+extern CORE_THREAD vartype *reg_lastx;
+extern CORE_THREAD int reg_alpha_length;
+extern CORE_THREAD char reg_alpha[44];
 
 /* FLAGS
  * Note: flags whose names start with VIRTUAL_ are named here for reference
@@ -407,7 +407,7 @@ typedef union {
         char f95; char f96; char f97; char f98; char f99;
     } f;
 } flags_struct;
-extern flags_struct flags;
+extern CORE_THREAD flags_struct flags;
 
 /* Variables */
 typedef struct {
@@ -418,16 +418,47 @@ typedef struct {
     bool hiding;
     vartype *value;
 } var_struct;
-extern int vars_capacity;
-extern int vars_count;
-extern var_struct *vars;
+extern CORE_THREAD int vars_capacity;
+extern CORE_THREAD int vars_count;
+extern CORE_THREAD var_struct *vars;
 
 /* Programs */
+
+/* Decoded instruction, as returned by get_next_command(). Running programs
+ * execute from an array of these, built on demand by
+ * get_next_decoded_command(), so that the variable-length encoding in 'text'
+ * only has to be parsed once per program edit.
+ */
+typedef struct {
+    int4 pc;
+    int4 next_pc;
+    int cmd;
+    arg_struct arg;
+} insn_struct;
+
+/* Local label, as found by find_local_label(). LBL ST T through LBL ST L
+ * have 'num' set to 112 through 116, so they can be found by GTO 112 etc.
+ */
+typedef struct {
+    int4 pc;
+    int4 num;
+    char type; /* ARGTYPE_NUM, ARGTYPE_STK, or ARGTYPE_LCLBL */
+    char lclbl;
+} lclbl_struct;
+
 typedef struct {
     int4 capacity;
     int4 size;
     int lclbl_invalid;
     unsigned char *text;
+    /* Decoded instruction cache; NULL when not built yet */
+    int4 insns_count;
+    int4 insns_next;
+    insn_struct *insns;
+    /* Local labels, in pc order; NULL when not built yet */
+    int4 lclbls_count;
+    int4 lclbls_capacity;
+    lclbl_struct *lclbls;
 } prgm_struct;
 typedef struct {
     int4 capacity;
@@ -435,81 +466,81 @@ typedef struct {
     int lclbl_invalid;
     int4 text;
 } prgm_struct_32bit;
-extern int prgms_capacity;
-extern int prgms_count;
-extern prgm_struct *prgms;
+extern CORE_THREAD int prgms_capacity;
+extern CORE_THREAD int prgms_count;
+extern CORE_THREAD prgm_struct *prgms;
 typedef struct {
     unsigned char length;
     char name[7];
     int prgm;
     int4 pc;
 } label_struct;
-extern int labels_capacity;
-extern int labels_count;
-extern label_struct *labels;
+extern CORE_THREAD int labels_capacity;
+extern CORE_THREAD int labels_count;
+extern CORE_THREAD label_struct *labels;
 
-extern int current_prgm;
-extern int4 pc;
-extern int prgm_highlight_row;
+extern CORE_THREAD int current_prgm;
+extern CORE_THREAD int4 pc;
+extern CORE_THREAD int prgm_highlight_row;
 
-extern int varmenu_length;
-extern char varmenu[7];
-extern int varmenu_rows;
-extern int varmenu_row;
-extern int varmenu_labellength[6];
-extern char varmenu_labeltext[6][7];
-extern int varmenu_role;
+extern CORE_THREAD int varmenu_length;
+extern CORE_THREAD char varmenu[7];
+extern CORE_THREAD int varmenu_rows;
+extern CORE_THREAD int varmenu_row;
+extern CORE_THREAD int varmenu_labellength[6];
+extern CORE_THREAD char varmenu_labeltext[6][7];
+extern CORE_THREAD int varmenu_role;
 
 
 /****************/
 /* More globals */
 /****************/
 
-extern bool mode_clall;
-extern int (*mode_interruptible)(int);
-extern bool mode_stoppable;
-extern bool mode_command_entry;
-extern bool mode_number_entry;
-extern bool mode_alpha_entry;
-extern bool mode_shift;
-extern int mode_appmenu;
-extern int mode_plainmenu;
-extern bool mode_plainmenu_sticky;
-extern int mode_transientmenu;
-extern int mode_alphamenu;
-extern int mode_commandmenu;
-extern bool mode_running;
-extern bool mode_getkey;
-extern bool mode_pause;
-extern bool mode_disable_stack_lift;
-extern bool mode_varmenu;
-extern bool mode_updown;
-extern int4 mode_sigma_reg;
-extern int mode_goose;
-extern bool mode_time_clktd;
-extern bool mode_time_clk24;
-extern int mode_wsize;
-
-extern phloat entered_number;
-extern int entered_string_length;
-extern char entered_string[15];
-
-extern int pending_command;
-extern arg_struct pending_command_arg;
-extern int xeq_invisible;
+extern CORE_THREAD bool mode_clall;
+extern CORE_THREAD int (*mode_interruptible)(int);
+extern CORE_THREAD bool mode_stoppable;
+extern CORE_THREAD bool mode_command_entry;
+extern CORE_THREAD bool mode_number_entry;
+extern CORE_THREAD bool mode_alpha_entry;
+extern CORE_THREAD bool mode_shift;
+extern CORE_THREAD int mode_appmenu;
+extern CORE_THREAD int mode_plainmenu;
+extern CORE_THREAD bool mode_plainmenu_sticky;
+extern CORE_THREAD int mode_transientmenu;
+extern CORE_THREAD int mode_alphamenu;
+extern CORE_THREAD int mode_commandmenu;
+extern CORE_THREAD bool mode_running;
+extern CORE_THREAD bool mode_getkey;
+extern CORE_THREAD bool mode_pause;
+extern CORE_THREAD bool mode_disable_stack_lift;
+extern CORE_THREAD bool mode_varmenu;
+extern CORE_THREAD bool mode_updown;
+extern CORE_THREAD int4 mode_sigma_reg;
+extern CORE_THREAD int mode_goose;
+extern CORE_THREAD bool mode_time_clktd;
+extern CORE_THREAD bool mode_time_clk24;
+extern CORE_THREAD int mode_wsize;
+
+extern CORE_THREAD phloat entered_number;
+extern CORE_THREAD int entered_string_length;
+extern CORE_THREAD char entered_string[15];
+
+extern CORE_THREAD int pending_command;
+extern CORE_THREAD arg_struct pending_command_arg;
+extern CORE_THREAD int xeq_invisible;
 
 /* Multi-keystroke commands -- edit state */
 /* Relevant when mode_command_entry != 0 */
-extern int incomplete_command;
-extern int incomplete_ind;
-extern int incomplete_alpha;
-extern int incomplete_length;
-extern int incomplete_maxdigits;
-extern int incomplete_argtype;
-extern int incomplete_num;
-extern char incomplete_str[7];
-extern int4 incomplete_saved_pc;
-extern int4 incomplete_saved_highlight_row;
+extern CORE_THREAD int incomplete_command;
+extern CORE_THREAD int incomplete_ind;
+extern CORE_THREAD int incomplete_alpha;
+extern CORE_THREAD int incomplete_length;
+extern CORE_THREAD int incomplete_maxdigits;
+extern CORE_THREAD int incomplete_argtype;
+extern CORE_THREAD int incomplete_num;
+extern CORE_THREAD char incomplete_str[7];
+extern CORE_THREAD int4 incomplete_saved_pc;
+extern CORE_THREAD int4 incomplete_saved_highlight_row;
 
 #define CATSECT_TOP 0
 #define CATSECT_FCN 1
@@ -525,49 +556,49 @@ extern int4 incomplete_saved_highlight_row;
 #define CATSECT_PGM_INTEG 11
 
 /* Command line handling temporaries */
-extern char cmdline[100];
-extern int cmdline_length;
-extern int cmdline_row;
+extern CORE_THREAD char cmdline[100];
+extern CORE_THREAD int cmdline_length;
+extern CORE_THREAD int cmdline_row;
 
 /* Matrix editor / matrix indexing */
-extern int matedit_mode; /* 0=off, 1=index, 2=edit, 3=editn */
-extern char matedit_name[7];
-extern int matedit_length;
-extern vartype *matedit_x;
-extern int4 matedit_i;
-extern int4 matedit_j;
-extern int matedit_prev_appmenu;
+extern CORE_THREAD int matedit_mode; /* 0=off, 1=index, 2=edit, 3=editn */
+extern CORE_THREAD char matedit_name[7];
+extern CORE_THREAD int matedit_length;
+extern CORE_THREAD vartype *matedit_x;
+extern CORE_THREAD int4 matedit_i;
+extern CORE_THREAD int4 matedit_j;
+extern CORE_THREAD int matedit_prev_appmenu;
 
 /* INPUT */
-extern char input_name[11];
-extern int input_length;
-extern arg_struct input_arg;
+extern CORE_THREAD char input_name[11];
+extern CORE_THREAD int input_length;
+extern CORE_THREAD arg_struct input_arg;
 
 /* BASE application */
-extern int baseapp;
+extern CORE_THREAD int baseapp;
 
 /* Random number generator */
-extern int8 random_number_low, random_number_high;
+extern CORE_THREAD int8 random_number_low, random_number_high;
 
 /* NORM & TRACE mode: number waiting to be printed */
-extern int deferred_print;
+extern CORE_THREAD int deferred_print;
 
 /* Keystroke buffer - holds keystrokes received while
  * there is a program running.
  */
-extern int keybuf_head;
-extern int keybuf_tail;
-extern int keybuf[16];
+extern CORE_THREAD int keybuf_head;
+extern CORE_THREAD int keybuf_tail;
+extern CORE_THREAD int keybuf[16];
 
-extern int remove_program_catalog;
+extern CORE_THREAD int remove_program_catalog;
 
 #define NUMBER_FORMAT_BINARY 0
 #define NUMBER_FORMAT_BCD20_OLD 1
 #define NUMBER_FORMAT_BCD20_NEW 2
 #define NUMBER_FORMAT_BID128 3
-extern int state_file_number_format;
+extern CORE_THREAD int state_file_number_format;
 
-extern bool no_keystrokes_yet;
+extern CORE_THREAD bool no_keystrokes_yet;
 
 
 /*********************/
@@ -583,6 +614,8 @@ int mvar_prgms_exist();
 int label_has_mvar(int lblindex);
 int get_command_length(int prgm, int4 pc);
 void get_next_command(int4 *pc, int *command, arg_struct *arg, int find_target);
+void get_next_decoded_command(int4 *pc, int *command, arg_struct *arg);
+void discard_decoded_prgm(int prgm_index);
 void rebuild_label_table();
 void delete_command(int4 pc);
 void store_command(int4 pc, int command, arg_struct *arg);
@@ -604,7 +637,7 @@ bool solve_active();
 bool integ_active();
 bool unwind_stack_until_solve();
 
-extern bool state_is_portable;
+extern CORE_THREAD bool state_is_portable;
 
 bool read_bool(bool *b);
 bool write_bool(bool b);
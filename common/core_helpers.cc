@@ -21,6 +21,7 @@
 #include "core_helpers.h"
 #include "core_commands2.h"
 #include "core_display.h"
+#include "core_linalg1.h"
 #include "core_phloat.h"
 #include "core_main.h"
 #include "core_variables.h"
@@ -178,15 +179,108 @@ void unary_result(vartype *x) {
         docmd_prx(NULL);
 }
 
+/* Drops Y out of the stack, duplicating T into Z. When the old Y and T are
+ * scalars of the same type, the Y object is reused to hold the copy of T,
+ * rather than going back to the pool and having dup_vartype() take it out
+ * again.
+ */
+static void drop_y() {
+    vartype *y = reg_y;
+    reg_y = reg_z;
+    if (y->type == TYPE_REAL && reg_t->type == TYPE_REAL)
+        ((vartype_real *) y)->x = ((vartype_real *) reg_t)->x;
+    else if (y->type == TYPE_COMPLEX && reg_t->type == TYPE_COMPLEX) {
+        ((vartype_complex *) y)->re = ((vartype_complex *) reg_t)->re;
+        ((vartype_complex *) y)->im = ((vartype_complex *) reg_t)->im;
+    } else {
+        free_vartype(y);
+        y = dup_vartype(reg_t);
+    }
+    reg_z = y;
+}
+
 void binary_result(vartype *x) {
     free_vartype(reg_lastx);
     reg_lastx = reg_x;
     reg_x = x;
-    free_vartype(reg_y);
-    reg_y = reg_z;
-    reg_z = dup_vartype(reg_t);
+    drop_y();
+    if (flags.f.trace_print && flags.f.printer_exists)
+        docmd_prx(NULL);
+}
+
+/* Scalar versions of unary_result() and binary_result(). The old LASTX,
+ * which is about to be discarded, is reused to hold the new X if it has the
+ * right type, so arithmetic on plain reals and complex numbers doesn't
+ * touch the pools at all. If a new object is needed and can't be
+ * allocated, the stack is left unchanged.
+ */
+static vartype *recycle_lastx_real(phloat x) {
+    if (reg_lastx->type == TYPE_REAL) {
+        ((vartype_real *) reg_lastx)->x = x;
+        return reg_lastx;
+    }
+    vartype *v = new_real(x);
+    if (v != NULL)
+        free_vartype(reg_lastx);
+    return v;
+}
+
+static vartype *recycle_lastx_complex(phloat re, phloat im) {
+    if (reg_lastx->type == TYPE_COMPLEX) {
+        ((vartype_complex *) reg_lastx)->re = re;
+        ((vartype_complex *) reg_lastx)->im = im;
+        return reg_lastx;
+    }
+    vartype *v = new_complex(re, im);
+    if (v != NULL)
+        free_vartype(reg_lastx);
+    return v;
+}
+
+int unary_real_result(phloat x) {
+    vartype *v = recycle_lastx_real(x);
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    reg_lastx = reg_x;
+    reg_x = v;
+    if (flags.f.trace_print && flags.f.printer_exists)
+        docmd_prx(NULL);
+    return ERR_NONE;
+}
+
+int unary_complex_result(phloat re, phloat im) {
+    vartype *v = recycle_lastx_complex(re, im);
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    reg_lastx = reg_x;
+    reg_x = v;
+    if (flags.f.trace_print && flags.f.printer_exists)
+        docmd_prx(NULL);
+    return ERR_NONE;
+}
+
+int binary_real_result(phloat x) {
+    vartype *v = recycle_lastx_real(x);
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    reg_lastx = reg_x;
+    reg_x = v;
+    drop_y();
+    if (flags.f.trace_print && flags.f.printer_exists)
+        docmd_prx(NULL);
+    return ERR_NONE;
+}
+
+int binary_complex_result(phloat re, phloat im) {
+    vartype *v = recycle_lastx_complex(re, im);
+    if (v == NULL)
+        return ERR_INSUFFICIENT_MEMORY;
+    reg_lastx = reg_x;
+    reg_x = v;
+    drop_y();
     if (flags.f.trace_print && flags.f.printer_exists)
         docmd_prx(NULL);
+    return ERR_NONE;
 }
 
 phloat rad_to_angle(phloat x) {
@@ -255,7 +349,7 @@ bool string_equals(const char *s1, int s1len, const char *s2, int s2len) {
 }
 
 #if (!defined(ANDROID) && !defined(IPHONE))
-static bool always_on = false;
+static CORE_THREAD bool always_on = false;
 int shell_always_on(int ao) {
     int ret = always_on ? 1 : 0;
     if (ao != -1)
@@ -928,6 +1022,7 @@ int dimension_array(const char *name, int namelen, int4 rows, int4 columns, bool
 
 int dimension_array_ref(vartype *matrix, int4 rows, int4 columns) {
     int4 size = rows * columns;
+    linalg_cache_release(matrix);
     if (matrix->type == TYPE_REALMATRIX) {
         vartype_realmatrix *oldmatrix = (vartype_realmatrix *) matrix;
         if (oldmatrix->rows == rows && oldmatrix->columns == columns)
@@ -1194,7 +1289,7 @@ int vartype2string(const vartype *v, char *buf, int buflen, int max_mant_digits)
                                       max_mant_digits);
             }
 
-            for (i = 0; i < buflen; i++) {
+            for (i = 0; i < buflen && i < x_len + y_len + 2; i++) {
                 if (i < x_len)
                     buf[i] = x_buf[i];
                 else if (i < x_len + 1)
@@ -1276,8 +1371,8 @@ char *phloat2program(phloat d) {
     /* Converts a phloat to its most compact representation;
      * used for generating HP-42S style number literals in programs.
      */
-    static char allbuf[50];
-    static char scibuf[50];
+    static CORE_THREAD char allbuf[50];
+    static CORE_THREAD char scibuf[50];
     int alllen;
     int scilen;
     char dot = flags.f.decimal_point ? '.' : ',';
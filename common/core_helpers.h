@@ -35,6 +35,10 @@ void recall_result(vartype *v);
 void recall_two_results(vartype *x, vartype *y);
 void unary_result(vartype *x);
 void binary_result(vartype *x);
+int unary_real_result(phloat x);
+int unary_complex_result(phloat re, phloat im);
+int binary_real_result(phloat x);
+int binary_complex_result(phloat re, phloat im);
 phloat rad_to_angle(phloat x);
 phloat rad_to_deg(phloat x);
 phloat deg_to_rad(phloat x);
@@ -16,6 +16,7 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <time.h>
 
 #include "core_linalg1.h"
 #include "core_linalg2.h"
@@ -23,13 +24,507 @@
 #include "core_variables.h"
 
 
+/**********************************/
+/***** LU factorization cache *****/
+/**********************************/
+
+/* The LU decomposition of the most recently divided-by or inverted matrix
+ * is kept, so that doing it again, with the same matrix, only takes the
+ * back-substitution. The cache holds a reference to the matrix's data,
+ * which makes sure that the data cannot be freed, and its address reused,
+ * while it is in the cache; it also means that code that modifies matrices
+ * in place the normal way, calling disentangle() first, gets a copy, unless
+ * the cache's reference is the only other one, in which case disentangle()
+ * drops the entry, by calling linalg_cache_release().
+ * A few places write to an array regardless of whether it is shared: Σ+,
+ * Σ-, and CLΣ update the summation registers in REGS directly, and READR
+ * reads into REGS. Those call linalg_cache_invalidate() instead, which drops
+ * the entry if it is for that array, no matter who else is using it.
+ * The decomposition depends on the 'singular matrix' error mode, so that is
+ * part of the key as well.
+ */
+
+static CORE_THREAD vartype *lu_cache_matrix = NULL;
+static CORE_THREAD vartype *lu_cache_lu = NULL;
+static CORE_THREAD int4 *lu_cache_perm = NULL;
+static CORE_THREAD bool lu_cache_singularmatrix;
+
+static bool lu_cache_holds(const vartype *m) {
+    if (lu_cache_matrix == NULL || lu_cache_matrix->type != m->type)
+        return false;
+    if (m->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *a = (vartype_realmatrix *) m;
+        vartype_realmatrix *b = (vartype_realmatrix *) lu_cache_matrix;
+        return a->array == b->array
+                && a->rows == b->rows && a->columns == b->columns;
+    } else {
+        vartype_complexmatrix *a = (vartype_complexmatrix *) m;
+        vartype_complexmatrix *b = (vartype_complexmatrix *) lu_cache_matrix;
+        return a->array == b->array
+                && a->rows == b->rows && a->columns == b->columns;
+    }
+}
+
+static bool lu_cache_lookup(const vartype *m) {
+    return lu_cache_holds(m)
+        && lu_cache_singularmatrix == core_settings.matrix_singularmatrix;
+}
+
+/* Stores the decomposition of m; the cache takes ownership of lu and perm,
+ * unless m cannot be duplicated, in which case nothing is stored.
+ */
+static void lu_cache_store(const vartype *m, vartype *lu, int4 *perm) {
+    vartype *key = dup_vartype(m);
+    if (key == NULL)
+        return;
+    linalg_cache_clear();
+    lu_cache_matrix = key;
+    lu_cache_lu = lu;
+    lu_cache_perm = perm;
+    lu_cache_singularmatrix = core_settings.matrix_singularmatrix;
+}
+
+/* Frees a decomposition, unless it belongs to the cache */
+static void lu_free(vartype *lu, int4 *perm) {
+    if (lu == lu_cache_lu)
+        return;
+    free_vartype(lu);
+    free(perm);
+}
+
+void linalg_cache_clear() {
+    if (lu_cache_matrix == NULL)
+        return;
+    free_vartype(lu_cache_matrix);
+    free_vartype(lu_cache_lu);
+    free(lu_cache_perm);
+    lu_cache_matrix = NULL;
+    lu_cache_lu = NULL;
+    lu_cache_perm = NULL;
+}
+
+void linalg_cache_release(const vartype *m) {
+    int refcount;
+    if (!lu_cache_holds(m))
+        return;
+    if (m->type == TYPE_REALMATRIX)
+        refcount = ((vartype_realmatrix *) m)->array->refcount;
+    else
+        refcount = ((vartype_complexmatrix *) m)->array->refcount;
+    /* If the only other reference is the cache's own, drop the cache entry,
+     * so the caller can modify the data in place instead of copying it.
+     */
+    if (refcount == 2)
+        linalg_cache_clear();
+}
+
+void linalg_cache_invalidate(const vartype *m) {
+    void *a, *b;
+    if (lu_cache_matrix == NULL || lu_cache_matrix->type != m->type)
+        return;
+    if (m->type == TYPE_REALMATRIX) {
+        a = ((vartype_realmatrix *) m)->array;
+        b = ((vartype_realmatrix *) lu_cache_matrix)->array;
+    } else if (m->type == TYPE_COMPLEXMATRIX) {
+        a = ((vartype_complexmatrix *) m)->array;
+        b = ((vartype_complexmatrix *) lu_cache_matrix)->array;
+    } else
+        return;
+    if (a == b)
+        linalg_cache_clear();
+}
+
+
+/**************************/
+/***** Small matrices *****/
+/**************************/
+
+/* Matrices of up to LU_SMALL_MAX rows are the common case, and for those,
+ * the allocations and the interruptible machinery of the general code cost
+ * far more than the arithmetic itself. The kernels below run the same
+ * algorithms as lu_decomp_r(), lu_decomp_c(), and lu_backsubst_rr(), _rc(),
+ * and _cc(), operation for operation, so the results are identical; they
+ * just do it synchronously, on stack buffers, with the loop bounds known at
+ * compile time.
+ * The decompositions return false when they hit a zero pivot; it is up to
+ * the callers to deal with singular matrices, usually by falling back on
+ * the general code, which knows how to handle them in either 'singular
+ * matrix' error mode.
+ */
+
+#define LU_SMALL_MAX 4
+
+#define SMALL_DISPATCH(n, fn, args) \
+    switch (n) {                    \
+        case 1: return fn<1> args;  \
+        case 2: return fn<2> args;  \
+        case 3: return fn<3> args;  \
+        default: return fn<4> args; \
+    }
+
+template <int N>
+static bool small_lu_r_n(phloat *a, int4 *perm, phloat *det) {
+    phloat scale[N];
+    phloat max, tmp, sum;
+    int i, imax, j, k;
+
+    *det = 1;
+    for (i = 0; i < N; i++) {
+        max = 0;
+        for (j = 0; j < N; j++) {
+            tmp = a[i * N + j];
+            if (tmp < 0)
+                tmp = -tmp;
+            if (tmp > max)
+                max = tmp;
+        }
+        scale[i] = max;
+    }
+
+    for (j = 0; j < N; j++) {
+        for (i = 0; i < j; i++) {
+            sum = a[i * N + j];
+            for (k = 0; k < i; k++)
+                sum -= a[i * N + k] * a[k * N + j];
+            a[i * N + j] = sum;
+        }
+
+        max = 0;
+        imax = j;
+        for (i = j; i < N; i++) {
+            sum = a[i * N + j];
+            for (k = 0; k < j; k++)
+                sum -= a[i * N + k] * a[k * N + j];
+            a[i * N + j] = sum;
+            if (scale[i] == 0) {
+                imax = i;
+                break;
+            }
+            tmp = (sum < 0 ? -sum : sum) / scale[i];
+            if (tmp > max) {
+                imax = i;
+                max = tmp;
+            }
+        }
+
+        if (j != imax) {
+            for (k = 0; k < N; k++) {
+                tmp = a[imax * N + k];
+                a[imax * N + k] = a[j * N + k];
+                a[j * N + k] = tmp;
+            }
+            *det = -*det;
+            scale[imax] = scale[j];
+        }
+
+        perm[j] = imax;
+        if (a[j * N + j] == 0)
+            return false;
+        *det *= a[j * N + j];
+        if (j != N - 1) {
+            tmp = 1 / a[j * N + j];
+            for (i = j + 1; i < N; i++)
+                a[i * N + j] *= tmp;
+        }
+    }
+    return true;
+}
+
+static bool small_lu_r(phloat *a, int4 n, int4 *perm, phloat *det) {
+    SMALL_DISPATCH(n, small_lu_r_n, (a, perm, det))
+}
+
+template <int N>
+static bool small_lu_c_n(phloat *a, int4 *perm,
+                         phloat *det_re, phloat *det_im) {
+    phloat scale[N];
+    phloat max, tmp, tmp_re, tmp_im, sum_re, sum_im, s_re, s_im;
+    phloat xre, xim, yre, yim;
+    int i, imax, j, k;
+
+    *det_re = 1;
+    *det_im = 0;
+    for (i = 0; i < N; i++) {
+        max = 0;
+        for (j = 0; j < N; j++) {
+            tmp = hypot(a[2 * (i * N + j)], a[2 * (i * N + j) + 1]);
+            if (tmp > max)
+                max = tmp;
+        }
+        scale[i] = max;
+    }
+
+    for (j = 0; j < N; j++) {
+        for (i = 0; i < j; i++) {
+            sum_re = a[2 * (i * N + j)];
+            sum_im = a[2 * (i * N + j) + 1];
+            for (k = 0; k < i; k++) {
+                xre = a[2 * (i * N + k)];
+                xim = a[2 * (i * N + k) + 1];
+                yre = a[2 * (k * N + j)];
+                yim = a[2 * (k * N + j) + 1];
+                sum_re -= xre * yre - xim * yim;
+                sum_im -= xim * yre + xre * yim;
+            }
+            a[2 * (i * N + j)] = sum_re;
+            a[2 * (i * N + j) + 1] = sum_im;
+        }
+
+        max = 0;
+        imax = j;
+        for (i = j; i < N; i++) {
+            sum_re = a[2 * (i * N + j)];
+            sum_im = a[2 * (i * N + j) + 1];
+            for (k = 0; k < j; k++) {
+                xre = a[2 * (i * N + k)];
+                xim = a[2 * (i * N + k) + 1];
+                yre = a[2 * (k * N + j)];
+                yim = a[2 * (k * N + j) + 1];
+                sum_re -= xre * yre - xim * yim;
+                sum_im -= xim * yre + xre * yim;
+            }
+            a[2 * (i * N + j)] = sum_re;
+            a[2 * (i * N + j) + 1] = sum_im;
+            if (scale[i] == 0) {
+                imax = i;
+                break;
+            }
+            tmp = hypot(sum_re, sum_im) / scale[i];
+            if (tmp > max) {
+                imax = i;
+                max = tmp;
+            }
+        }
+
+        if (j != imax) {
+            for (k = 0; k < 2 * N; k++) {
+                tmp = a[2 * imax * N + k];
+                a[2 * imax * N + k] = a[2 * j * N + k];
+                a[2 * j * N + k] = tmp;
+            }
+            *det_re = -*det_re;
+            *det_im = -*det_im;
+            scale[imax] = scale[j];
+        }
+
+        perm[j] = imax;
+        tmp_re = a[2 * (j * N + j)];
+        tmp_im = a[2 * (j * N + j) + 1];
+        if (tmp_re == 0 && tmp_im == 0)
+            return false;
+        tmp = *det_re * tmp_re - *det_im * tmp_im;
+        *det_im = *det_im * tmp_re + *det_re * tmp_im;
+        *det_re = tmp;
+        if (j != N - 1) {
+            tmp = hypot(tmp_re, tmp_im);
+            s_re = tmp_re / tmp / tmp;
+            s_im = -tmp_im / tmp / tmp;
+            for (i = j + 1; i < N; i++) {
+                tmp_re = a[2 * (i * N + j)];
+                tmp_im = a[2 * (i * N + j) + 1];
+                a[2 * (i * N + j)] = tmp_re * s_re - tmp_im * s_im;
+                a[2 * (i * N + j) + 1] = tmp_im * s_re + tmp_re * s_im;
+            }
+        }
+    }
+    return true;
+}
+
+static bool small_lu_c(phloat *a, int4 n, int4 *perm,
+                       phloat *det_re, phloat *det_im) {
+    SMALL_DISPATCH(n, small_lu_c_n, (a, perm, det_re, det_im))
+}
+
+/* Replaces an out-of-range element of a solution, the way the
+ * back-substitution workers do.
+ */
+static int small_range_check(phloat *t) {
+    if (p_isinf(*t) || p_isnan(*t)) {
+        if (core_settings.matrix_outofrange && !flags.f.range_error_ignore)
+            return ERR_OUT_OF_RANGE;
+        *t = p_isinf(*t) < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    }
+    return ERR_NONE;
+}
+
+template <int N>
+static int small_solve_rr_n(const phloat *a, const int4 *perm,
+                            phloat *b, int4 q) {
+    int4 i, ii, ll, k;
+    phloat sum, t;
+    for (k = 0; k < q; k++) {
+        ii = -1;
+        for (i = 0; i < N; i++) {
+            ll = perm[i];
+            sum = b[ll * q + k];
+            b[ll * q + k] = b[i * q + k];
+            if (ii != -1)
+                sum = -linalg_dot(-sum, a + i * N + ii, 1,
+                                  b + ii * q + k, q, i - ii);
+            else if (sum != 0)
+                ii = i;
+            b[i * q + k] = sum;
+        }
+        for (i = N - 1; i >= 0; i--) {
+            sum = -linalg_dot(-b[i * q + k], a + i * N + i + 1, 1,
+                              b + (i + 1) * q + k, q, N - i - 1);
+            t = sum / a[i * N + i];
+            if (small_range_check(&t) != ERR_NONE)
+                return ERR_OUT_OF_RANGE;
+            b[i * q + k] = t;
+        }
+    }
+    return ERR_NONE;
+}
+
+static int small_solve_rr(const phloat *a, int4 n, const int4 *perm,
+                          phloat *b, int4 q) {
+    SMALL_DISPATCH(n, small_solve_rr_n, (a, perm, b, q))
+}
+
+template <int N>
+static int small_solve_rc_n(const phloat *a, const int4 *perm,
+                            phloat *b, int4 q) {
+    int4 i, ii, j, ll, k;
+    phloat sum_re, sum_im, tmp, t_re, t_im;
+    for (k = 0; k < q; k++) {
+        ii = -1;
+        for (i = 0; i < N; i++) {
+            ll = perm[i];
+            sum_re = b[2 * (ll * q + k)];
+            sum_im = b[2 * (ll * q + k) + 1];
+            b[2 * (ll * q + k)] = b[2 * (i * q + k)];
+            b[2 * (ll * q + k) + 1] = b[2 * (i * q + k) + 1];
+            if (ii != -1) {
+                for (j = ii; j < i; j++) {
+                    tmp = a[i * N + j];
+                    sum_re -= tmp * b[2 * (j * q + k)];
+                    sum_im -= tmp * b[2 * (j * q + k) + 1];
+                }
+            } else if (sum_re != 0 || sum_im != 0)
+                ii = i;
+            b[2 * (i * q + k)] = sum_re;
+            b[2 * (i * q + k) + 1] = sum_im;
+        }
+        for (i = N - 1; i >= 0; i--) {
+            sum_re = b[2 * (i * q + k)];
+            sum_im = b[2 * (i * q + k) + 1];
+            for (j = i + 1; j < N; j++) {
+                tmp = a[i * N + j];
+                sum_re -= tmp * b[2 * (j * q + k)];
+                sum_im -= tmp * b[2 * (j * q + k) + 1];
+            }
+            tmp = a[i * N + i];
+            t_re = sum_re / tmp;
+            t_im = sum_im / tmp;
+            if (small_range_check(&t_re) != ERR_NONE
+                    || small_range_check(&t_im) != ERR_NONE)
+                return ERR_OUT_OF_RANGE;
+            b[2 * (i * q + k)] = t_re;
+            b[2 * (i * q + k) + 1] = t_im;
+        }
+    }
+    return ERR_NONE;
+}
+
+static int small_solve_rc(const phloat *a, int4 n, const int4 *perm,
+                          phloat *b, int4 q) {
+    SMALL_DISPATCH(n, small_solve_rc_n, (a, perm, b, q))
+}
+
+template <int N>
+static int small_solve_cc_n(const phloat *a, const int4 *perm,
+                            phloat *b, int4 q) {
+    int4 i, ii, j, ll, k;
+    phloat sum_re, sum_im, tmp, tmp_re, tmp_im, bre, bim, t_re, t_im;
+    for (k = 0; k < q; k++) {
+        ii = -1;
+        for (i = 0; i < N; i++) {
+            ll = perm[i];
+            sum_re = b[2 * (ll * q + k)];
+            sum_im = b[2 * (ll * q + k) + 1];
+            b[2 * (ll * q + k)] = b[2 * (i * q + k)];
+            b[2 * (ll * q + k) + 1] = b[2 * (i * q + k) + 1];
+            if (ii != -1) {
+                for (j = ii; j < i; j++) {
+                    bre = b[2 * (j * q + k)];
+                    bim = b[2 * (j * q + k) + 1];
+                    tmp_re = a[2 * (i * N + j)];
+                    tmp_im = a[2 * (i * N + j) + 1];
+                    sum_re -= bre * tmp_re - bim * tmp_im;
+                    sum_im -= bim * tmp_re + bre * tmp_im;
+                }
+            } else if (sum_re != 0 || sum_im != 0)
+                ii = i;
+            b[2 * (i * q + k)] = sum_re;
+            b[2 * (i * q + k) + 1] = sum_im;
+        }
+        for (i = N - 1; i >= 0; i--) {
+            sum_re = b[2 * (i * q + k)];
+            sum_im = b[2 * (i * q + k) + 1];
+            for (j = i + 1; j < N; j++) {
+                bre = b[2 * (j * q + k)];
+                bim = b[2 * (j * q + k) + 1];
+                tmp_re = a[2 * (i * N + j)];
+                tmp_im = a[2 * (i * N + j) + 1];
+                sum_re -= bre * tmp_re - bim * tmp_im;
+                sum_im -= bim * tmp_re + bre * tmp_im;
+            }
+            tmp_re = a[2 * (i * N + i)];
+            tmp_im = a[2 * (i * N + i) + 1];
+            tmp = hypot(tmp_re, tmp_im);
+            tmp_re = tmp_re / tmp / tmp;
+            tmp_im = -tmp_im / tmp / tmp;
+            t_re = sum_re * tmp_re - sum_im * tmp_im;
+            t_im = sum_im * tmp_re + sum_re * tmp_im;
+            if (small_range_check(&t_re) != ERR_NONE
+                    || small_range_check(&t_im) != ERR_NONE)
+                return ERR_OUT_OF_RANGE;
+            b[2 * (i * q + k)] = t_re;
+            b[2 * (i * q + k) + 1] = t_im;
+        }
+    }
+    return ERR_NONE;
+}
+
+static int small_solve_cc(const phloat *a, int4 n, const int4 *perm,
+                          phloat *b, int4 q) {
+    SMALL_DISPATCH(n, small_solve_cc_n, (a, perm, b, q))
+}
+
+/* Copies an n x n matrix into a stack buffer, if it is small enough */
+static bool small_load(const vartype *m, phloat *a, int4 *n) {
+    int4 i, size;
+    const phloat *data;
+    if (m->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) m;
+        *n = rm->rows;
+        if (*n > LU_SMALL_MAX || rm->columns != *n)
+            return false;
+        size = *n * *n;
+        data = rm->array->data;
+    } else {
+        vartype_complexmatrix *cm = (vartype_complexmatrix *) m;
+        *n = cm->rows;
+        if (*n > LU_SMALL_MAX || cm->columns != *n)
+            return false;
+        size = 2 * *n * *n;
+        data = cm->array->data;
+    }
+    for (i = 0; i < size; i++)
+        a[i] = data[i];
+    return true;
+}
+
+
 /**********************************/
 /***** Matrix-matrix division *****/
 /**********************************/
 
-static void (*linalg_div_completion)(int, vartype *);
-static const vartype *linalg_div_left;
-static vartype *linalg_div_result;
+static CORE_THREAD void (*linalg_div_completion)(int, vartype *);
+static CORE_THREAD const vartype *linalg_div_left;
+static CORE_THREAD const vartype *linalg_div_right;
+static CORE_THREAD vartype *linalg_div_result;
 
 static int div_rr_completion1(int error, vartype_realmatrix *a, int4 *perm,
                                     phloat det);
@@ -48,8 +543,92 @@ static int div_cc_completion1(int error, vartype_complexmatrix *a, int4 *perm,
 static void div_cc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                     vartype_complexmatrix *b);
 
+/* Does the division synchronously, if right is small enough, and not
+ * singular; otherwise, returns false, leaving it to the general code.
+ */
+static bool div_small(const vartype *left, const vartype *right,
+                      void (*completion)(int, vartype *), int *err) {
+    phloat a[2 * LU_SMALL_MAX * LU_SMALL_MAX];
+    int4 perm[LU_SMALL_MAX];
+    phloat det_re, det_im;
+    int4 n, rows, columns;
+    vartype *res;
+
+    if (!small_load(right, a, &n))
+        return false;
+    if (left->type == TYPE_REALMATRIX) {
+        rows = ((vartype_realmatrix *) left)->rows;
+        columns = ((vartype_realmatrix *) left)->columns;
+    } else {
+        rows = ((vartype_complexmatrix *) left)->rows;
+        columns = ((vartype_complexmatrix *) left)->columns;
+    }
+    if (rows != n)
+        return false;
+    if (right->type == TYPE_REALMATRIX) {
+        if (!small_lu_r(a, n, perm, &det_re))
+            return false;
+    } else {
+        if (!small_lu_c(a, n, perm, &det_re, &det_im))
+            return false;
+    }
+
+    if (left->type == TYPE_REALMATRIX && right->type == TYPE_REALMATRIX)
+        res = new_realmatrix(rows, columns);
+    else
+        res = new_complexmatrix(rows, columns);
+    if (res == NULL) {
+        *err = ERR_INSUFFICIENT_MEMORY;
+    } else {
+        matrix_copy(res, left);
+        if (right->type == TYPE_COMPLEXMATRIX)
+            *err = small_solve_cc(a, n, perm,
+                    ((vartype_complexmatrix *) res)->array->data, columns);
+        else if (res->type == TYPE_REALMATRIX)
+            *err = small_solve_rr(a, n, perm,
+                    ((vartype_realmatrix *) res)->array->data, columns);
+        else
+            *err = small_solve_rc(a, n, perm,
+                    ((vartype_complexmatrix *) res)->array->data, columns);
+        if (*err != ERR_NONE) {
+            free_vartype(res);
+            res = NULL;
+        }
+    }
+    completion(*err, res);
+    return true;
+}
+
+/* Divides left by right, using the cached decomposition of right; res has
+ * already been allocated by the caller.
+ */
+static int div_cached(const vartype *left, const vartype *right,
+                      vartype *res, void (*completion)(int, vartype *)) {
+    matrix_copy(res, left);
+    linalg_div_completion = completion;
+    linalg_div_result = res;
+    if (right->type == TYPE_REALMATRIX) {
+        if (res->type == TYPE_REALMATRIX)
+            return lu_backsubst_rr((vartype_realmatrix *) lu_cache_lu,
+                                   lu_cache_perm, (vartype_realmatrix *) res,
+                                   div_rr_completion2);
+        else
+            return lu_backsubst_rc((vartype_realmatrix *) lu_cache_lu,
+                                   lu_cache_perm,
+                                   (vartype_complexmatrix *) res,
+                                   div_cr_completion2);
+    } else
+        return lu_backsubst_cc((vartype_complexmatrix *) lu_cache_lu,
+                               lu_cache_perm, (vartype_complexmatrix *) res,
+                               left->type == TYPE_REALMATRIX
+                                    ? div_rc_completion2 : div_cc_completion2);
+}
+
 int linalg_div(const vartype *left, const vartype *right,
                                     void (*completion)(int, vartype *)) {
+    int err;
+    if (div_small(left, right, completion, &err))
+        return err;
     if (left->type == TYPE_REALMATRIX) {
         if (right->type == TYPE_REALMATRIX) {
             vartype_realmatrix *num = (vartype_realmatrix *) left;
@@ -62,6 +641,14 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_DIMENSION_ERROR, NULL);
                 return ERR_DIMENSION_ERROR;
             }
+            if (lu_cache_lookup(right)) {
+                res = new_realmatrix(rows, columns);
+                if (res == NULL) {
+                    completion(ERR_INSUFFICIENT_MEMORY, NULL);
+                    return ERR_INSUFFICIENT_MEMORY;
+                }
+                return div_cached(left, right, res, completion);
+            }
             perm = (int4 *) malloc(rows * sizeof(int4));
             if (perm == NULL) {
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
@@ -83,6 +670,7 @@ int linalg_div(const vartype *left, const vartype *right,
             matrix_copy(lu, right);
             linalg_div_completion = completion;
             linalg_div_left = left;
+            linalg_div_right = right;
             linalg_div_result = res;
             return lu_decomp_r((vartype_realmatrix *) lu, perm,
                                                 div_rr_completion1); 
@@ -97,6 +685,14 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_DIMENSION_ERROR, NULL);
                 return ERR_DIMENSION_ERROR;
             }
+            if (lu_cache_lookup(right)) {
+                res = new_complexmatrix(rows, columns);
+                if (res == NULL) {
+                    completion(ERR_INSUFFICIENT_MEMORY, NULL);
+                    return ERR_INSUFFICIENT_MEMORY;
+                }
+                return div_cached(left, right, res, completion);
+            }
             perm = (int4 *) malloc(rows * sizeof(int4));
             if (perm == NULL) {
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
@@ -118,6 +714,7 @@ int linalg_div(const vartype *left, const vartype *right,
             matrix_copy(lu, right);
             linalg_div_completion = completion;
             linalg_div_left = left;
+            linalg_div_right = right;
             linalg_div_result = res;
             return lu_decomp_c((vartype_complexmatrix *) lu, perm,
                                                 div_rc_completion1);
@@ -134,6 +731,14 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_DIMENSION_ERROR, 0);
                 return ERR_DIMENSION_ERROR;
             }
+            if (lu_cache_lookup(right)) {
+                res = new_complexmatrix(rows, columns);
+                if (res == NULL) {
+                    completion(ERR_INSUFFICIENT_MEMORY, NULL);
+                    return ERR_INSUFFICIENT_MEMORY;
+                }
+                return div_cached(left, right, res, completion);
+            }
             perm = (int4 *) malloc(rows * sizeof(int4));
             if (perm == NULL) {
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
@@ -155,6 +760,7 @@ int linalg_div(const vartype *left, const vartype *right,
             matrix_copy(lu, right);
             linalg_div_completion = completion;
             linalg_div_left = left;
+            linalg_div_right = right;
             linalg_div_result = res;
             return lu_decomp_r((vartype_realmatrix *) lu, perm,
                                                     div_cr_completion1);
@@ -169,6 +775,14 @@ int linalg_div(const vartype *left, const vartype *right,
                 completion(ERR_DIMENSION_ERROR, NULL);
                 return ERR_DIMENSION_ERROR;
             }
+            if (lu_cache_lookup(right)) {
+                res = new_complexmatrix(rows, columns);
+                if (res == NULL) {
+                    completion(ERR_INSUFFICIENT_MEMORY, NULL);
+                    return ERR_INSUFFICIENT_MEMORY;
+                }
+                return div_cached(left, right, res, completion);
+            }
             perm = (int4 *) malloc(rows * sizeof(int4));
             if (perm == NULL) {
                 completion(ERR_INSUFFICIENT_MEMORY, NULL);
@@ -190,6 +804,7 @@ int linalg_div(const vartype *left, const vartype *right,
             matrix_copy(lu, right);
             linalg_div_completion = completion;
             linalg_div_left = left;
+            linalg_div_right = right;
             linalg_div_result = res;
             return lu_decomp_c((vartype_complexmatrix *) lu, perm,
                                                     div_cc_completion1);
@@ -205,6 +820,7 @@ static int div_rr_completion1(int error, vartype_realmatrix *a, int4 *perm,
         free_vartype(linalg_div_result);
         return error;
     } else {
+        lu_cache_store(linalg_div_right, (vartype *) a, perm);
         matrix_copy(linalg_div_result, linalg_div_left);
         return lu_backsubst_rr(a, perm,
                                 (vartype_realmatrix *) linalg_div_result,
@@ -216,8 +832,7 @@ static void div_rr_completion2(int error, vartype_realmatrix *a, int4 *perm,
                                           vartype_realmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    lu_free((vartype *) a, perm);
     linalg_div_completion(error, linalg_div_result);
 }
 
@@ -229,6 +844,7 @@ static int div_rc_completion1(int error, vartype_complexmatrix *a, int4 *perm,
         free_vartype(linalg_div_result);
         return error;
     } else {
+        lu_cache_store(linalg_div_right, (vartype *) a, perm);
         matrix_copy(linalg_div_result, linalg_div_left);
         return lu_backsubst_cc(a, perm,
                                 (vartype_complexmatrix *) linalg_div_result,
@@ -240,8 +856,7 @@ static void div_rc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                           vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    lu_free((vartype *) a, perm);
     linalg_div_completion(error, linalg_div_result);
 }
 
@@ -253,6 +868,7 @@ static int div_cr_completion1(int error, vartype_realmatrix *a, int4 *perm,
         free_vartype(linalg_div_result);
         return error;
     } else {
+        lu_cache_store(linalg_div_right, (vartype *) a, perm);
         matrix_copy(linalg_div_result, linalg_div_left);
         return lu_backsubst_rc(a, perm,
                                 (vartype_complexmatrix *) linalg_div_result,
@@ -264,8 +880,7 @@ static void div_cr_completion2(int error, vartype_realmatrix *a, int4 *perm,
                                     vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    lu_free((vartype *) a, perm);
     linalg_div_completion(error, linalg_div_result);
 }
 
@@ -277,6 +892,7 @@ static int div_cc_completion1(int error, vartype_complexmatrix *a, int4 *perm,
         free_vartype(linalg_div_result);
         return error;
     } else {
+        lu_cache_store(linalg_div_right, (vartype *) a, perm);
         matrix_copy(linalg_div_result, linalg_div_left);
         return lu_backsubst_cc(a, perm,
                                 (vartype_complexmatrix *) linalg_div_result,
@@ -288,8 +904,7 @@ static void div_cc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                     vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_div_result); /* Note: linalg_div_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    lu_free((vartype *) a, perm);
     linalg_div_completion(error, linalg_div_result);
 }
 
@@ -298,574 +913,309 @@ static void div_cc_completion2(int error, vartype_complexmatrix *a, int4 *perm,
 /***** Matrix-matrix multiplication *****/
 /****************************************/
 
-typedef struct {
-    vartype_realmatrix *left;
-    vartype_realmatrix *right;
-    vartype *result;
-    int4 i, j, k;
-    phloat sum;
-    void (*completion)(int error, vartype *result);
-} mul_rr_data_struct;
-
-static mul_rr_data_struct *mul_rr_data;
-
-static int matrix_mul_rr_worker(int interrupted);
-
-static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
-                         void (*completion)(int, vartype *)) {
-
-    mul_rr_data_struct *dat;
-    int error;
-
-    if (left->columns != right->rows) {
-        error = ERR_DIMENSION_ERROR;
-        goto finished;
-    }
-
-    if (!contains_no_strings(left) || !contains_no_strings(right)) {
-        error = ERR_ALPHA_DATA_IS_INVALID;
-        goto finished;
-    }
-
-    dat = (mul_rr_data_struct *) malloc(sizeof(mul_rr_data_struct));
-    if (dat == NULL) {
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
-    }
-
-    dat->result = new_realmatrix(left->rows, right->columns);
-    if (dat->result == NULL) {
-        free(dat);
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
-    }
-
-    dat->left = left;
-    dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum = 0;
-    dat->completion = completion;
-
-    mul_rr_data = dat;
-    mode_interruptible = matrix_mul_rr_worker;
-    mode_stoppable = false;
-    return ERR_INTERRUPTIBLE;
-
-    finished:
-    completion(error, NULL);
-    return error;
-}
+/* Blocked matrix multiplication.
+ * The product is computed one block at a time: for each block of rows i and
+ * columns j of the result, the contributions of the blocks of the inner
+ * dimension k are added in order, so that every element is still summed in
+ * increasing k order, just like with the straightforward i,j,k algorithm,
+ * and the results are identical. Within a block, the loops run in i,k,j
+ * order, so the innermost loop walks along rows of the right-hand matrix and
+ * of the result. If the blocks are sufficiently small, they stay in the CPU's
+ * L1 cache while they are being reused, which speeds things up by a factor
+ * of 2 or more for large matrices.
+ * The optimum block size depends on the CPU, so unless the shell sets
+ * core_settings.matrix_block_size, it is determined by timing a few
+ * candidates, the first time a matrix multiplication comes along that is
+ * large enough for it to matter.
+ * The multiplication is performed in slices of about MUL_SLICE
+ * multiply-adds, so the user can interrupt it and the display stays
+ * responsive.
+ * When more than one CPU core is available, large products are computed
+ * in panels of rows instead, with the rows of each panel divided among
+ * threads; see linalg_parallel().
+ */
 
-static int matrix_mul_rr_worker(int interrupted) {
-    mul_rr_data_struct *dat = mul_rr_data;
-    int count = 0;
-    int inf;
-    phloat *l = dat->left->array->data;
-    phloat *r = dat->right->array->data;
-    phloat *p = ((vartype_realmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
-    int4 m = dat->left->rows;
-    int4 n = dat->right->columns;
-    int4 q = dat->left->columns;
-    phloat sum = dat->sum;
+#define MUL_SLICE 10000
+#define MUL_PAR_SLICE 1000000
+#define MUL_SMALL 32
+#define MUL_CALIBRATION_WORK (128 * 128 * 128)
 
-    if (interrupted) {
-        dat->completion(ERR_INTERRUPTED, NULL);
-        free_vartype(dat->result);
-        free(dat);
-        return ERR_INTERRUPTED;
-    }
+#define MUL_RR 0
+#define MUL_RC 1
+#define MUL_CR 2
+#define MUL_CC 3
 
-    while (count++ < 1000) {
-        sum += l[i * q + k] * r[k * n + j];
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-        }
-        p[i * n + j] = sum;
-        sum = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
-            dat->completion(ERR_NONE, dat->result);
-            free(dat);
-            return ERR_NONE;
-        }
-    }
+typedef struct {
+    vartype *left;
+    vartype *right;
+    vartype *result;
+    int variant;
+    int4 m, n, q, bs;
+    int4 i, j, k, ii;
+    int nthreads;
+    void (*completion)(int error, vartype *result);
+} mul_data_struct;
 
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum = sum;
-    return ERR_INTERRUPTIBLE;
-}
+static CORE_THREAD mul_data_struct *mul_data;
+static CORE_THREAD int4 mul_block_size = 0;
 
-#if 0
-/* TODO: Blocked matrix multiplication
- * This commented-out function implements a working blocked matrix
- * multiplication algorithm. It works by breaking up the multiplication into
- * multiplications of submatrices of the multiplicands. If the submatrices are
- * sufficiently small, they can be made to fit entirely in the CPU's L1 cache.
- * With block sizes of around 45, I have observed a speed-up factor of circa
- * 1.7 on a Pentium MMX, and with block sizes of about 90, I have observed a
- * speed-up factor of circa 3 on a Duron. (Those were the optimum block sizes
- * observed for each processor.) These numbers suggest the Pentium MMX has a 32
- * kilobyte L1 cache, and the Duron has a 128 kilobyte L1 cache.
- * For production use, the block size should be a user-configurable parameter,
- * with a built-in tool to automatically determine the optimum value. Since the
- * UI for this kind of advanced configuration does not exist yet, and sice the
- * determination of optimum block size is a very slow process, and since I
- * expect most HP-42S users will not be very interested in using a calculator
- * to work with order-100+ matrices, and since even in the optimum case the
- * speed-up is not staggering, I'm putting full implementation of this feature
- * off until some later date.
+/* Adds the contributions of columns k through k + kmax - 1 of row i of the
+ * left-hand matrix to elements j through j + jmax - 1 of row i of the result.
+ * n and q are the number of columns of the result and of the left-hand
+ * matrix, respectively. Complex matrices are stored as interleaved
+ * real/imaginary pairs.
  */
-static int matrix_mul_rr(vartype_realmatrix *left, vartype_realmatrix *right,
-                         vartype **result) {
-    phloat *cache = NULL;
-    phloat *leftcache, *rightcache;
-
-    phloat *l = left->array->data;
-    phloat *r = right->array->data;
-    phloat *p;
-    int inf;
-    int4 m, n, q;
-    int4 i, j, k;
-
-    q = left->columns;
-    if (q != right->rows)
-        return ERR_DIMENSION_ERROR;
-    m = left->rows;
-    n = right->columns;
-
-    if (!contains_no_strings(left) || !contains_no_strings(right))
-        return ERR_ALPHA_DATA_IS_INVALID;
-
-    *result = new_realmatrix(m, n);
-    if (*result == NULL)
-        return ERR_INSUFFICIENT_MEMORY;
-    p = ((vartype_realmatrix *) *result)->array->data;
-
-    if (BLOCK_SIZE > 0) {
-        int4 cachesize = 2 * BLOCK_SIZE * BLOCK_SIZE;
-        int4 alignment = CACHE_ALIGNMENT;
-        int4 misalgn;
-        if (alignment == 0)
-            alignment = 1;
-        misalgn = alignment % sizeof(phloat);
-        if (misalgn != 0)
-            alignment += sizeof(phloat) - misalgn;
-
-        cache = (phloat *) malloc(cachesize * sizeof(phloat) + alignment);
-        if (cache != NULL) {
-            misalgn = ((unsigned long) cache) % alignment;
-            if (misalgn == 0)
-                leftcache = cache;
-            else
-                leftcache = cache + (alignment - misalgn) / sizeof(phloat);
-            rightcache = leftcache + BLOCK_SIZE * BLOCK_SIZE;
+static void mul_row(int variant, const phloat *l, const phloat *r, phloat *p,
+                    int4 n, int4 q, int4 i, int4 j, int4 jmax,
+                    int4 k, int4 kmax) {
+    int4 jj, kk;
+    switch (variant) {
+        case MUL_RR: {
+            phloat *pp = p + i * n + j;
+            const phloat *ll = l + i * q + k;
+            for (kk = 0; kk < kmax; kk++)
+                linalg_axpy(pp, r + (k + kk) * n + j, ll[kk], jmax);
+            break;
         }
-    }
-
-    if (cache == NULL) {
-
-        /* Falling back on basic i,j,k algorithm */
-        for (i = 0; i < m; i++)
-            for (j = 0; j < n; j++) {
-                phloat sum = 0;
-                for (k = 0; k < q; k++)
-                    sum += l[i * q + k] * r[k * n + j];
-                if ((inf = p_isinf(sum)) != 0) {
-                    if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore)
-                        return ERR_OUT_OF_RANGE;
-                    else
-                        sum = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+        case MUL_RC: {
+            phloat *pp = p + 2 * (i * n + j);
+            const phloat *ll = l + i * q + k;
+            for (kk = 0; kk < kmax; kk++)
+                linalg_axpy(pp, r + 2 * ((k + kk) * n + j), ll[kk], 2 * jmax);
+            break;
+        }
+        case MUL_CR: {
+            phloat *pp = p + 2 * (i * n + j);
+            const phloat *ll = l + 2 * (i * q + k);
+            for (kk = 0; kk < kmax; kk++) {
+                phloat a_re = ll[2 * kk];
+                phloat a_im = ll[2 * kk + 1];
+                const phloat *rr = r + (k + kk) * n + j;
+                for (jj = 0; jj < jmax; jj++) {
+                    phloat tmp = rr[jj];
+                    pp[2 * jj] += tmp * a_re;
+                    pp[2 * jj + 1] += tmp * a_im;
                 }
-                p[i * n + j] = sum;
             }
-        return ERR_NONE;
-
-    } else {
-
-        /* Blocked i,j,k algorithm for optimal cache utilization */
-        int4 i, j, k, ii, jj, kk;
-        for (i = 0; i < m; i += BLOCK_SIZE) {
-            int4 iimax = m - i;
-            if (iimax > BLOCK_SIZE)
-                iimax = BLOCK_SIZE;
-            for (j = 0; j < n; j += BLOCK_SIZE) {
-                int4 jjmax = n - j;
-                if (jjmax > BLOCK_SIZE)
-                    jjmax = BLOCK_SIZE;
-                for (k = 0; k < q; k += BLOCK_SIZE) {
-                    int4 kkmax = q - k;
-                    if (kkmax > BLOCK_SIZE)
-                        kkmax = BLOCK_SIZE;
-                    for (ii = 0; ii < iimax; ii++)
-                        for (kk = 0; kk < kkmax; kk++)
-                            leftcache[ii * BLOCK_SIZE + kk]
-                                = l[(ii + i) * q + (kk + k)];
-                    for (kk = 0; kk < kkmax; kk++)
-                        for (jj = 0; jj < jjmax; jj++)
-                            rightcache[kk * BLOCK_SIZE + jj]
-                                = r[(kk + k) * n + (jj + j)];
-                    for (ii = 0; ii < iimax; ii++)
-                        for (jj = 0; jj < jjmax; jj++) {
-                            phloat sum = p[(ii + i) * n + (jj + j)];
-                            for (kk = 0; kk < kkmax; kk++)
-                                sum += leftcache[ii * BLOCK_SIZE + kk]
-                                        * rightcache[kk * BLOCK_SIZE + jj];
-                            if ((inf = p_isinf(sum)) != 0) {
-                                if (core_settings.matrix_outofrange
-                                            && !flags.f.range_error_ignore) {
-                                    free(cache);
-                                    return ERR_OUT_OF_RANGE;
-                                } else
-                                    sum = inf < 0 ? NEG_HUGE_PHLOAT
-                                                  : POS_HUGE_PHLOAT;
-                            }
-                            p[(ii + i) * n + (jj + j)] = sum;
-                        }
+            break;
+        }
+        case MUL_CC: {
+            phloat *pp = p + 2 * (i * n + j);
+            const phloat *ll = l + 2 * (i * q + k);
+            for (kk = 0; kk < kmax; kk++) {
+                phloat a_re = ll[2 * kk];
+                phloat a_im = ll[2 * kk + 1];
+                const phloat *rr = r + 2 * ((k + kk) * n + j);
+                for (jj = 0; jj < 2 * jmax; jj += 2) {
+                    phloat r_re = rr[jj];
+                    phloat r_im = rr[jj + 1];
+                    pp[jj] += a_re * r_re - a_im * r_im;
+                    pp[jj + 1] += a_im * r_re + a_re * r_im;
                 }
             }
+            break;
         }
-        free(cache);
-        return ERR_NONE;
-
     }
 }
-#endif
-
-typedef struct {
-    vartype_realmatrix *left;
-    vartype_complexmatrix *right;
-    vartype *result;
-    int4 i, j, k;
-    phloat sum_re, sum_im;
-    void (*completion)(int error, vartype *result);
-} mul_rc_data_struct;
-
-static mul_rc_data_struct *mul_rc_data;
-
-static int matrix_mul_rc_worker(int interrupted);
-
-static int matrix_mul_rc(vartype_realmatrix *left, vartype_complexmatrix *right,
-                         void (*completion)(int, vartype *)) {
-
-    mul_rc_data_struct *dat;
-    int error;
-
-    if (left->columns != right->rows) {
-        error = ERR_DIMENSION_ERROR;
-        goto finished;
-    }
 
-    if (!contains_no_strings(left)) {
-        error = ERR_ALPHA_DATA_IS_INVALID;
-        goto finished;
-    }
-
-    dat = (mul_rc_data_struct *) malloc(sizeof(mul_rc_data_struct));
-    if (dat == NULL) {
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
+/* Range check for finished elements j through j + jmax - 1 of row i of
+ * the result; count is the number of phloats per element.
+ */
+static int mul_row_check(phloat *p, int4 n, int4 i, int4 j, int4 jmax,
+                         int count) {
+    phloat *pp = p + count * (i * n + j);
+    int4 len = count * jmax;
+    int4 jj = 0;
+    while ((jj += linalg_find_inf(pp + jj, len - jj)) < len) {
+        if (core_settings.matrix_outofrange && !flags.f.range_error_ignore)
+            return ERR_OUT_OF_RANGE;
+        pp[jj] = p_isinf(pp[jj]) < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+        jj++;
     }
+    return ERR_NONE;
+}
 
-    dat->result = new_complexmatrix(left->rows, right->columns);
-    if (dat->result == NULL) {
-        free(dat);
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
+#ifdef BCD_MATH
+/* Decimal arithmetic is so much slower than memory access that the block
+ * size makes no measurable difference; don't waste time calibrating.
+ */
+#define MUL_DEFAULT_BLOCK_SIZE 32
+#else
+#define MUL_CALIBRATION_SIZE 192
+static const int4 mul_block_candidates[] = { 16, 24, 32, 48, 64, 96, 128, 0 };
+
+static clock_t time_mul(const phloat *a, const phloat *b, phloat *c,
+                        int4 sz, int4 bs) {
+    int4 i, j, k, ii;
+    for (i = 0; i < sz * sz; i++)
+        c[i] = 0;
+    clock_t start = clock();
+    for (i = 0; i < sz; i += bs) {
+        int4 iimax = sz - i < bs ? sz - i : bs;
+        for (j = 0; j < sz; j += bs) {
+            int4 jjmax = sz - j < bs ? sz - j : bs;
+            for (k = 0; k < sz; k += bs) {
+                int4 kkmax = sz - k < bs ? sz - k : bs;
+                for (ii = 0; ii < iimax; ii++)
+                    mul_row(MUL_RR, a, b, c, sz, sz, i + ii, j, jjmax,
+                                                        k, kkmax);
+            }
+        }
     }
-
-    dat->left = left;
-    dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum_re = 0;
-    dat->sum_im = 0;
-    dat->completion = completion;
-
-    mul_rc_data = dat;
-    mode_interruptible = matrix_mul_rc_worker;
-    mode_stoppable = false;
-    return ERR_INTERRUPTIBLE;
-
-    finished:
-    completion(error, NULL);
-    return error;
+    return clock() - start;
 }
 
-static int matrix_mul_rc_worker(int interrupted) {
-    mul_rc_data_struct *dat = mul_rc_data;
-    int count = 0;
-    int inf;
-    phloat *l = dat->left->array->data;
-    phloat *r = dat->right->array->data;
-    phloat *p = ((vartype_complexmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
-    int4 m = dat->left->rows;
-    int4 n = dat->right->columns;
-    int4 q = dat->left->columns;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
-
-    if (interrupted) {
-        dat->completion(ERR_INTERRUPTED, NULL);
-        free_vartype(dat->result);
-        free(dat);
-        return ERR_INTERRUPTED;
+static int4 calibrate_mul_block_size() {
+    int4 sz = MUL_CALIBRATION_SIZE;
+    int4 nn = sz * sz;
+    int4 i;
+    phloat *a = (phloat *) malloc(3 * nn * sizeof(phloat));
+    if (a == NULL)
+        return MUL_SMALL;
+    phloat *b = a + nn;
+    phloat *c = b + nn;
+    for (i = 0; i < nn; i++) {
+        a[i] = (i % 7) - 3;
+        b[i] = (i % 5) - 2;
     }
-
-    while (count++ < 1000) {
-        phloat tmp = l[i * q + k];
-        sum_re += tmp * r[2 * (k * n + j)];
-        sum_im += tmp * r[2 * (k * n + j) + 1];
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum_re)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-        }
-        if ((inf = p_isinf(sum_im)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_im = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
-        }
-        p[2 * (i * n + j)] = sum_re;
-        p[2 * (i * n + j) + 1] = sum_im;
-        sum_re = 0;
-        sum_im = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
-            dat->completion(ERR_NONE, dat->result);
-            free(dat);
-            return ERR_NONE;
+    /* Warm-up run, not counted */
+    time_mul(a, b, c, sz, mul_block_candidates[0]);
+    int4 best = mul_block_candidates[0];
+    clock_t best_time = time_mul(a, b, c, sz, best);
+    for (i = 1; mul_block_candidates[i] != 0; i++) {
+        clock_t t = time_mul(a, b, c, sz, mul_block_candidates[i]);
+        if (t < best_time) {
+            best = mul_block_candidates[i];
+            best_time = t;
         }
     }
+    free(a);
+    return best;
+}
+#endif
 
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
-    return ERR_INTERRUPTIBLE;
+static int4 get_mul_block_size(int4 m, int4 n, int4 q) {
+    if (core_settings.matrix_block_size > 0)
+        return core_settings.matrix_block_size;
+    if ((double) m * n * q < MUL_CALIBRATION_WORK)
+        /* Too small for the block size to matter much */
+        return MUL_SMALL;
+    if (mul_block_size == 0) {
+#ifdef BCD_MATH
+        mul_block_size = MUL_DEFAULT_BLOCK_SIZE;
+#else
+        mul_block_size = calibrate_mul_block_size();
+#endif
+    }
+    return mul_block_size;
 }
 
 typedef struct {
-    vartype_complexmatrix *left;
-    vartype_realmatrix *right;
-    vartype *result;
+    int variant;
+    const phloat *l, *r;
+    phloat *p;
+    int4 n, q, bs;
+    int4 i, h;
+} mul_panel_struct;
+
+/* Computes this thread's share of rows i through i + h - 1 of the result */
+static void mul_panel(void *arg, int t, int nthreads) {
+    mul_panel_struct *pan = (mul_panel_struct *) arg;
+    int4 n = pan->n;
+    int4 q = pan->q;
+    int4 bs = pan->bs;
+    int4 begin = pan->i + (int4) ((int8) pan->h * t / nthreads);
+    int4 end = pan->i + (int4) ((int8) pan->h * (t + 1) / nthreads);
     int4 i, j, k;
-    phloat sum_re, sum_im;
-    void (*completion)(int error, vartype *result);
-} mul_cr_data_struct;
-
-static mul_cr_data_struct *mul_cr_data;
-
-static int matrix_mul_cr_worker(int interrupted);
-
-static int matrix_mul_cr(vartype_complexmatrix *left, vartype_realmatrix *right,
-                         void (*completion)(int, vartype *)) {
-
-    mul_cr_data_struct *dat;
-    int error;
-
-    if (left->columns != right->rows) {
-        error = ERR_DIMENSION_ERROR;
-        goto finished;
-    }
-
-    if (!contains_no_strings(right)) {
-        error = ERR_ALPHA_DATA_IS_INVALID;
-        goto finished;
-    }
-
-    dat = (mul_cr_data_struct *) malloc(sizeof(mul_cr_data_struct));
-    if (dat == NULL) {
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
-    }
-
-    dat->result = new_complexmatrix(left->rows, right->columns);
-    if (dat->result == NULL) {
-        free(dat);
-        error = ERR_INSUFFICIENT_MEMORY;
-        goto finished;
+    for (j = 0; j < n; j += bs) {
+        int4 jjmax = n - j < bs ? n - j : bs;
+        for (k = 0; k < q; k += bs) {
+            int4 kkmax = q - k < bs ? q - k : bs;
+            for (i = begin; i < end; i++)
+                mul_row(pan->variant, pan->l, pan->r, pan->p, n, q,
+                        i, j, jjmax, k, kkmax);
+        }
     }
+}
 
-    dat->left = left;
-    dat->right = right;
-    dat->i = 0;
-    dat->j = 0;
-    dat->k = 0;
-    dat->sum_re = 0;
-    dat->sum_im = 0;
-    dat->completion = completion;
-
-    mul_cr_data = dat;
-    mode_interruptible = matrix_mul_cr_worker;
-    mode_stoppable = false;
-    return ERR_INTERRUPTIBLE;
+static int matrix_mul_worker(int interrupted);
 
-    finished:
-    completion(error, NULL);
-    return error;
-}
+int linalg_mul(const vartype *left, const vartype *right,
+                                    void (*completion)(int, vartype *)) {
 
-static int matrix_mul_cr_worker(int interrupted) {
-    mul_cr_data_struct *dat = mul_cr_data;
-    int count = 0;
-    int inf;
-    phloat *l = dat->left->array->data;
-    phloat *r = dat->right->array->data;
-    phloat *p = ((vartype_complexmatrix *) dat->result)->array->data;
-    int4 i = dat->i;
-    int4 j = dat->j;
-    int4 k = dat->k;
-    int4 m = dat->left->rows;
-    int4 n = dat->right->columns;
-    int4 q = dat->left->columns;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
+    mul_data_struct *dat;
+    int error;
+    int variant;
+    int4 m, n, q;
 
-    if (interrupted) {
-        dat->completion(ERR_INTERRUPTED, NULL);
-        free_vartype(dat->result);
-        free(dat);
-        return ERR_INTERRUPTED;
+    if (left->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *l = (vartype_realmatrix *) left;
+        m = l->rows;
+        q = l->columns;
+        if (!contains_no_strings(l)) {
+            error = ERR_ALPHA_DATA_IS_INVALID;
+            goto finished;
+        }
+        variant = MUL_RR;
+    } else {
+        vartype_complexmatrix *l = (vartype_complexmatrix *) left;
+        m = l->rows;
+        q = l->columns;
+        variant = MUL_CR;
     }
-
-    while (count++ < 1000) {
-        phloat tmp = r[k * n + j];
-        sum_re += tmp * l[2 * (i * q + k)];
-        sum_im += tmp * l[2 * (i * q + k) + 1];
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum_re)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+    if (right->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *r = (vartype_realmatrix *) right;
+        if (q != r->rows) {
+            error = ERR_DIMENSION_ERROR;
+            goto finished;
         }
-        if ((inf = p_isinf(sum_im)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
-                free_vartype(dat->result);
-                free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_im = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+        if (!contains_no_strings(r)) {
+            error = ERR_ALPHA_DATA_IS_INVALID;
+            goto finished;
         }
-        p[2 * (i * n + j)] = sum_re;
-        p[2 * (i * n + j) + 1] = sum_im;
-        sum_re = 0;
-        sum_im = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
-            continue;
-        else {
-            dat->completion(ERR_NONE, dat->result);
-            free(dat);
-            return ERR_NONE;
+        n = r->columns;
+    } else {
+        vartype_complexmatrix *r = (vartype_complexmatrix *) right;
+        if (q != r->rows) {
+            error = ERR_DIMENSION_ERROR;
+            goto finished;
         }
+        n = r->columns;
+        variant = variant == MUL_RR ? MUL_RC : MUL_CC;
     }
 
-    dat->i = i;
-    dat->j = j;
-    dat->k = k;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
-    return ERR_INTERRUPTIBLE;
-}
-
-typedef struct {
-    vartype_complexmatrix *left;
-    vartype_complexmatrix *right;
-    vartype *result;
-    int4 i, j, k;
-    phloat sum_re, sum_im;
-    void (*completion)(int error, vartype *result);
-} mul_cc_data_struct;
-
-static mul_cc_data_struct *mul_cc_data;
-
-static int matrix_mul_cc_worker(int interrupted);
-
-static int matrix_mul_cc(vartype_complexmatrix *left, vartype_complexmatrix *right,
-                         void (*completion)(int, vartype *)) {
-
-    mul_cc_data_struct *dat;
-    int error;
-
-    if (left->columns != right->rows) {
-        error = ERR_DIMENSION_ERROR;
-        goto finished;
-    }
-
-    dat = (mul_cc_data_struct *) malloc(sizeof(mul_cc_data_struct));
+    dat = (mul_data_struct *) malloc(sizeof(mul_data_struct));
     if (dat == NULL) {
         error = ERR_INSUFFICIENT_MEMORY;
         goto finished;
     }
 
-    dat->result = new_complexmatrix(left->rows, right->columns);
+    if (variant == MUL_RR)
+        dat->result = new_realmatrix(m, n);
+    else
+        dat->result = new_complexmatrix(m, n);
     if (dat->result == NULL) {
         free(dat);
         error = ERR_INSUFFICIENT_MEMORY;
         goto finished;
     }
 
-    dat->left = left;
-    dat->right = right;
+    dat->left = (vartype *) left;
+    dat->right = (vartype *) right;
+    dat->variant = variant;
+    dat->m = m;
+    dat->n = n;
+    dat->q = q;
+    dat->bs = get_mul_block_size(m, n, q);
+    dat->nthreads = linalg_threads((double) m * n * q);
     dat->i = 0;
     dat->j = 0;
     dat->k = 0;
-    dat->sum_re = 0;
-    dat->sum_im = 0;
+    dat->ii = 0;
     dat->completion = completion;
 
-    mul_cc_data = dat;
-    mode_interruptible = matrix_mul_cc_worker;
+    mul_data = dat;
+    mode_interruptible = matrix_mul_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 
@@ -874,21 +1224,29 @@ static int matrix_mul_cc(vartype_complexmatrix *left, vartype_complexmatrix *rig
     return error;
 }
 
-static int matrix_mul_cc_worker(int interrupted) {
-    mul_cc_data_struct *dat = mul_cc_data;
-    int count = 0;
-    int inf;
-    phloat *l = dat->left->array->data;
-    phloat *r = dat->right->array->data;
-    phloat *p = ((vartype_complexmatrix *) dat->result)->array->data;
+static phloat *matrix_data(vartype *m) {
+    if (m->type == TYPE_REALMATRIX)
+        return ((vartype_realmatrix *) m)->array->data;
+    else
+        return ((vartype_complexmatrix *) m)->array->data;
+}
+
+static int matrix_mul_worker(int interrupted) {
+    mul_data_struct *dat = mul_data;
+    int variant = dat->variant;
+    const phloat *l = matrix_data(dat->left);
+    const phloat *r = matrix_data(dat->right);
+    phloat *p = matrix_data(dat->result);
+    int count = variant == MUL_RR ? 1 : 2;
+    int4 m = dat->m;
+    int4 n = dat->n;
+    int4 q = dat->q;
+    int4 bs = dat->bs;
     int4 i = dat->i;
     int4 j = dat->j;
     int4 k = dat->k;
-    int4 m = dat->left->rows;
-    int4 n = dat->right->columns;
-    int4 q = dat->left->columns;
-    phloat sum_re = dat->sum_re;
-    phloat sum_im = dat->sum_im;
+    int4 ii = dat->ii;
+    int4 done = 0;
 
     if (interrupted) {
         dat->completion(ERR_INTERRUPTED, NULL);
@@ -897,88 +1255,94 @@ static int matrix_mul_cc_worker(int interrupted) {
         return ERR_INTERRUPTED;
     }
 
-    while (count++ < 1000) {
-        phloat l_re = l[2 * (i * q + k)];
-        phloat l_im = l[2 * (i * q + k) + 1];
-        phloat r_re = r[2 * (k * n + j)];
-        phloat r_im = r[2 * (k * n + j) + 1];
-        sum_re += l_re * r_re - l_im * r_im;
-        sum_im += l_im * r_re + l_re * r_im;
-        if (++k < q)
-            continue;
-        k = 0;
-        if ((inf = p_isinf(sum_re)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
+    if (dat->nthreads > 1) {
+        mul_panel_struct pan;
+        int4 h = (int4) (MUL_PAR_SLICE / ((double) n * q));
+        if (h < dat->nthreads)
+            h = dat->nthreads;
+        if (h > m - i)
+            h = m - i;
+        pan.variant = variant;
+        pan.l = l;
+        pan.r = r;
+        pan.p = p;
+        pan.n = n;
+        pan.q = q;
+        pan.bs = bs;
+        pan.i = i;
+        pan.h = h;
+        linalg_parallel(mul_panel, &pan, h < dat->nthreads ? h : dat->nthreads);
+        for (int4 row = i; row < i + h; row++) {
+            int error = mul_row_check(p, n, row, 0, n, count);
+            if (error != ERR_NONE) {
+                dat->completion(error, NULL);
                 free_vartype(dat->result);
                 free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_re = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+                return error;
+            }
         }
-        if ((inf = p_isinf(sum_im)) != 0) {
-            if (core_settings.matrix_outofrange && !flags.f.range_error_ignore){
-                dat->completion(ERR_OUT_OF_RANGE, NULL);
+        dat->i = i + h;
+        if (dat->i < m)
+            return ERR_INTERRUPTIBLE;
+        dat->completion(ERR_NONE, dat->result);
+        free(dat);
+        return ERR_NONE;
+    }
+
+    int4 iimax = m - i < bs ? m - i : bs;
+    int4 jjmax = n - j < bs ? n - j : bs;
+    int4 kkmax = q - k < bs ? q - k : bs;
+
+    while (done < MUL_SLICE) {
+        mul_row(variant, l, r, p, n, q, i + ii, j, jjmax, k, kkmax);
+        done += jjmax * kkmax;
+        if (k + kkmax == q) {
+            /* This row of the block is finished */
+            int error = mul_row_check(p, n, i + ii, j, jjmax, count);
+            if (error != ERR_NONE) {
+                dat->completion(error, NULL);
                 free_vartype(dat->result);
                 free(dat);
-                return ERR_OUT_OF_RANGE;
-            } else
-                sum_im = inf < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
+                return error;
+            }
         }
-        p[2 * (i * n + j)] = sum_re;
-        p[2 * (i * n + j) + 1] = sum_im;
-        sum_re = 0;
-        sum_im = 0;
-        if (++j < n)
-            continue;
-        j = 0;
-        if (++i < m)
+        if (++ii < iimax)
             continue;
-        else {
-            dat->completion(ERR_NONE, dat->result);
-            free(dat);
-            return ERR_NONE;
+        ii = 0;
+        k += bs;
+        if (k >= q) {
+            k = 0;
+            j += bs;
+            if (j >= n) {
+                j = 0;
+                i += bs;
+                if (i >= m) {
+                    dat->completion(ERR_NONE, dat->result);
+                    free(dat);
+                    return ERR_NONE;
+                }
+                iimax = m - i < bs ? m - i : bs;
+            }
+            jjmax = n - j < bs ? n - j : bs;
         }
+        kkmax = q - k < bs ? q - k : bs;
     }
 
     dat->i = i;
     dat->j = j;
     dat->k = k;
-    dat->sum_re = sum_re;
-    dat->sum_im = sum_im;
+    dat->ii = ii;
     return ERR_INTERRUPTIBLE;
 }
 
-int linalg_mul(const vartype *left, const vartype *right,
-                                    void (*completion)(int, vartype *)) {
-    if (left->type == TYPE_REALMATRIX) {
-        if (right->type == TYPE_REALMATRIX)
-            return matrix_mul_rr((vartype_realmatrix *) left,
-                                 (vartype_realmatrix *) right,
-                                 completion);
-        else
-            return matrix_mul_rc((vartype_realmatrix *) left,
-                                 (vartype_complexmatrix *) right,
-                                 completion);
-    } else {
-        if (right->type == TYPE_REALMATRIX)
-            return matrix_mul_cr((vartype_complexmatrix *) left,
-                                 (vartype_realmatrix *) right,
-                                 completion);
-        else
-            return matrix_mul_cc((vartype_complexmatrix *) left,
-                                 (vartype_complexmatrix *) right,
-                                 completion);
-    }
-}
-
 
 /**************************/
 /***** Matrix inverse *****/
 /**************************/
 
-static void (*linalg_inv_completion)(int error, vartype *det);
-static vartype *linalg_inv_result;
+static CORE_THREAD void (*linalg_inv_completion)(int error, vartype *det);
+static CORE_THREAD const vartype *linalg_inv_src;
+static CORE_THREAD vartype *linalg_inv_result;
 
 static int inv_r_completion1(int error, vartype_realmatrix *a, int4 *perm,
                                 phloat det);
@@ -989,9 +1353,61 @@ static int inv_c_completion1(int error, vartype_complexmatrix *a, int4 *perm,
 static void inv_c_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                 vartype_complexmatrix *b);
 
+/* Inverts src synchronously, if it is small enough, and not singular;
+ * otherwise, returns false, leaving it to the general code.
+ */
+static bool inv_small(const vartype *src, void (*completion)(int, vartype *),
+                      int *err) {
+    phloat a[2 * LU_SMALL_MAX * LU_SMALL_MAX];
+    int4 perm[LU_SMALL_MAX];
+    phloat det_re, det_im;
+    int4 i, n;
+    vartype *inv;
+
+    if (src->type == TYPE_REALMATRIX
+            && !contains_no_strings((vartype_realmatrix *) src))
+        return false;
+    if (!small_load(src, a, &n))
+        return false;
+    if (src->type == TYPE_REALMATRIX) {
+        if (!small_lu_r(a, n, perm, &det_re))
+            return false;
+        inv = new_realmatrix(n, n);
+        if (inv == NULL) {
+            *err = ERR_INSUFFICIENT_MEMORY;
+            return true;
+        }
+        phloat *b = ((vartype_realmatrix *) inv)->array->data;
+        for (i = 0; i < n; i++)
+            b[i * (n + 1)] = 1;
+        *err = small_solve_rr(a, n, perm, b, n);
+    } else {
+        if (!small_lu_c(a, n, perm, &det_re, &det_im))
+            return false;
+        inv = new_complexmatrix(n, n);
+        if (inv == NULL) {
+            *err = ERR_INSUFFICIENT_MEMORY;
+            return true;
+        }
+        phloat *b = ((vartype_complexmatrix *) inv)->array->data;
+        for (i = 0; i < n; i++)
+            b[2 * (i * (n + 1))] = 1;
+        *err = small_solve_cc(a, n, perm, b, n);
+    }
+    if (*err != ERR_NONE) {
+        free_vartype(inv);
+        inv = NULL;
+    }
+    completion(*err, inv);
+    return true;
+}
+
 int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
     int4 n;
     int4 *perm;
+    int err;
+    if (inv_small(src, completion, &err))
+        return err;
     if (src->type == TYPE_REALMATRIX) {
         vartype_realmatrix *ma = (vartype_realmatrix *) src;
         vartype *lu, *inv;
@@ -1000,6 +1416,15 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
             return ERR_DIMENSION_ERROR;
         if (!contains_no_strings(ma))
             return ERR_ALPHA_DATA_IS_INVALID;
+        if (lu_cache_lookup(src)) {
+            inv = new_realmatrix(n, n);
+            if (inv == NULL)
+                return ERR_INSUFFICIENT_MEMORY;
+            linalg_inv_completion = completion;
+            linalg_inv_result = inv;
+            return inv_r_completion1(ERR_NONE,
+                        (vartype_realmatrix *) lu_cache_lu, lu_cache_perm, 0);
+        }
         lu = new_realmatrix(n, n);
         if (lu == NULL)
             return ERR_INSUFFICIENT_MEMORY;
@@ -1016,6 +1441,7 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
         }
         matrix_copy(lu, src);
         linalg_inv_completion = completion;
+        linalg_inv_src = src;
         linalg_inv_result = inv;
         return lu_decomp_r((vartype_realmatrix *) lu, perm, inv_r_completion1);
     } else {
@@ -1024,6 +1450,16 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
         n = ma->rows;
         if (n != ma->columns)
             return ERR_DIMENSION_ERROR;
+        if (lu_cache_lookup(src)) {
+            inv = new_complexmatrix(n, n);
+            if (inv == NULL)
+                return ERR_INSUFFICIENT_MEMORY;
+            linalg_inv_completion = completion;
+            linalg_inv_result = inv;
+            return inv_c_completion1(ERR_NONE,
+                        (vartype_complexmatrix *) lu_cache_lu, lu_cache_perm,
+                        0, 0);
+        }
         lu = new_complexmatrix(n, n);
         if (lu == NULL)
             return ERR_INSUFFICIENT_MEMORY;
@@ -1040,6 +1476,7 @@ int linalg_inv(const vartype *src, void (*completion)(int, vartype *)) {
         }
         matrix_copy(lu, src);
         linalg_inv_completion = completion;
+        linalg_inv_src = src;
         linalg_inv_result = inv;
         return lu_decomp_c((vartype_complexmatrix *) lu, perm,
                                                     inv_c_completion1);
@@ -1056,6 +1493,8 @@ static int inv_r_completion1(int error, vartype_realmatrix *a, int4 *perm,
         return error;
     } else {
         int4 i, n = a->rows;
+        if (a != (vartype_realmatrix *) lu_cache_lu)
+            lu_cache_store(linalg_inv_src, (vartype *) a, perm);
         vartype_realmatrix *inv = (vartype_realmatrix *) linalg_inv_result;
         for (i = 0; i < n; i++)
             inv->array->data[i * (n + 1)] = 1;
@@ -1067,8 +1506,7 @@ static void inv_r_completion2(int error, vartype_realmatrix *a, int4 *perm,
                                 vartype_realmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_inv_result); /* Note: linalg_inv_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    lu_free((vartype *) a, perm);
     linalg_inv_completion(error, linalg_inv_result);
 }
 
@@ -1082,6 +1520,8 @@ static int inv_c_completion1(int error, vartype_complexmatrix *a, int4 *perm,
         return error;
     } else {
         int4 i, n = a->rows;
+        if (a != (vartype_complexmatrix *) lu_cache_lu)
+            lu_cache_store(linalg_inv_src, (vartype *) a, perm);
         vartype_complexmatrix *inv =
                             (vartype_complexmatrix *) linalg_inv_result;
         for (i = 0; i < n; i++)
@@ -1094,8 +1534,7 @@ static void inv_c_completion2(int error, vartype_complexmatrix *a, int4 *perm,
                                 vartype_complexmatrix *b) {
     if (error != ERR_NONE)
         free_vartype(linalg_inv_result); /* Note: linalg_inv_result == b */
-    free_vartype((vartype *) a);
-    free(perm);
+    lu_free((vartype *) a, perm);
     linalg_inv_completion(error, linalg_inv_result);
 }
 
@@ -1104,17 +1543,54 @@ static void inv_c_completion2(int error, vartype_complexmatrix *a, int4 *perm,
 /***** Matrix determinant *****/
 /******************************/
 
-static void (*linalg_det_completion)(int error, vartype *det);
-static bool linalg_det_prev_sm_err;
+static CORE_THREAD void (*linalg_det_completion)(int error, vartype *det);
+static CORE_THREAD bool linalg_det_prev_sm_err;
 
 static int det_r_completion(int error, vartype_realmatrix *a, int4 *perm,
                                     phloat det);
 static int det_c_completion(int error, vartype_complexmatrix *a, int4 *perm,
                                     phloat det_re, phloat det_im);
+static int det_r_result(int error, phloat det);
+static int det_c_result(int error, phloat det_re, phloat det_im);
+
+/* Computes the determinant synchronously, if src is small enough;
+ * otherwise, returns false, leaving it to the general code.
+ * A zero pivot simply means a zero determinant here, just like it does in
+ * the general code, which runs in 'singular matrix' error mode.
+ */
+static bool det_small(const vartype *src, void (*completion)(int, vartype *),
+                      int *err) {
+    phloat a[2 * LU_SMALL_MAX * LU_SMALL_MAX];
+    int4 perm[LU_SMALL_MAX];
+    phloat det_re, det_im;
+    int4 n;
+
+    if (src->type == TYPE_REALMATRIX
+            && !contains_no_strings((vartype_realmatrix *) src))
+        return false;
+    if (!small_load(src, a, &n))
+        return false;
+    linalg_det_completion = completion;
+    if (src->type == TYPE_REALMATRIX) {
+        if (!small_lu_r(a, n, perm, &det_re))
+            det_re = 0;
+        *err = det_r_result(ERR_NONE, det_re);
+    } else {
+        if (!small_lu_c(a, n, perm, &det_re, &det_im)) {
+            det_re = 0;
+            det_im = 0;
+        }
+        *err = det_c_result(ERR_NONE, det_re, det_im);
+    }
+    return true;
+}
 
 int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
     int4 n;
     int4 *perm;
+    int err;
+    if (det_small(src, completion, &err))
+        return err;
     if (src->type == TYPE_REALMATRIX) {
         vartype_realmatrix *ma = (vartype_realmatrix *) src;
         n = ma->rows;
@@ -1191,12 +1667,16 @@ int linalg_det(const vartype *src, void (*completion)(int, vartype *)) {
 
 static int det_r_completion(int error, vartype_realmatrix *a, int4 *perm,
                                          phloat det) {
-    vartype *det_v;
-
     core_settings.matrix_singularmatrix = linalg_det_prev_sm_err;
 
     free_vartype((vartype *) a);
     free(perm);
+    return det_r_result(error, det);
+}
+
+static int det_r_result(int error, phloat det) {
+    vartype *det_v;
+
     if (error == ERR_SINGULAR_MATRIX) {
         det = 0;
         error = ERR_NONE;
@@ -1222,12 +1702,16 @@ static int det_r_completion(int error, vartype_realmatrix *a, int4 *perm,
 
 static int det_c_completion(int error, vartype_complexmatrix *a, int4 *perm,
                                     phloat det_re, phloat det_im) {
-    vartype *det_v;
-
     core_settings.matrix_singularmatrix = linalg_det_prev_sm_err;
 
     free_vartype((vartype *) a);
     free(perm);
+    return det_c_result(error, det_re, det_im);
+}
+
+static int det_c_result(int error, phloat det_re, phloat det_im) {
+    vartype *det_v;
+
     if (error == ERR_SINGULAR_MATRIX) {
         det_re = 0;
         det_im = 0;
@@ -27,4 +27,15 @@ int linalg_mul(const vartype *left, const vartype *right,
 int linalg_inv(const vartype *src, void (*completion)(int, vartype *));
 int linalg_det(const vartype *src, void (*completion)(int, vartype *));
 
+/* The LU decomposition of the most recent divisor or inverted matrix is kept
+ * around, so repeated solves against the same matrix skip the factorization.
+ * Code that modifies a matrix in place must either call disentangle() first,
+ * which calls linalg_cache_release(), or, if it writes to the array even when
+ * it is shared, as the statistics functions do with REGS, call
+ * linalg_cache_invalidate().
+ */
+void linalg_cache_clear();
+void linalg_cache_release(const vartype *m);
+void linalg_cache_invalidate(const vartype *m);
+
 #endif
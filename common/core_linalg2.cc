@@ -16,6 +16,9 @@
  *****************************************************************************/
 
 #include <stdlib.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "core_linalg2.h"
 #include "core_globals.h"
@@ -31,10 +34,309 @@
         ;
 
 
+/******************************************/
+/***** Thread pool for matrix kernels *****/
+/******************************************/
+
+/* The pool is started the first time a job needs it, and its threads live
+ * until the process exits. The synchronization objects are allocated on the
+ * heap and never freed, so that they are not destroyed at exit while idle
+ * pool threads are still waiting on them. Jobs are run one at a time; if a
+ * job is submitted while another one is running (which can only happen in
+ * FREE42_REENTRANT builds, with several calculators sharing the pool), it is
+ * run on the calling thread instead.
+ */
+
+static std::mutex *pool_job_mutex = new std::mutex;
+static std::mutex *pool_mutex = new std::mutex;
+static std::condition_variable *pool_start_cond = new std::condition_variable;
+static std::condition_variable *pool_done_cond = new std::condition_variable;
+static int pool_size = 1;
+static unsigned int pool_generation = 0;
+static int pool_pending;
+static void (*pool_fn)(void *arg, int t, int nthreads);
+static void *pool_arg;
+static int pool_nthreads;
+
+static void pool_worker(int t) {
+    unsigned int gen = 0;
+    std::unique_lock<std::mutex> lock(*pool_mutex);
+    while (true) {
+        while (pool_generation == gen)
+            pool_start_cond->wait(lock);
+        gen = pool_generation;
+        if (t >= pool_nthreads)
+            continue;
+        void (*fn)(void *, int, int) = pool_fn;
+        void *arg = pool_arg;
+        int nthreads = pool_nthreads;
+        lock.unlock();
+        fn(arg, t, nthreads);
+        lock.lock();
+        if (--pool_pending == 0)
+            pool_done_cond->notify_one();
+    }
+}
+
+int linalg_threads(double work) {
+#ifdef BCD_MATH
+    /* The Intel library is built with DECIMAL_GLOBAL_EXCEPTION_FLAGS, so
+     * every decimal operation updates one process-wide status word, and
+     * running them on several threads at once would be a data race.
+     */
+    return 1;
+#else
+    int n = core_settings.matrix_threads;
+    if (n == 0)
+        n = (int) std::thread::hardware_concurrency();
+    if (n > LINALG_MAX_THREADS)
+        n = LINALG_MAX_THREADS;
+    if (n < 2 || work < LINALG_PARALLEL_WORK)
+        return 1;
+    return n;
+#endif
+}
+
+void linalg_parallel(void (*fn)(void *arg, int t, int nthreads), void *arg,
+                     int nthreads) {
+    if (nthreads > 1 && pool_job_mutex->try_lock()) {
+        std::unique_lock<std::mutex> lock(*pool_mutex);
+        while (pool_size < nthreads) {
+            std::thread(pool_worker, pool_size).detach();
+            pool_size++;
+        }
+        pool_fn = fn;
+        pool_arg = arg;
+        pool_nthreads = nthreads;
+        pool_pending = nthreads - 1;
+        pool_generation++;
+        pool_start_cond->notify_all();
+        lock.unlock();
+        fn(arg, 0, nthreads);
+        lock.lock();
+        while (pool_pending > 0)
+            pool_done_cond->wait(lock);
+        lock.unlock();
+        pool_job_mutex->unlock();
+    } else {
+        for (int t = 0; t < nthreads; t++)
+            fn(arg, t, nthreads);
+    }
+}
+
+
+/**************************/
+/***** Vector kernels *****/
+/**************************/
+
+/* linalg_dot() is a plain loop, which adds up its terms one at a time, in
+ * order, so the back-substitutions give exactly the same results as the
+ * loops it replaced.
+ * In the Binary build on x86, linalg_axpy() and linalg_find_inf() use SSE2
+ * or AVX; each element is handled independently and the multiplications and
+ * additions are never fused, so the results are the same as the scalar
+ * loops. The AVX versions are selected at run time when the CPU supports
+ * them; SSE2 is always available on x86-64.
+ */
+
+#if !defined(BCD_MATH) && (defined(__x86_64__) || defined(_M_X64))
+#define LINALG_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__)
+#define LINALG_AVX 1
+#include <immintrin.h>
+#endif
+#endif
+
+#ifdef LINALG_AVX
+static bool have_avx() {
+    static const bool avx = __builtin_cpu_supports("avx") != 0;
+    return avx;
+}
+
+__attribute__((target("avx")))
+static void axpy_avx(phloat *y, const phloat *x, phloat a, int4 n) {
+    __m256d va = _mm256_set1_pd(a);
+    int4 i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256d p = _mm256_mul_pd(va, _mm256_loadu_pd(x + i));
+        _mm256_storeu_pd(y + i, _mm256_add_pd(_mm256_loadu_pd(y + i), p));
+    }
+    for (; i < n; i++)
+        y[i] += a * x[i];
+}
+#endif
+
+void linalg_axpy(phloat *y, const phloat *x, phloat a, int4 n) {
+#ifdef LINALG_AVX
+    if (have_avx()) {
+        axpy_avx(y, x, a, n);
+        return;
+    }
+#endif
+    int4 i = 0;
+#ifdef LINALG_SSE2
+    __m128d va = _mm_set1_pd(a);
+    for (; i + 2 <= n; i += 2) {
+        __m128d p = _mm_mul_pd(va, _mm_loadu_pd(x + i));
+        _mm_storeu_pd(y + i, _mm_add_pd(_mm_loadu_pd(y + i), p));
+    }
+#endif
+    for (; i < n; i++)
+        y[i] += a * x[i];
+}
+
+phloat linalg_dot(phloat sum, const phloat *x, int4 incx,
+                  const phloat *y, int4 incy, int4 n) {
+    for (int4 i = 0; i < n; i++)
+        sum += x[i * incx] * y[i * incy];
+    return sum;
+}
+
+int4 linalg_find_inf(const phloat *x, int4 n) {
+    int4 i = 0;
+#ifdef LINALG_SSE2
+    /* Infinities are the only values whose absolute value compares equal
+     * to infinity; NaNs compare unequal to everything.
+     */
+    __m128d mask = _mm_castsi128_pd(_mm_set1_epi64x(0x7fffffffffffffffLL));
+    __m128d inf = _mm_set1_pd(HUGE_VAL);
+    for (; i + 2 <= n; i += 2) {
+        __m128d a = _mm_and_pd(_mm_loadu_pd(x + i), mask);
+        if (_mm_movemask_pd(_mm_cmpeq_pd(a, inf)) != 0)
+            break;
+    }
+#endif
+    for (; i < n; i++)
+        if (p_isinf(x[i]))
+            break;
+    return i;
+}
+
+
 /****************************/
 /***** LU decomposition *****/
 /****************************/
 
+/* Larger matrices are decomposed using a blocked right-looking algorithm
+ * instead of Crout's algorithm. The columns are processed in panels of
+ * LU_BLOCK columns. First, the panel itself is factored, choosing the
+ * pivots and updating only the columns within the panel; next, the rows of
+ * U to the right of the panel are computed; and finally, the trailing
+ * submatrix is updated with the product of the panel's columns of L and
+ * those rows of U. Nearly all the work is in that last step, which is done
+ * one row at a time, so each row stays in cache while all the updates from
+ * the panel are applied to it; when more than one CPU core is available,
+ * the rows are divided among threads. All three steps are done in slices of
+ * about LU_SLICE multiply-adds, so the calculator stays responsive even
+ * while the panel of a large matrix is being factored.
+ * The same pivots are chosen, and every element receives the same
+ * operations in the same order, so the results are identical to those of
+ * Crout's algorithm. The one exception is a pivot column containing an
+ * all-zero row, with singular matrix errors turned off, where Crout's
+ * algorithm leaves the elements below that row unreduced.
+ */
+
+#define LU_BLOCK 32
+#define LU_BLOCKED_MIN 16
+#ifdef BCD_MATH
+#define LU_SLICE 20000
+#else
+#define LU_SLICE 1000000
+#endif
+
+typedef struct {
+    phloat *a;
+    int4 n, k, kb, i, rows;
+} lu_update_struct;
+
+/* Subtracts x times the complex vector y from the complex vector p; the
+ * same operations as in the inner loops of lu_decomp_c_worker().
+ */
+static void lu_caxpy(phloat *p, const phloat *y, phloat xre, phloat xim,
+                     int4 n) {
+    int4 j = 0;
+#ifdef LINALG_SSE2
+    /* One complex number per vector: x * y = (xre, xre) * (yre, yim)
+     * + (-xim, xim) * (yim, yre)
+     */
+    __m128d vre = _mm_set1_pd(xre);
+    __m128d vim = _mm_set_pd(xim, -xim);
+    for (; j < 2 * n; j += 2) {
+        __m128d vy = _mm_loadu_pd(y + j);
+        __m128d t = _mm_add_pd(_mm_mul_pd(vre, vy),
+                        _mm_mul_pd(vim, _mm_shuffle_pd(vy, vy, 1)));
+        _mm_storeu_pd(p + j, _mm_sub_pd(_mm_loadu_pd(p + j), t));
+    }
+#endif
+    for (; j < 2 * n; j += 2) {
+        phloat yre = y[j];
+        phloat yim = y[j + 1];
+        p[j] -= xre * yre - xim * yim;
+        p[j + 1] -= xim * yre + xre * yim;
+    }
+}
+
+/* Applies the updates from panel columns k through k + kb - 1 to this
+ * thread's share of rows i through i + rows - 1 of the trailing submatrix.
+ */
+static void lu_update_r(void *arg, int t, int nthreads) {
+    lu_update_struct *u = (lu_update_struct *) arg;
+    phloat *a = u->a;
+    int4 n = u->n;
+    int4 k = u->k;
+    int4 kb = u->kb;
+    int4 begin = u->i + (int4) ((int8) u->rows * t / nthreads);
+    int4 end = u->i + (int4) ((int8) u->rows * (t + 1) / nthreads);
+    for (int4 i = begin; i < end; i++) {
+        phloat *pi = a + i * n;
+        /* Adding -l * pk[j] rounds exactly like subtracting l * pk[j] */
+        for (int4 p = k; p < k + kb; p++)
+            linalg_axpy(pi + k + kb, a + p * n + k + kb, -pi[p], n - k - kb);
+    }
+}
+
+static void lu_update_c(void *arg, int t, int nthreads) {
+    lu_update_struct *u = (lu_update_struct *) arg;
+    phloat *a = u->a;
+    int4 n = u->n;
+    int4 k = u->k;
+    int4 kb = u->kb;
+    int4 begin = u->i + (int4) ((int8) u->rows * t / nthreads);
+    int4 end = u->i + (int4) ((int8) u->rows * (t + 1) / nthreads);
+    for (int4 i = begin; i < end; i++) {
+        phloat *pi = a + 2 * i * n;
+        for (int4 p = k; p < k + kb; p++)
+            lu_caxpy(pi + 2 * (k + kb), a + 2 * (p * n + k + kb),
+                     pi[2 * p], pi[2 * p + 1], n - k - kb);
+    }
+}
+
+/* Applies the trailing-submatrix updates for the panel starting at column
+ * k, continuing at row *i, until either all rows are done or the work
+ * budget for this slice, *work, is used up.
+ */
+static void lu_update_trailing(void (*fn)(void *, int, int), phloat *a,
+                               int4 n, int4 k, int4 kb, int4 *i,
+                               int8 *work, int nthreads) {
+    int8 rowwork = (int8) kb * (n - k - kb);
+    int4 chunk = rowwork == 0 ? n : (int4) (LU_SLICE / rowwork);
+    if (chunk < nthreads)
+        chunk = nthreads;
+    lu_update_struct u;
+    u.a = a;
+    u.n = n;
+    u.k = k;
+    u.kb = kb;
+    while (*i < n && *work < LU_SLICE) {
+        u.i = *i;
+        u.rows = n - *i < chunk ? n - *i : chunk;
+        linalg_parallel(fn, &u, nthreads < u.rows ? nthreads : u.rows);
+        *i += u.rows;
+        *work += u.rows * rowwork;
+    }
+}
+
 typedef struct {
     vartype_realmatrix *a;
     int4 *perm;
@@ -42,12 +344,14 @@ typedef struct {
     int4 i, imax, j, k;
     phloat max, tmp, sum, *scale;
     int state;
+    int nthreads;
     int (*completion)(int, vartype_realmatrix *, int4 *, phloat);
 } lu_r_data_struct;
 
-lu_r_data_struct *lu_r_data;
+CORE_THREAD lu_r_data_struct *lu_r_data;
 
 static int lu_decomp_r_worker(int interrupted);
+static int lu_decomp_r_blocked_worker(int interrupted);
 
 int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_realmatrix *, int4 *, phloat)) {
@@ -68,9 +372,14 @@ int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
     dat->completion = completion;
 
     dat->state = 0;
+    dat->i = 0;
+    dat->nthreads = linalg_threads((double) a->rows * a->rows * a->rows / 3);
 
     lu_r_data = dat;
-    mode_interruptible = lu_decomp_r_worker;
+    if (a->rows >= LU_BLOCKED_MIN)
+        mode_interruptible = lu_decomp_r_blocked_worker;
+    else
+        mode_interruptible = lu_decomp_r_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 }
@@ -218,19 +527,190 @@ static int lu_decomp_r_worker(int interrupted) {
 }
 
 
+static int lu_decomp_r_blocked_worker(int interrupted) {
+    lu_r_data_struct *dat = lu_r_data;
+
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    phloat *scale = dat->scale;
+    int4 *perm = dat->perm;
+    int4 i, j, k, kb, p, imax;
+    phloat max, tmp;
+    int8 work = 0;
+    int err;
+
+    if (interrupted) {
+        free(scale);
+        err = dat->completion(ERR_INTERRUPTED, dat->a, perm, 0);
+        free(dat);
+        return err;
+    }
+
+    if (dat->state == 0) {
+        for (i = dat->i; i < n && work < LU_SLICE; i++) {
+            max = 0;
+            for (j = 0; j < n; j++) {
+                tmp = a[i * n + j];
+                if (tmp < 0)
+                    tmp = -tmp;
+                if (tmp > max)
+                    max = tmp;
+            }
+            scale[i] = max;
+            work += n;
+        }
+        dat->i = i;
+        if (i < n)
+            return ERR_INTERRUPTIBLE;
+        dat->det = 1;
+        dat->k = 0;
+        dat->state = 1;
+    }
+
+    while (work < LU_SLICE) {
+        k = dat->k;
+        kb = n - k < LU_BLOCK ? n - k : LU_BLOCK;
+
+        switch (dat->state) {
+            case 1:
+                if (k == n)
+                    goto done;
+                dat->j = k;
+                dat->state = 3;
+                /* fall through */
+
+            case 3:
+                /* Factor the panel, one column at a time: first, choose the
+                 * pivot for column p...
+                 */
+                p = dat->j;
+                max = 0;
+                imax = p;
+                for (i = p; i < n; i++) {
+                    if (scale[i] == 0) {
+                        imax = i;
+                        break;
+                    }
+                    tmp = a[i * n + p];
+                    tmp = (tmp < 0 ? -tmp : tmp) / scale[i];
+                    if (tmp > max) {
+                        imax = i;
+                        max = tmp;
+                    }
+                }
+
+                if (p != imax) {
+                    for (j = 0; j < n; j++) {
+                        tmp = a[imax * n + j];
+                        a[imax * n + j] = a[p * n + j];
+                        a[p * n + j] = tmp;
+                    }
+                    dat->det = -dat->det;
+                    scale[imax] = scale[p];
+                }
+
+                perm[p] = imax;
+                if (a[p * n + p] == 0) {
+                    if (core_settings.matrix_singularmatrix) {
+                        free(scale);
+                        err = dat->completion(ERR_SINGULAR_MATRIX, dat->a,
+                                              perm, 0);
+                        free(dat);
+                        return err;
+                    } else {
+                        /* Same substitution as in lu_decomp_r_worker() */
+                        phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
+                        phloat tiny;
+                        if (scale[p] == 0)
+                            tiny = tiniest;
+                        else {
+                            tiny = pow(10, floor(log10(scale[p])) - 20);
+                            if (tiny < tiniest)
+                                tiny = tiniest;
+                        }
+                        a[p * n + p] = tiny;
+                    }
+                }
+                dat->det *= a[p * n + p];
+                dat->tmp = 1 / a[p * n + p];
+                work += n - p;
+                dat->i = p + 1;
+                dat->state = 4;
+                break;
+
+            case 4:
+                /* ...then eliminate below it, within the panel */
+                p = dat->j;
+                tmp = dat->tmp;
+                for (i = dat->i; i < n && work < LU_SLICE; i++) {
+                    phloat *pi = a + i * n;
+                    pi[p] *= tmp;
+                    linalg_axpy(pi + p + 1, a + p * n + p + 1, -pi[p],
+                                k + kb - p - 1);
+                    work += k + kb - p;
+                }
+                dat->i = i;
+                if (i < n)
+                    break;
+                if (++dat->j < k + kb) {
+                    dat->state = 3;
+                    break;
+                }
+                dat->i = k + 1;
+                dat->state = 5;
+                /* fall through */
+
+            case 5:
+                /* Compute the rows of U to the right of the panel */
+                for (i = dat->i; i < k + kb && work < LU_SLICE; i++) {
+                    phloat *pi = a + i * n;
+                    for (p = k; p < i; p++)
+                        linalg_axpy(pi + k + kb, a + p * n + k + kb, -pi[p],
+                                    n - k - kb);
+                    work += (int8) (i - k) * (n - k - kb);
+                }
+                dat->i = i;
+                if (i < k + kb)
+                    break;
+                dat->i = k + kb;
+                dat->state = 2;
+                /* fall through */
+
+            case 2:
+                lu_update_trailing(lu_update_r, a, n, k, kb, &dat->i, &work,
+                                   dat->nthreads);
+                if (dat->i == n) {
+                    dat->k = k + kb;
+                    dat->state = 1;
+                }
+                break;
+        }
+    }
+    return ERR_INTERRUPTIBLE;
+
+    done:
+    free(scale);
+    err = dat->completion(ERR_NONE, dat->a, perm, dat->det);
+    free(dat);
+    return err;
+}
+
+
 typedef struct {
     vartype_complexmatrix *a;
     int4 *perm;
     phloat det_re, det_im;
     int4 i, imax, j, k;
-    phloat max, tmp, tmp_re, tmp_im, sum_re, sum_im, *scale;
+    phloat max, tmp, tmp_re, tmp_im, sum_re, sum_im, s_re, s_im, *scale;
     int state;
+    int nthreads;
     int (*completion)(int, vartype_complexmatrix *, int4 *, phloat, phloat);
 } lu_c_data_struct;
 
-lu_c_data_struct *lu_c_data;
+CORE_THREAD lu_c_data_struct *lu_c_data;
 
 static int lu_decomp_c_worker(int interrupted);
+static int lu_decomp_c_blocked_worker(int interrupted);
 
 int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
                 int (*completion)(int, vartype_complexmatrix *,
@@ -252,9 +732,14 @@ int lu_decomp_c(vartype_complexmatrix *a, int4 *perm,
     dat->completion = completion;
 
     dat->state = 0;
+    dat->i = 0;
+    dat->nthreads = linalg_threads((double) a->rows * a->rows * a->rows / 3);
 
     lu_c_data = dat;
-    mode_interruptible = lu_decomp_c_worker;
+    if (a->rows >= LU_BLOCKED_MIN)
+        mode_interruptible = lu_decomp_c_blocked_worker;
+    else
+        mode_interruptible = lu_decomp_c_worker;
     mode_stoppable = false;
     return ERR_INTERRUPTIBLE;
 }
@@ -280,11 +765,12 @@ static int lu_decomp_c_worker(int interrupted) {
     phloat tmp_im = dat->tmp_im;
     phloat sum_re = dat->sum_re;
     phloat sum_im = dat->sum_im;
+    phloat s_re = dat->s_re;
+    phloat s_im = dat->s_im;
 
     phloat xre, xim, yre, yim;
     phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
     phloat tiny;
-    phloat s_re, s_im;
 
     if (interrupted) {
         free(scale);
@@ -334,6 +820,7 @@ static int lu_decomp_c_worker(int interrupted) {
         }
 
         max = 0;
+        imax = j;
         for (i = j; i < n; i++) {
             sum_re = a[2 * (i * n + j)];
             sum_im = a[2 * (i * n + j) + 1];
@@ -380,7 +867,7 @@ static int lu_decomp_c_worker(int interrupted) {
         if (tmp_re == 0 && tmp_im == 0) {
             if (core_settings.matrix_singularmatrix) {
                 free(scale);
-                err = dat->completion(ERR_NONE, dat->a, perm, 0, 0);
+                err = dat->completion(ERR_SINGULAR_MATRIX, dat->a, perm, 0, 0);
                 free(dat);
                 return err;
             } else {
@@ -433,10 +920,192 @@ static int lu_decomp_c_worker(int interrupted) {
     dat->tmp_im = tmp_im;
     dat->sum_re = sum_re;
     dat->sum_im = sum_im;
+    dat->s_re = s_re;
+    dat->s_im = s_im;
     return ERR_INTERRUPTIBLE;
 }
 
 
+static int lu_decomp_c_blocked_worker(int interrupted) {
+    lu_c_data_struct *dat = lu_c_data;
+
+    phloat *a = dat->a->array->data;
+    int4 n = dat->a->rows;
+    phloat *scale = dat->scale;
+    int4 *perm = dat->perm;
+    int4 i, j, k, kb, p, imax;
+    phloat max, tmp, tmp_re, tmp_im, s_re, s_im;
+    int8 work = 0;
+    int err;
+
+    if (interrupted) {
+        free(scale);
+        err = dat->completion(ERR_INTERRUPTED, dat->a, perm, 0, 0);
+        free(dat);
+        return err;
+    }
+
+    if (dat->state == 0) {
+        for (i = dat->i; i < n && work < LU_SLICE; i++) {
+            max = 0;
+            for (j = 0; j < n; j++) {
+                tmp = hypot(a[2 * (i * n + j)], a[2 * (i * n + j) + 1]);
+                if (tmp > max)
+                    max = tmp;
+            }
+            scale[i] = max;
+            work += n;
+        }
+        dat->i = i;
+        if (i < n)
+            return ERR_INTERRUPTIBLE;
+        dat->det_re = 1;
+        dat->det_im = 0;
+        dat->k = 0;
+        dat->state = 1;
+    }
+
+    while (work < LU_SLICE) {
+        k = dat->k;
+        kb = n - k < LU_BLOCK ? n - k : LU_BLOCK;
+
+        switch (dat->state) {
+            case 1:
+                if (k == n)
+                    goto done;
+                dat->j = k;
+                dat->state = 3;
+                /* fall through */
+
+            case 3:
+                /* Factor the panel, one column at a time: first, choose the
+                 * pivot for column p...
+                 */
+                p = dat->j;
+                max = 0;
+                imax = p;
+                for (i = p; i < n; i++) {
+                    if (scale[i] == 0) {
+                        imax = i;
+                        break;
+                    }
+                    tmp = hypot(a[2 * (i * n + p)], a[2 * (i * n + p) + 1])
+                                / scale[i];
+                    if (tmp > max) {
+                        imax = i;
+                        max = tmp;
+                    }
+                }
+
+                if (p != imax) {
+                    for (j = 0; j < 2 * n; j++) {
+                        tmp = a[2 * imax * n + j];
+                        a[2 * imax * n + j] = a[2 * p * n + j];
+                        a[2 * p * n + j] = tmp;
+                    }
+                    dat->det_re = -dat->det_re;
+                    dat->det_im = -dat->det_im;
+                    scale[imax] = scale[p];
+                }
+
+                perm[p] = imax;
+                tmp_re = a[2 * (p * n + p)];
+                tmp_im = a[2 * (p * n + p) + 1];
+                if (tmp_re == 0 && tmp_im == 0) {
+                    if (core_settings.matrix_singularmatrix) {
+                        free(scale);
+                        err = dat->completion(ERR_SINGULAR_MATRIX, dat->a,
+                                              perm, 0, 0);
+                        free(dat);
+                        return err;
+                    } else {
+                        /* Same substitution as in lu_decomp_c_worker() */
+                        phloat tiniest = 1e20 / POS_HUGE_PHLOAT;
+                        phloat tiny;
+                        if (scale[p] == 0)
+                            tiny = tiniest;
+                        else {
+                            tiny = pow(10, floor(log10(scale[p])) - 20);
+                            if (tiny < tiniest)
+                                tiny = tiniest;
+                        }
+                        a[2 * (p * n + p)] = tmp_re = tiny;
+                        a[2 * (p * n + p) + 1] = tmp_im = 0;
+                    }
+                }
+                tmp = dat->det_re * tmp_re - dat->det_im * tmp_im;
+                dat->det_im = dat->det_im * tmp_re + dat->det_re * tmp_im;
+                dat->det_re = tmp;
+                tmp = hypot(tmp_re, tmp_im);
+                dat->s_re = tmp_re / tmp / tmp;
+                dat->s_im = -tmp_im / tmp / tmp;
+                work += n - p;
+                dat->i = p + 1;
+                dat->state = 4;
+                break;
+
+            case 4:
+                /* ...then eliminate below it, within the panel */
+                p = dat->j;
+                s_re = dat->s_re;
+                s_im = dat->s_im;
+                for (i = dat->i; i < n && work < LU_SLICE; i++) {
+                    phloat *pi = a + 2 * i * n;
+                    tmp_re = pi[2 * p];
+                    tmp_im = pi[2 * p + 1];
+                    pi[2 * p] = tmp_re * s_re - tmp_im * s_im;
+                    pi[2 * p + 1] = tmp_im * s_re + tmp_re * s_im;
+                    lu_caxpy(pi + 2 * (p + 1), a + 2 * (p * n + p + 1),
+                             pi[2 * p], pi[2 * p + 1], k + kb - p - 1);
+                    work += k + kb - p;
+                }
+                dat->i = i;
+                if (i < n)
+                    break;
+                if (++dat->j < k + kb) {
+                    dat->state = 3;
+                    break;
+                }
+                dat->i = k + 1;
+                dat->state = 5;
+                /* fall through */
+
+            case 5:
+                /* Compute the rows of U to the right of the panel */
+                for (i = dat->i; i < k + kb && work < LU_SLICE; i++) {
+                    phloat *pi = a + 2 * i * n;
+                    for (p = k; p < i; p++)
+                        lu_caxpy(pi + 2 * (k + kb), a + 2 * (p * n + k + kb),
+                                 pi[2 * p], pi[2 * p + 1], n - k - kb);
+                    work += (int8) (i - k) * (n - k - kb);
+                }
+                dat->i = i;
+                if (i < k + kb)
+                    break;
+                dat->i = k + kb;
+                dat->state = 2;
+                /* fall through */
+
+            case 2:
+                lu_update_trailing(lu_update_c, a, n, k, kb, &dat->i, &work,
+                                   dat->nthreads);
+                if (dat->i == n) {
+                    dat->k = k + kb;
+                    dat->state = 1;
+                }
+                break;
+        }
+    }
+    return ERR_INTERRUPTIBLE;
+
+    done:
+    free(scale);
+    err = dat->completion(ERR_NONE, dat->a, perm, dat->det_re, dat->det_im);
+    free(dat);
+    return err;
+}
+
+
 /*****************************/
 /***** Back-substitution *****/
 /*****************************/
@@ -451,7 +1120,7 @@ typedef struct {
     void (*completion)(int, vartype_realmatrix *, int4 *, vartype_realmatrix *);
 } backsub_rr_data_struct;
 
-static backsub_rr_data_struct *backsub_rr_data;
+static CORE_THREAD backsub_rr_data_struct *backsub_rr_data;
 
 static int lu_backsubst_rr_worker(int interrupted);
 
@@ -515,21 +1184,22 @@ static int lu_backsubst_rr_worker(int interrupted) {
             ll = perm[i];
             sum = b[ll * q + k];
             b[ll * q + k] = b[i * q + k];
+            /* Negating the sum before and after linalg_dot() rounds exactly
+             * like subtracting the terms one at a time.
+             */
             if (ii != -1) {
-                for (j = ii; j < i; j++) {
-                    sum -= a[i * n + j] * b[j * q + k];
-                    STATE(1);
-                }
+                sum = -linalg_dot(-sum, a + i * n + ii, 1,
+                                  b + ii * q + k, q, i - ii);
+                count -= i - ii;
             } else if (sum != 0)
                 ii = i;
             b[i * q + k] = sum;
+            STATE(1);
         }
         for (i = n - 1; i >= 0; i--) {
-            sum = b[i * q + k];
-            for (j = i + 1; j < n; j++) {
-                sum -= a[i * n + j] * b[j * q + k];
-                STATE(2);
-            }
+            sum = -linalg_dot(-b[i * q + k], a + i * n + i + 1, 1,
+                              b + (i + 1) * q + k, q, n - i - 1);
+            count -= n - i - 1;
             t = sum / a[i * n + i];
             if (p_isinf(t) || p_isnan(t)) {
                 if (core_settings.matrix_outofrange
@@ -539,6 +1209,7 @@ static int lu_backsubst_rr_worker(int interrupted) {
                     t = p_isinf(t) < 0 ? NEG_HUGE_PHLOAT : POS_HUGE_PHLOAT;
             }
             b[i * q + k] = t;
+            STATE(2);
         }
     }
 
@@ -567,7 +1238,7 @@ typedef struct {
                                             vartype_complexmatrix *);
 } backsub_rc_data_struct;
 
-static backsub_rc_data_struct *backsub_rc_data;
+static CORE_THREAD backsub_rc_data_struct *backsub_rc_data;
 
 static int lu_backsubst_rc_worker(int interrupted);
 
@@ -704,7 +1375,7 @@ typedef struct {
                                             vartype_complexmatrix *);
 } backsub_cc_data_struct;
 
-static backsub_cc_data_struct *backsub_cc_data;
+static CORE_THREAD backsub_cc_data_struct *backsub_cc_data;
 
 static int lu_backsubst_cc_worker(int interrupted);
 
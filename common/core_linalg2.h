@@ -20,6 +20,34 @@
 
 #include "core_globals.h"
 
+/* Parallel execution of large matrix operations.
+ * linalg_threads() returns the number of threads to use for a job of the
+ * given size, in multiply-adds; 1 means the job should be done the normal
+ * way, on the calling thread. It never returns more than LINALG_MAX_THREADS,
+ * and always returns 1 in the Decimal build.
+ * linalg_parallel() calls fn(arg, t, nthreads) for t = 0 .. nthreads - 1,
+ * each on its own thread, and returns when all of them have finished. fn
+ * must not use any core state, other than what it is given through arg.
+ */
+#define LINALG_PARALLEL_WORK (64.0 * 64.0 * 64.0)
+#define LINALG_MAX_THREADS 16
+
+int linalg_threads(double work);
+void linalg_parallel(void (*fn)(void *arg, int t, int nthreads), void *arg,
+                     int nthreads);
+
+/* Vector kernels. linalg_axpy() and linalg_find_inf() are SIMD-accelerated
+ * in the Binary build on x86; linalg_dot() adds its terms in order.
+ * linalg_axpy() adds a * x[i] to y[i], for i = 0 .. n - 1.
+ * linalg_dot() returns sum plus the sum of x[i * incx] * y[i * incy].
+ * linalg_find_inf() returns the index of the first infinity in x[0] ..
+ * x[n - 1], or n if there are none.
+ */
+void linalg_axpy(phloat *y, const phloat *x, phloat a, int4 n);
+phloat linalg_dot(phloat sum, const phloat *x, int4 incx,
+                  const phloat *y, int4 incy, int4 n);
+int4 linalg_find_inf(const phloat *x, int4 n);
+
 int lu_decomp_r(vartype_realmatrix *a, int4 *perm,
                        int (*completion)(int, vartype_realmatrix *,
                                           int4 *, phloat));
@@ -20,6 +20,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <time.h>
 
 #include "core_main.h"
 #include "core_commands2.h"
@@ -28,6 +29,7 @@
 #include "core_display.h"
 #include "core_helpers.h"
 #include "core_keydown.h"
+#include "core_linalg1.h"
 #include "core_math1.h"
 #include "core_sto_rcl.h"
 #include "core_tables.h"
@@ -52,14 +54,74 @@ static void set_shift(bool state) {
 static void continue_running();
 static void stop_interruptible();
 static int handle_error(int error);
+static void profile_dump();
 
-int repeating = 0;
-int repeating_shift;
-int repeating_key;
+CORE_THREAD int repeating = 0;
+CORE_THREAD int repeating_shift;
+CORE_THREAD int repeating_key;
 
-static int4 oldpc;
+static CORE_THREAD int4 oldpc;
 
-core_settings_struct core_settings;
+CORE_THREAD core_settings_struct core_settings;
+CORE_THREAD core_run_stats_struct core_run_stats;
+
+/* Number of instructions executed between calls to shell_wants_cpu(),
+ * when core_settings.run_slice_ms is nonzero. Calibrated as we go.
+ */
+static CORE_THREAD int run_batch = 1;
+static CORE_THREAD bool in_continue_running = false;
+#define MAX_RUN_BATCH 1048576
+
+/* Execution profiler state; see profile_start() */
+typedef struct {
+    int prgm;
+    int4 pc;
+    int4 hits;
+} prof_line_struct;
+
+typedef struct {
+    int from_prgm;
+    int4 from_pc;
+    int to_prgm;
+    int4 to_pc;
+    int4 count;
+} prof_call_struct;
+
+static CORE_THREAD bool prof_active = false;
+static CORE_THREAD uint4 prof_start_ms;
+static CORE_THREAD int8 prof_insns;
+static CORE_THREAD int8 prof_cmd_count[CMD_SENTINEL];
+static CORE_THREAD clock_t prof_cmd_time[CMD_SENTINEL];
+static CORE_THREAD int prof_interruptible_cmd = CMD_NONE;
+/* Open-addressing hash tables; capacities are powers of two */
+static CORE_THREAD prof_line_struct *prof_lines = NULL;
+static CORE_THREAD int4 prof_lines_count, prof_lines_capacity;
+static CORE_THREAD prof_call_struct *prof_calls = NULL;
+static CORE_THREAD int4 prof_calls_count, prof_calls_capacity;
+/* When a program stops while an instruction is being profiled, e.g. at RTN
+ * or STOP, the report is written after that instruction has been recorded */
+static CORE_THREAD bool prof_in_insn = false;
+static CORE_THREAD bool prof_dump_pending = false;
+
+/* Execution trace ring buffer; see trace_record() */
+#define TRACE_INSN 0
+#define TRACE_SOLVE 1
+#define TRACE_INTEG 2
+
+typedef struct {
+    int8 seq;
+    uint4 ms;
+    int prgm;
+    int4 pc;
+    short cmd;
+    char kind;
+} trace_entry;
+
+static CORE_THREAD trace_entry *trace_buf = NULL;
+static CORE_THREAD int4 trace_capacity = 0;
+static CORE_THREAD int4 trace_next = 0;
+static CORE_THREAD int8 trace_seq = 0;
+static CORE_THREAD uint4 trace_ms;
 
 void core_init(int read_saved_state, int4 version, const char *state_file_name, int offset) {
 
@@ -177,6 +239,7 @@ void core_cleanup() {
     reg_t = NULL;
     free_vartype(reg_lastx);
     reg_lastx = NULL;
+    linalg_cache_clear();
     purge_all_vars();
     clear_all_prgms();
     if (vars != NULL) {
@@ -185,6 +248,9 @@ void core_cleanup() {
         vars_capacity = 0;
     }
     clean_vartype_pools();
+    free(trace_buf);
+    trace_buf = NULL;
+    trace_capacity = 0;
 }
 
 void core_repaint_display() {
@@ -268,7 +334,16 @@ int core_keydown(int key, int *enqueued, int *repeat) {
             }
             set_shift(false);
         }
-        error = mode_interruptible(0);
+        if (prof_active && prof_interruptible_cmd != CMD_NONE) {
+            clock_t start = clock();
+            prof_in_insn = true;
+            error = mode_interruptible(0);
+            prof_in_insn = false;
+            prof_cmd_time[prof_interruptible_cmd] += clock() - start;
+            if (prof_dump_pending)
+                profile_dump();
+        } else
+            error = mode_interruptible(0);
 		if (error == ERR_INTERRUPTIBLE) {
             /* Still not done */
             return 1;
@@ -761,9 +836,9 @@ char *core_list_programs() {
 // This would have been a lot cleaner using fmemopen(), but that's only supported
 // in iOS 11 and later, and I'm not ready to give up on iOS 8 through 10 yet.
 
-static char *raw_buf;
-static size_t raw_size;
-static size_t raw_pos;
+static CORE_THREAD char *raw_buf;
+static CORE_THREAD size_t raw_size;
+static CORE_THREAD size_t raw_pos;
 
 static int raw_getc() {
     if (raw_buf == NULL)
@@ -3743,10 +3818,390 @@ void set_alpha_entry(bool state) {
     mode_alpha_entry = state;
 }
 
+/**********************/
+/* Execution profiler */
+/**********************/
+
+static void profile_start() {
+    prof_active = true;
+    prof_start_ms = shell_milliseconds();
+    prof_insns = 0;
+    for (int i = 0; i < CMD_SENTINEL; i++) {
+        prof_cmd_count[i] = 0;
+        prof_cmd_time[i] = 0;
+    }
+    prof_interruptible_cmd = CMD_NONE;
+    free(prof_lines);
+    prof_lines = NULL;
+    prof_lines_count = prof_lines_capacity = 0;
+    free(prof_calls);
+    prof_calls = NULL;
+    prof_calls_count = prof_calls_capacity = 0;
+}
+
+static uint4 prof_hash(int prgm, int4 pc) {
+    return ((uint4) prgm * 0x9e3779b1 + (uint4) pc) * 0x85ebca6b;
+}
+
+static prof_line_struct *prof_line(int prgm, int4 pc) {
+    if (prof_lines_count * 2 >= prof_lines_capacity) {
+        int4 newcap = prof_lines_capacity == 0 ? 1024 : prof_lines_capacity * 2;
+        prof_line_struct *newlines = (prof_line_struct *) malloc(newcap * sizeof(prof_line_struct));
+        if (newlines == NULL)
+            return NULL;
+        for (int4 i = 0; i < newcap; i++)
+            newlines[i].prgm = -1;
+        for (int4 i = 0; i < prof_lines_capacity; i++) {
+            prof_line_struct *l = prof_lines + i;
+            if (l->prgm == -1)
+                continue;
+            int4 j = prof_hash(l->prgm, l->pc) & (newcap - 1);
+            while (newlines[j].prgm != -1)
+                j = (j + 1) & (newcap - 1);
+            newlines[j] = *l;
+        }
+        free(prof_lines);
+        prof_lines = newlines;
+        prof_lines_capacity = newcap;
+    }
+    int4 i = prof_hash(prgm, pc) & (prof_lines_capacity - 1);
+    while (true) {
+        prof_line_struct *l = prof_lines + i;
+        if (l->prgm == prgm && l->pc == pc)
+            return l;
+        if (l->prgm == -1) {
+            l->prgm = prgm;
+            l->pc = pc;
+            l->hits = 0;
+            prof_lines_count++;
+            return l;
+        }
+        i = (i + 1) & (prof_lines_capacity - 1);
+    }
+}
+
+static prof_call_struct *prof_call(int from_prgm, int4 from_pc, int to_prgm, int4 to_pc) {
+    if (prof_calls_count * 2 >= prof_calls_capacity) {
+        int4 newcap = prof_calls_capacity == 0 ? 64 : prof_calls_capacity * 2;
+        prof_call_struct *newcalls = (prof_call_struct *) malloc(newcap * sizeof(prof_call_struct));
+        if (newcalls == NULL)
+            return NULL;
+        for (int4 i = 0; i < newcap; i++)
+            newcalls[i].from_prgm = -1;
+        for (int4 i = 0; i < prof_calls_capacity; i++) {
+            prof_call_struct *c = prof_calls + i;
+            if (c->from_prgm == -1)
+                continue;
+            int4 j = (prof_hash(c->from_prgm, c->from_pc) ^ prof_hash(c->to_prgm, c->to_pc)) & (newcap - 1);
+            while (newcalls[j].from_prgm != -1)
+                j = (j + 1) & (newcap - 1);
+            newcalls[j] = *c;
+        }
+        free(prof_calls);
+        prof_calls = newcalls;
+        prof_calls_capacity = newcap;
+    }
+    int4 i = (prof_hash(from_prgm, from_pc) ^ prof_hash(to_prgm, to_pc)) & (prof_calls_capacity - 1);
+    while (true) {
+        prof_call_struct *c = prof_calls + i;
+        if (c->from_prgm == from_prgm && c->from_pc == from_pc
+                && c->to_prgm == to_prgm && c->to_pc == to_pc)
+            return c;
+        if (c->from_prgm == -1) {
+            c->from_prgm = from_prgm;
+            c->from_pc = from_pc;
+            c->to_prgm = to_prgm;
+            c->to_pc = to_pc;
+            c->count = 0;
+            prof_calls_count++;
+            return c;
+        }
+        i = (i + 1) & (prof_calls_capacity - 1);
+    }
+}
+
+/* Called by continue_running() after each instruction while profiling.
+ * prgm and insn_pc identify the instruction, start is the clock() value from
+ * just before its handler was called, and level is the return stack depth at
+ * that time; if the depth went up, the instruction was a call.
+ */
+static void profile_insn(int cmd, int prgm, int4 insn_pc, clock_t start, int level, int error) {
+    prof_cmd_time[cmd] += clock() - start;
+    prof_cmd_count[cmd]++;
+    prof_insns++;
+    prof_line_struct *l = prof_line(prgm, insn_pc);
+    if (l != NULL)
+        l->hits++;
+    if (get_rtn_level() > level) {
+        prof_call_struct *c = prof_call(prgm, insn_pc, current_prgm, pc);
+        if (c != NULL)
+            c->count++;
+    }
+    prof_interruptible_cmd = error == ERR_INTERRUPTIBLE ? cmd : CMD_NONE;
+}
+
+static int prof_line_compare(const void *a, const void *b) {
+    const prof_line_struct *la = (const prof_line_struct *) a;
+    const prof_line_struct *lb = (const prof_line_struct *) b;
+    if (la->hits != lb->hits)
+        return la->hits > lb->hits ? -1 : 1;
+    if (la->prgm != lb->prgm)
+        return la->prgm < lb->prgm ? -1 : 1;
+    return la->pc < lb->pc ? -1 : la->pc > lb->pc ? 1 : 0;
+}
+
+static int prof_call_compare(const void *a, const void *b) {
+    const prof_call_struct *ca = (const prof_call_struct *) a;
+    const prof_call_struct *cb = (const prof_call_struct *) b;
+    if (ca->count != cb->count)
+        return ca->count > cb->count ? -1 : 1;
+    if (ca->from_prgm != cb->from_prgm)
+        return ca->from_prgm < cb->from_prgm ? -1 : 1;
+    return ca->from_pc < cb->from_pc ? -1 : ca->from_pc > cb->from_pc ? 1 : 0;
+}
+
+static void dump_name(FILE *f, const char *name, int length, bool json) {
+    fputc('"', f);
+    for (int i = 0; i < length; i++) {
+        unsigned char c = name[i];
+        if (c >= 32 && c <= 126 && c != '"' && c != '\\')
+            fputc(c, f);
+        else if (json)
+            fprintf(f, "\\u%04x", c);
+        else
+            fprintf(f, "\\%02x", c);
+    }
+    fputc('"', f);
+}
+
+static void dump_cmd_name(FILE *f, int cmd, bool json) {
+    const command_spec *cs = cmdlist(cmd);
+    if (cmd == CMD_NUMBER)
+        dump_name(f, "(number)", 8, json);
+    else if (cmd == CMD_STRING)
+        dump_name(f, "(string)", 8, json);
+    else
+        dump_name(f, cs->name, cs->name_length, json);
+}
+
+static void dump_prgm_name(FILE *f, int prgm, bool json) {
+    for (int i = 0; i < labels_count; i++)
+        if (labels[i].prgm == prgm && labels[i].length > 0) {
+            dump_name(f, labels[i].name, labels[i].length, json);
+            return;
+        }
+    fputs(json ? "null" : "-", f);
+}
+
+static int4 dump_pc2line(int prgm, int4 p) {
+    int saved_prgm = current_prgm;
+    current_prgm = prgm;
+    int4 line = pc2line(p);
+    current_prgm = saved_prgm;
+    return line;
+}
+
+static void profile_dump() {
+    prof_active = false;
+    prof_dump_pending = false;
+    const char *name = core_settings.profile_file;
+    FILE *f = fopen(name, "w");
+    if (f == NULL)
+        return;
+    int namelen = strlen(name);
+    bool json = namelen >= 5 && string_equals(name + namelen - 5, 5, ".json", 5);
+    uint4 ms = shell_milliseconds() - prof_start_ms;
+
+    int4 nlines = 0;
+    for (int4 i = 0; i < prof_lines_capacity; i++)
+        if (prof_lines[i].prgm != -1)
+            prof_lines[nlines++] = prof_lines[i];
+    qsort(prof_lines, nlines, sizeof(prof_line_struct), prof_line_compare);
+    int4 ncalls = 0;
+    for (int4 i = 0; i < prof_calls_capacity; i++)
+        if (prof_calls[i].from_prgm != -1)
+            prof_calls[ncalls++] = prof_calls[i];
+    qsort(prof_calls, ncalls, sizeof(prof_call_struct), prof_call_compare);
+
+    if (json) {
+        fprintf(f, "{\n\"instructions\": %lld,\n\"ms\": %u,\n\"commands\": [", prof_insns, ms);
+        bool first = true;
+        for (int i = 0; i < CMD_SENTINEL; i++) {
+            if (prof_cmd_count[i] == 0)
+                continue;
+            fprintf(f, "%s\n {\"id\": %d, \"name\": ", first ? "" : ",", i);
+            dump_cmd_name(f, i, true);
+            fprintf(f, ", \"count\": %lld, \"seconds\": %.6f}", prof_cmd_count[i],
+                    (double) prof_cmd_time[i] / CLOCKS_PER_SEC);
+            first = false;
+        }
+        fprintf(f, "\n],\n\"lines\": [");
+        for (int4 i = 0; i < nlines; i++) {
+            prof_line_struct *l = prof_lines + i;
+            fprintf(f, "%s\n {\"prgm\": %d, \"label\": ", i == 0 ? "" : ",", l->prgm);
+            dump_prgm_name(f, l->prgm, true);
+            fprintf(f, ", \"line\": %d, \"hits\": %d}", dump_pc2line(l->prgm, l->pc), l->hits);
+        }
+        fprintf(f, "\n],\n\"calls\": [");
+        for (int4 i = 0; i < ncalls; i++) {
+            prof_call_struct *c = prof_calls + i;
+            fprintf(f, "%s\n {\"from_prgm\": %d, \"from_label\": ", i == 0 ? "" : ",", c->from_prgm);
+            dump_prgm_name(f, c->from_prgm, true);
+            fprintf(f, ", \"from_line\": %d, \"to_prgm\": %d, \"to_label\": ",
+                    dump_pc2line(c->from_prgm, c->from_pc), c->to_prgm);
+            dump_prgm_name(f, c->to_prgm, true);
+            fprintf(f, ", \"to_line\": %d, \"count\": %d}",
+                    dump_pc2line(c->to_prgm, c->to_pc), c->count);
+        }
+        fprintf(f, "\n]\n}\n");
+    } else {
+        fprintf(f, "%lld instructions in %u ms\n\nCommands:\n%12s %12s  name\n",
+                prof_insns, ms, "count", "seconds");
+        for (int i = 0; i < CMD_SENTINEL; i++) {
+            if (prof_cmd_count[i] == 0)
+                continue;
+            fprintf(f, "%12lld %12.6f  ", prof_cmd_count[i],
+                    (double) prof_cmd_time[i] / CLOCKS_PER_SEC);
+            dump_cmd_name(f, i, false);
+            fputc('\n', f);
+        }
+        fprintf(f, "\nLines:\n%12s  prgm  line\n", "hits");
+        for (int4 i = 0; i < nlines; i++) {
+            prof_line_struct *l = prof_lines + i;
+            fprintf(f, "%12d  %d ", l->hits, l->prgm);
+            dump_prgm_name(f, l->prgm, false);
+            fprintf(f, "  %d\n", dump_pc2line(l->prgm, l->pc));
+        }
+        fprintf(f, "\nCalls:\n%12s  from -> to\n", "count");
+        for (int4 i = 0; i < ncalls; i++) {
+            prof_call_struct *c = prof_calls + i;
+            fprintf(f, "%12d  %d ", c->count, c->from_prgm);
+            dump_prgm_name(f, c->from_prgm, false);
+            fprintf(f, " %d -> %d ", dump_pc2line(c->from_prgm, c->from_pc), c->to_prgm);
+            dump_prgm_name(f, c->to_prgm, false);
+            fprintf(f, " %d\n", dump_pc2line(c->to_prgm, c->to_pc));
+        }
+    }
+    fclose(f);
+
+    free(prof_lines);
+    prof_lines = NULL;
+    prof_lines_count = prof_lines_capacity = 0;
+    free(prof_calls);
+    prof_calls = NULL;
+    prof_calls_count = prof_calls_capacity = 0;
+}
+
+/*******************/
+/* Execution trace */
+/*******************/
+
+static void trace_setup() {
+    int4 size = core_settings.trace_size;
+    if (size < 0)
+        size = 0;
+    if (size == trace_capacity)
+        return;
+    free(trace_buf);
+    trace_buf = NULL;
+    trace_capacity = 0;
+    trace_next = 0;
+    trace_seq = 0;
+    if (size == 0)
+        return;
+    trace_buf = (trace_entry *) malloc(size * sizeof(trace_entry));
+    if (trace_buf != NULL)
+        trace_capacity = size;
+}
+
+static void trace_record(int kind, int prgm, int4 p, int cmd) {
+    /* Reading the clock for every instruction would be too slow; the
+     * millisecond clock doesn't resolve individual instructions anyway.
+     */
+    if ((trace_seq & 255) == 0)
+        trace_ms = shell_milliseconds();
+    trace_entry *e = trace_buf + trace_next;
+    e->seq = trace_seq++;
+    e->ms = trace_ms;
+    e->prgm = prgm;
+    e->pc = p;
+    e->cmd = cmd;
+    e->kind = kind;
+    if (++trace_next == trace_capacity)
+        trace_next = 0;
+}
+
+void trace_reentry(int cmd) {
+    if (trace_buf != NULL)
+        trace_record(cmd == CMD_SOLVE ? TRACE_SOLVE : TRACE_INTEG,
+                     current_prgm, pc, cmd);
+}
+
+void core_dump_trace(const char *file_name) {
+    if (trace_buf == NULL || trace_seq == 0)
+        return;
+    FILE *f = fopen(file_name, "w");
+    if (f == NULL)
+        return;
+    int4 n = trace_seq < trace_capacity ? (int4) trace_seq : trace_capacity;
+    int4 i = trace_seq < trace_capacity ? 0 : trace_next;
+    fprintf(f, "%12s %10s  event  prgm  line  command\n", "seq", "ms");
+    while (n-- > 0) {
+        trace_entry *e = trace_buf + i;
+        fprintf(f, "%12lld %10u  %-5s  %d ", e->seq, e->ms,
+                e->kind == TRACE_INSN ? "insn"
+                    : e->kind == TRACE_SOLVE ? "solve" : "integ", e->prgm);
+        if (e->prgm >= 0 && e->prgm < prgms_count) {
+            dump_prgm_name(f, e->prgm, false);
+            fprintf(f, "  %d  ", dump_pc2line(e->prgm, e->pc));
+        } else
+            fputs("-  -  ", f);
+        dump_cmd_name(f, e->cmd, false);
+        fputc('\n', f);
+        if (++i == trace_capacity)
+            i = 0;
+    }
+    fclose(f);
+}
+
+static void report_run_stats() {
+    if (!core_settings.run_stats)
+        return;
+    char buf[200];
+    uint4 ms = core_run_stats.run_ms;
+    snprintf(buf, 200, "run: %lld insns in %u ms (%lld ips), %u polls, max gap %u ms, slice %d ms, batch %d",
+            core_run_stats.insns, ms,
+            ms == 0 ? 0LL : core_run_stats.insns * 1000 / ms,
+            core_run_stats.polls, core_run_stats.max_poll_gap_ms,
+            core_settings.run_slice_ms, core_run_stats.batch);
+    shell_log(buf);
+}
+
 void set_running(bool state) {
     if (mode_running != state) {
         mode_running = state;
         shell_annunciators(-1, -1, -1, state, -1, -1);
+        if (state) {
+            core_run_stats.insns = 0;
+            core_run_stats.run_ms = 0;
+            core_run_stats.polls = 0;
+            core_run_stats.max_poll_gap_ms = 0;
+            if (prof_dump_pending)
+                /* Stopped and restarted by the same instruction;
+                 * keep adding to the same profile */
+                prof_dump_pending = false;
+            else if (core_settings.profile_file != NULL
+                    && core_settings.profile_file[0] != 0)
+                profile_start();
+            trace_setup();
+        } else {
+            if (!in_continue_running)
+                report_run_stats();
+            if (prof_in_insn)
+                prof_dump_pending = prof_active;
+            else if (prof_active)
+                profile_dump();
+        }
     }
     if (state) {
         /* Cancel any pending INPUT command */
@@ -3850,7 +4305,46 @@ void do_interactive(int command) {
 
 static void continue_running() {
     int error;
-    while (!shell_wants_cpu()) {
+    int slice = core_settings.run_slice_ms;
+    int count = 0;
+    uint4 batch_start = shell_milliseconds();
+    uint4 last_poll = batch_start;
+    bool first = true;
+    /* Reading the clock after every instruction is not free, so without a
+     * budget, poll gaps are only measured when asked for.
+     */
+    bool timed = slice > 0 || core_settings.run_stats;
+    in_continue_running = true;
+    while (true) {
+        if (count == 0) {
+            if (timed) {
+                uint4 now = shell_milliseconds();
+                uint4 elapsed = now - batch_start;
+                if (!first) {
+                    if (now - last_poll > core_run_stats.max_poll_gap_ms)
+                        core_run_stats.max_poll_gap_ms = now - last_poll;
+                    if (slice > 0) {
+                        /* Aim for batches taking between half the budget
+                         * and the whole budget.
+                         */
+                        if (elapsed * 2 < (uint4) slice) {
+                            if (run_batch < MAX_RUN_BATCH)
+                                run_batch <<= 1;
+                        } else if (elapsed > (uint4) slice && run_batch > 1)
+                            run_batch >>= 1;
+                    }
+                }
+                core_run_stats.run_ms += elapsed;
+                batch_start = now;
+                last_poll = now;
+                first = false;
+            }
+            core_run_stats.polls++;
+            if (shell_wants_cpu())
+                break;
+            count = slice > 0 ? run_batch : 1;
+        }
+        count--;
         int cmd;
         arg_struct arg;
         oldpc = pc;
@@ -3859,24 +4353,45 @@ static void continue_running() {
         else if (pc >= prgms[current_prgm].size) {
             pc = -1;
             set_running(false);
-            return;
+            break;
         }
-        get_next_command(&pc, &cmd, &arg, 1);
+        int4 insn_pc = pc;
+        int insn_prgm = current_prgm;
+        get_next_decoded_command(&pc, &cmd, &arg);
         if (flags.f.trace_print && flags.f.printer_exists)
             print_program_line(current_prgm, oldpc);
         mode_disable_stack_lift = false;
-        error = cmdlist(cmd)->handler(&arg);
+        if (trace_buf != NULL)
+            trace_record(TRACE_INSN, insn_prgm, insn_pc, cmd);
+        if (prof_active) {
+            int level = get_rtn_level();
+            clock_t start = clock();
+            prof_in_insn = true;
+            error = cmdlist(cmd)->handler(&arg);
+            prof_in_insn = false;
+            profile_insn(cmd, insn_prgm, insn_pc, start, level, error);
+            if (prof_dump_pending)
+                profile_dump();
+        } else
+            error = cmdlist(cmd)->handler(&arg);
+        core_run_stats.insns++;
         if (mode_pause) {
             shell_request_timeout3(1000);
-            return;
+            break;
         }
         if (error == ERR_INTERRUPTIBLE)
-            return;
+            break;
         if (!handle_error(error))
-            return;
+            break;
         if (mode_getkey)
-            return;
+            break;
     }
+    uint4 now = shell_milliseconds();
+    core_run_stats.run_ms += now - batch_start;
+    core_run_stats.batch = run_batch;
+    in_continue_running = false;
+    if (!mode_running)
+        report_run_stats();
 }
 
 typedef struct {
@@ -4334,6 +4849,9 @@ int run = 0;
             pc = oldpc;
             display_error(error, 1);
             set_running(false);
+            if (trace_buf != NULL && core_settings.trace_file != NULL
+                    && core_settings.trace_file[0] != 0)
+                core_dump_trace(core_settings.trace_file);
             return 0;
         }
         return 1;
@@ -35,6 +35,8 @@
  * If the read_state parameter is 1, the 'version' parameter should contain the
  * state file version number; otherwise its value is not used.
  * This is guaranteed to be the first function called on the emulator core.
+ * In a FREE42_REENTRANT build, this creates a calculator for the calling
+ * thread; see free42.h.
  */
 void core_init(int read_state, int4 version, const char *state_file_name, int offset);
 
@@ -53,6 +55,8 @@ void core_save_state(const char *state_file_name);
  * called during app shutdown, although that's not really necessary unless you
  * are checking for memory leaks. It should be called between saving state and
  * loading a new state, that is, when switching states.
+ * In a FREE42_REENTRANT build, a thread should call this before it exits, to
+ * release its calculator's memory.
  */
 void core_cleanup();
 
@@ -282,6 +286,13 @@ void core_import_programs(int num_progs, const char *raw_file_name);
  */
 char *core_copy();
 
+/* core_dump_trace()
+ *
+ * Writes the execution trace to the given file, oldest entry first, as plain
+ * text. Does nothing if tracing is not enabled (see core_settings.trace_size).
+ */
+void core_dump_trace(const char *file_name);
+
 /* core_paste()
  *
  * Puts the given value on the stack, using RCL semantics. It tries to parse
@@ -323,9 +334,88 @@ typedef struct {
     bool enable_ext_fptest;
     bool enable_ext_prog;
 	bool enable_ext_hpil;
+    /* Time budget, in milliseconds, for running programs between calls to
+     * shell_wants_cpu(). When this is 0, shell_wants_cpu() is called after
+     * every instruction; otherwise, the core executes batches of
+     * instructions, sized so that each batch takes roughly this long.
+     * Shells with an expensive shell_wants_cpu() should set this.
+     */
+    int run_slice_ms;
+    /* When this is set, the statistics in core_run_stats are written to
+     * shell_log() whenever a program stops, and so are the number of calls
+     * made by SOLVE and INTEG when they finish. Poll gaps are then measured
+     * even when run_slice_ms is 0.
+     */
+    bool run_stats;
+    /* When this is set, running programs are profiled: the core counts how
+     * often each command is executed and how much time it takes, how often
+     * each program line is executed, and which lines call which programs.
+     * The report is written to this file when the program stops; in JSON
+     * if the name ends in ".json", and as plain text otherwise.
+     */
+    const char *profile_file;
+    /* When trace_size is nonzero, the core keeps a record of the last
+     * trace_size instructions executed by running programs, and of the
+     * solver and integrator calling back into their programs, in a ring
+     * buffer. The trace can be written out using core_dump_trace(); it is
+     * also written to trace_file, if set, when a program stops with an error.
+     * Changes take effect when a program is started.
+     */
+    int trace_size;
+    const char *trace_file;
+    /* Block size for matrix multiplication. When this is 0, the core picks
+     * one itself, by timing a few candidates the first time a large matrix
+     * multiplication is performed.
+     */
+    int matrix_block_size;
+    /* Number of threads to use for large matrix multiplications and LU
+     * decompositions. 0 means one per CPU core; 1 means everything runs on
+     * the thread that calls the core. Ignored in the Decimal build, which
+     * always uses one thread.
+     */
+    int matrix_threads;
+    /* Selects the algorithm used by INTEG. When this is false, it uses the
+     * Romberg method, like the HP-42S; when it is true, it uses tanh-sinh
+     * quadrature, which usually needs far fewer evaluations of the
+     * integrand, especially when it has singularities at the endpoints.
+     * Takes effect when an integration is started.
+     */
+    bool integ_tanh_sinh;
+    /* When this is set, SOLVE remembers the roots it finds, and the first
+     * interval in which f changed sign, and when it is started again on the
+     * same program and variable with the variable and X still holding the
+     * last root, it extrapolates its second guess from the last two roots,
+     * limiting the step to the width of that interval.
+     */
+    bool solve_warm_start;
 } core_settings_struct;
 
-extern core_settings_struct core_settings;
+extern CORE_THREAD core_settings_struct core_settings;
+
+/* core_run_stats
+ *
+ * Statistics on program execution, reset whenever a program is started.
+ * insns / run_ms gives the instruction rate; max_poll_gap_ms is the longest
+ * the core went without calling shell_wants_cpu(), i.e. the worst-case
+ * latency for responding to a key press while running (only measured when
+ * run_slice_ms > 0 or core_settings.run_stats is set). Comparing these with
+ * run_slice_ms = 0 and run_slice_ms > 0 shows what the budget buys.
+ */
+typedef struct {
+    int8 insns;
+    uint4 run_ms;
+    uint4 polls;
+    uint4 max_poll_gap_ms;
+    int batch;
+    /* Number of times the current or most recent SOLVE has called its
+     * program; reset when SOLVE starts, not when the program does.
+     */
+    int solve_calls;
+    /* The same, for INTEG, i.e. the number of evaluations of the integrand */
+    int integ_calls;
+} core_run_stats_struct;
+
+extern CORE_THREAD core_run_stats_struct core_run_stats;
 
 extern int hp42ext[];
 
@@ -333,9 +423,9 @@ extern int hp42ext[];
 /* Keyboard repeat */
 /*******************/
 
-extern int repeating;
-extern int repeating_shift;
-extern int repeating_key;
+extern CORE_THREAD int repeating;
+extern CORE_THREAD int repeating_shift;
+extern CORE_THREAD int repeating_key;
 
 
 /*******************/
@@ -344,6 +434,7 @@ extern int repeating_key;
 
 void set_alpha_entry(bool state);
 void set_running(bool state);
+void trace_reentry(int cmd);
 bool program_running();
 bool alpha_active();
 
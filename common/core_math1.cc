@@ -33,9 +33,10 @@
 #include "core_variables.h"
 #include "shell.h"
 
-#define SOLVE_VERSION 4
-#define INTEG_VERSION 3
+#define SOLVE_VERSION 5
+#define INTEG_VERSION 4
 #define NUM_SHADOWS 10
+#define NUM_WARM_STARTS 10
 
 /* Solver */
 typedef struct {
@@ -63,14 +64,30 @@ typedef struct {
     int shadow_length[NUM_SHADOWS];
     phloat shadow_value[NUM_SHADOWS];
     uint4 last_disp_time;
+    // First interval in which f changed sign, if any
+    int bracketed;
+    phloat bracket_lo, bracket_hi;
+    // Last two roots, and the last bracket, for each (program, variable) pair
+    char warm_prgm_name[NUM_WARM_STARTS][7];
+    int warm_prgm_length[NUM_WARM_STARTS];
+    char warm_var_name[NUM_WARM_STARTS][7];
+    int warm_var_length[NUM_WARM_STARTS];
+    phloat warm_root[NUM_WARM_STARTS];
+    phloat warm_prev_root[NUM_WARM_STARTS];
+    phloat warm_lo[NUM_WARM_STARTS], warm_hi[NUM_WARM_STARTS];
 } solve_state;
 
-static solve_state solve;
+static CORE_THREAD solve_state solve;
 
 #define ROMB_K 5
 // 1/2 million evals max!
 #define ROMB_MAX 20
 
+#define INTEG_ROMBERG 0
+#define INTEG_TANH_SINH 1
+// Each level halves the step size; 12 is 2^14 evals or so
+#define TS_MAX 12
+
 /* Integrator */
 typedef struct {
     int version;
@@ -95,9 +112,13 @@ typedef struct {
     phloat t, u;
     phloat prev_int;
     phloat prev_res;
+    int method;
+    // Tanh-sinh
+    int evals;
+    phloat d, tt, eh, w, x, fp, fm, lsum;
 } integ_state;
 
-static integ_state integ;
+static CORE_THREAD integ_state integ;
 
 
 static void reset_solve();
@@ -140,6 +161,19 @@ bool persist_math() {
         if (!write_phloat(solve.shadow_value[i])) return false;
     }
     if (!write_int4(solve.last_disp_time)) return false;
+    if (!write_int(solve.bracketed)) return false;
+    if (!write_phloat(solve.bracket_lo)) return false;
+    if (!write_phloat(solve.bracket_hi)) return false;
+    for (int i = 0; i < NUM_WARM_STARTS; i++) {
+        if (fwrite(solve.warm_prgm_name[i], 1, 7, gfile) != 7) return false;
+        if (!write_int(solve.warm_prgm_length[i])) return false;
+        if (fwrite(solve.warm_var_name[i], 1, 7, gfile) != 7) return false;
+        if (!write_int(solve.warm_var_length[i])) return false;
+        if (!write_phloat(solve.warm_root[i])) return false;
+        if (!write_phloat(solve.warm_prev_root[i])) return false;
+        if (!write_phloat(solve.warm_lo[i])) return false;
+        if (!write_phloat(solve.warm_hi[i])) return false;
+    }
 
     if (!write_int(integ.version)) return false;
     if (fwrite(integ.prgm_name, 1, 7, gfile) != 7) return false;
@@ -174,6 +208,16 @@ bool persist_math() {
     if (!write_phloat(integ.u)) return false;
     if (!write_phloat(integ.prev_int)) return false;
     if (!write_phloat(integ.prev_res)) return false;
+    if (!write_int(integ.method)) return false;
+    if (!write_int(integ.evals)) return false;
+    if (!write_phloat(integ.d)) return false;
+    if (!write_phloat(integ.tt)) return false;
+    if (!write_phloat(integ.eh)) return false;
+    if (!write_phloat(integ.w)) return false;
+    if (!write_phloat(integ.x)) return false;
+    if (!write_phloat(integ.fp)) return false;
+    if (!write_phloat(integ.fm)) return false;
+    if (!write_phloat(integ.lsum)) return false;
     return true;
 }
 
@@ -219,6 +263,27 @@ bool unpersist_math(int ver, bool discard) {
             if (!read_phloat(&solve.shadow_value[i])) return false;
         }
         if (!read_int4((int4 *) &solve.last_disp_time)) return false;
+        if (ver >= 30) {
+            if (!read_int(&solve.bracketed)) return false;
+            if (!read_phloat(&solve.bracket_lo)) return false;
+            if (!read_phloat(&solve.bracket_hi)) return false;
+        } else
+            solve.bracketed = 0;
+        for (int i = 0; i < NUM_WARM_STARTS; i++) {
+            if (ver < 30) {
+                solve.warm_var_length[i] = 0;
+                continue;
+            }
+            if (fread(solve.warm_prgm_name[i], 1, 7, gfile) != 7)
+                return false;
+            if (!read_int(&solve.warm_prgm_length[i])) return false;
+            if (fread(solve.warm_var_name[i], 1, 7, gfile) != 7) return false;
+            if (!read_int(&solve.warm_var_length[i])) return false;
+            if (!read_phloat(&solve.warm_root[i])) return false;
+            if (!read_phloat(&solve.warm_prev_root[i])) return false;
+            if (!read_phloat(&solve.warm_lo[i])) return false;
+            if (!read_phloat(&solve.warm_hi[i])) return false;
+        }
         
         if (!read_int(&integ.version)) return false;
         if (fread(integ.prgm_name, 1, 7, gfile) != 7) return false;
@@ -253,6 +318,19 @@ bool unpersist_math(int ver, bool discard) {
         if (!read_phloat(&integ.u)) return false;
         if (!read_phloat(&integ.prev_int)) return false;
         if (!read_phloat(&integ.prev_res)) return false;
+        if (ver >= 30) {
+            if (!read_int(&integ.method)) return false;
+            if (!read_int(&integ.evals)) return false;
+            if (!read_phloat(&integ.d)) return false;
+            if (!read_phloat(&integ.tt)) return false;
+            if (!read_phloat(&integ.eh)) return false;
+            if (!read_phloat(&integ.w)) return false;
+            if (!read_phloat(&integ.x)) return false;
+            if (!read_phloat(&integ.fp)) return false;
+            if (!read_phloat(&integ.fm)) return false;
+            if (!read_phloat(&integ.lsum)) return false;
+        } else
+            integ.method = INTEG_ROMBERG;
     } else {
         int size;
         bool success;
@@ -307,6 +385,8 @@ static void reset_solve() {
     int i;
     for (i = 0; i < NUM_SHADOWS; i++)
         solve.shadow_length[i] = 0;
+    for (i = 0; i < NUM_WARM_STARTS; i++)
+        solve.warm_var_length[i] = 0;
     solve.prgm_length = 0;
     solve.active_prgm_length = 0;
     solve.state = 0;
@@ -364,6 +444,73 @@ void remove_shadow(const char *name, int length) {
     solve.shadow_length[NUM_SHADOWS - 1] = 0;
 }
 
+/* Warm starts: when core_settings.solve_warm_start is set, the roots found
+ * by SOLVE are remembered per program and variable, together with the first
+ * interval in which f changed sign during that SOLVE. (The final interval
+ * is of no use here; it has shrunk to the root itself.) When SOLVE is
+ * started again with both guesses equal to the last root -- that is, with
+ * the variable and X left as the previous SOLVE left them -- the second
+ * guess is extrapolated from the last two roots, instead of being a tiny
+ * step away from the first. When a program solves the same equation for
+ * slowly changing parameters, that usually lands close to the new root.
+ * The step is limited to the width of the remembered interval, so a jump
+ * in the roots can't send the second guess further than the last search
+ * had to look. The step is not clamped to the interval itself, since when
+ * the roots drift steadily, the new root is usually just outside the old
+ * interval. Without an interval, e.g. when f happened to hit 0 exactly, or
+ * without a previous root, the usual default guess is used.
+ * Slots are used like the shadows: the oldest one is dropped when the
+ * table is full.
+ */
+
+static int find_warm_start(const char *prgm, int prgm_length,
+                           const char *var, int var_length) {
+    for (int i = 0; i < NUM_WARM_STARTS; i++)
+        if (solve.warm_var_length[i] != 0
+                && string_equals(solve.warm_var_name[i],
+                                 solve.warm_var_length[i], var, var_length)
+                && string_equals(solve.warm_prgm_name[i],
+                                 solve.warm_prgm_length[i], prgm, prgm_length))
+            return i;
+    return -1;
+}
+
+static void put_warm_start(phloat root) {
+    int i = find_warm_start(solve.active_prgm_name, solve.active_prgm_length,
+                            solve.var_name, solve.var_length);
+    phloat lo = solve.bracketed ? solve.bracket_lo : root;
+    phloat hi = solve.bracketed ? solve.bracket_hi : root;
+    if (i != -1) {
+        solve.warm_prev_root[i] = solve.warm_root[i];
+        solve.warm_root[i] = root;
+        solve.warm_lo[i] = lo;
+        solve.warm_hi[i] = hi;
+        return;
+    }
+    for (i = 0; i < NUM_WARM_STARTS; i++)
+        if (solve.warm_var_length[i] == 0)
+            goto do_insert;
+    for (i = 0; i < NUM_WARM_STARTS - 1; i++) {
+        string_copy(solve.warm_prgm_name[i], &solve.warm_prgm_length[i],
+                    solve.warm_prgm_name[i + 1], solve.warm_prgm_length[i + 1]);
+        string_copy(solve.warm_var_name[i], &solve.warm_var_length[i],
+                    solve.warm_var_name[i + 1], solve.warm_var_length[i + 1]);
+        solve.warm_root[i] = solve.warm_root[i + 1];
+        solve.warm_prev_root[i] = solve.warm_prev_root[i + 1];
+        solve.warm_lo[i] = solve.warm_lo[i + 1];
+        solve.warm_hi[i] = solve.warm_hi[i + 1];
+    }
+    do_insert:
+    string_copy(solve.warm_prgm_name[i], &solve.warm_prgm_length[i],
+                solve.active_prgm_name, solve.active_prgm_length);
+    string_copy(solve.warm_var_name[i], &solve.warm_var_length[i],
+                solve.var_name, solve.var_length);
+    solve.warm_root[i] = root;
+    solve.warm_prev_root[i] = root;
+    solve.warm_lo[i] = lo;
+    solve.warm_hi[i] = hi;
+}
+
 void set_solve_prgm(const char *name, int length) {
     string_copy(solve.prgm_name, &solve.prgm_length, name, length);
 }
@@ -388,6 +535,7 @@ static int call_solve_fn(int which, int state) {
         }
     } else
         ((vartype_real *) v)->x = x;
+    core_run_stats.solve_calls++;
     solve.which = which;
     solve.state = state;
     arg.type = ARGTYPE_STR;
@@ -416,6 +564,23 @@ int start_solve(const char *name, int length, phloat x1, phloat x2) {
                 solve.prgm_name, solve.prgm_length);
     solve.prev_prgm = current_prgm;
     solve.prev_pc = pc;
+    core_run_stats.solve_calls = 0;
+    if (x1 == x2 && core_settings.solve_warm_start) {
+        int i = find_warm_start(solve.active_prgm_name,
+                                solve.active_prgm_length, name, length);
+        if (i != -1 && solve.warm_root[i] == x1
+                    && solve.warm_prev_root[i] != x1) {
+            phloat step = x1 - solve.warm_prev_root[i];
+            phloat width = solve.warm_hi[i] - solve.warm_lo[i];
+            if (step > width)
+                step = width;
+            else if (step < -width)
+                step = -width;
+            phloat x = x1 + step;
+            if (!p_isinf(x))
+                x2 = x;
+        }
+    }
     if (x1 == x2) {
         if (x1 == 0) {
             x2 = 1;
@@ -442,6 +607,7 @@ int start_solve(const char *name, int length, phloat x1, phloat x2) {
     solve.second_x = 0;
     solve.second_f = POS_HUGE_PHLOAT;
     solve.last_disp_time = 0;
+    solve.bracketed = 0;
     solve.toggle = 1;
     solve.keep_running = !should_i_stop_at_this_level() && program_running();
     return call_solve_fn(1, 1);
@@ -510,6 +676,13 @@ static int finish_solve(int message) {
         s = solve.second_x;
 
     solve.state = 0;
+    if (message == SOLVE_ROOT && core_settings.solve_warm_start)
+        put_warm_start(b);
+    if (core_settings.run_stats) {
+        char statbuf[50];
+        snprintf(statbuf, 50, "solve: %d calls", core_run_stats.solve_calls);
+        shell_log(statbuf);
+    }
 
     v = recall_var(solve.var_name, solve.var_length);
     ((vartype_real *) v)->x = b;
@@ -588,6 +761,7 @@ int return_to_solve(int failure, bool stop) {
     phloat f, slope, s, xnew, prev_f = solve.curr_f;
     uint4 now_time;
 
+    trace_reentry(CMD_SOLVE);
     if (stop)
         solve.keep_running = 0;
 
@@ -968,6 +1142,11 @@ int return_to_solve(int failure, bool stop) {
                 solve.fx1 = f;
             }
             do_ridders:
+            if (!solve.bracketed) {
+                solve.bracket_lo = solve.x1;
+                solve.bracket_hi = solve.x2;
+                solve.bracketed = 1;
+            }
             solve.x3 = (solve.x1 + solve.x2) / 2;
             // TODO: The following termination condition should really be
             //
@@ -1034,6 +1213,7 @@ static int call_integ_fn() {
         }
     } else
         ((vartype_real *) v)->x = x;
+    core_run_stats.integ_calls++;
     arg.type = ARGTYPE_STR;
     arg.length = integ.active_prgm_length;
     for (i = 0; i < arg.length; i++)
@@ -1088,16 +1268,26 @@ int start_integ(const char *name, int length) {
                 integ.prgm_name, integ.prgm_length);
     integ.prev_prgm = current_prgm;
     integ.prev_pc = pc;
-
-    integ.a = integ.llim;
-    integ.b = integ.ulim - integ.llim;
-    integ.h = 2;
-    integ.prev_int = 0;
-    integ.nsteps = 1;
-    integ.n = 1;
-    integ.state = 1;
-    integ.s[0] = 0;
-    integ.k = 1;
+    core_run_stats.integ_calls = 0;
+
+    if (core_settings.integ_tanh_sinh) {
+        integ.method = INTEG_TANH_SINH;
+        integ.d = (integ.ulim - integ.llim) / 2;
+        integ.h = 2;
+        integ.n = 0;
+        integ.state = 3;
+    } else {
+        integ.method = INTEG_ROMBERG;
+        integ.a = integ.llim;
+        integ.b = integ.ulim - integ.llim;
+        integ.h = 2;
+        integ.prev_int = 0;
+        integ.nsteps = 1;
+        integ.n = 1;
+        integ.state = 1;
+        integ.s[0] = 0;
+        integ.k = 1;
+    }
     integ.prev_res = 0;
 
     integ.keep_running = !should_i_stop_at_this_level() && program_running();
@@ -1115,8 +1305,13 @@ static int finish_integ() {
     vartype *x, *y;
     int saved_trace = flags.f.trace_print;
     integ.state = 0;
+    if (core_settings.run_stats) {
+        char statbuf[50];
+        snprintf(statbuf, 50, "integ: %d calls", core_run_stats.integ_calls);
+        shell_log(statbuf);
+    }
 
-    x = new_real(integ.sum * integ.b * 0.75);
+    x = new_real(integ.prev_res);
     y = new_real(integ.eps);
     if (x == NULL || y == NULL) {
         free_vartype(x);
@@ -1148,12 +1343,108 @@ static int finish_integ() {
 }
 
 
+/* Tanh-sinh quadrature: with x = tanh(sinh(t)), the integrand decays
+ * double exponentially in t, so the trapezoidal rule on t converges very
+ * quickly, and the abscissas crowd towards the endpoints without reaching
+ * them, which handles endpoint singularities. Each level halves the step
+ * and only evaluates the new points; each level's tail is cut off when
+ * its terms stop contributing. This is the qthsh() scheme by R. van
+ * Engelen, with x and the weights computed from exp(j*h) alone.
+ * States: 3 = start, 4 = got f(center), 5 = got f(llim + x),
+ * 6 = got f(ulim - x).
+ */
+
+static int tanh_sinh(int failure) {
+    switch (integ.state) {
+    case 3:
+        integ.state = 4;
+        integ.u = integ.llim + integ.d;
+        return call_integ_fn();
+
+    case 4:
+        integ.sum = 0;
+        if (!failure && reg_x->type == TYPE_REAL)
+            integ.sum = ((vartype_real *) reg_x)->x;
+
+    level:
+
+        integ.h /= 2;
+        integ.lsum = 0;
+        integ.fp = 0;
+        integ.fm = 0;
+        integ.tt = integ.eh = exp(integ.h);
+        if (integ.n > 0)
+            integ.eh *= integ.eh;
+
+    point: {
+        // r = 1 - tanh(sinh(j*h)), w = cosh(j*h) / cosh(sinh(j*h))^2
+        phloat e = exp(1 / integ.tt - integ.tt);
+        phloat r = 2 * e / (1 + e);
+        integ.w = (integ.tt + 1 / integ.tt) * r / (1 + e);
+        integ.x = integ.d * r;
+        integ.evals = 0;
+        // Points too close to an endpoint to be told apart from it are
+        // skipped, and the previous value on that side is used instead
+        if (integ.llim + integ.x != integ.llim) {
+            integ.state = 5;
+            integ.u = integ.llim + integ.x;
+            return call_integ_fn();
+        }
+        goto right;
+    }
+
+    case 5:
+        integ.evals++;
+        if (!failure && reg_x->type == TYPE_REAL)
+            integ.fp = ((vartype_real *) reg_x)->x;
+
+    right:
+
+        if (integ.ulim - integ.x != integ.ulim) {
+            integ.state = 6;
+            integ.u = integ.ulim - integ.x;
+            return call_integ_fn();
+        }
+        goto next;
+
+    case 6:
+        integ.evals++;
+        if (!failure && reg_x->type == TYPE_REAL)
+            integ.fm = ((vartype_real *) reg_x)->x;
+
+    next: {
+        phloat v = integ.w * (integ.fp + integ.fm);
+        phloat s = integ.lsum + v;
+        bool more = integ.evals > 0 && s != integ.lsum
+                        && fabs(v) > integ.acc / 10 * fabs(s);
+        integ.lsum = s;
+        integ.tt *= integ.eh;
+        if (more)
+            goto point;
+
+        integ.sum += integ.lsum;
+        integ.n++;
+        phloat res = integ.d * integ.h * integ.sum;
+        integ.eps = fabs(integ.prev_res - res);
+        integ.prev_res = res;
+        if ((integ.n >= 2 && integ.eps <= integ.acc * fabs(res))
+                || integ.n >= TS_MAX)
+            return finish_integ();
+        goto level;
+    }
+
+    default:
+        return ERR_INTERNAL_ERROR;
+    }
+}
+
 /* approximate integral of `f' between `a' and `b' subject to a given
  * error. Use Romberg method with refinement substitution, x = (3u-u^3)/2
  * which prevents endpoint evaluation and causes non-uniform sampling.
  */
 
 int return_to_integ(int failure, bool stop) {
+    trace_reentry(CMD_INTEG);
     if (stop)
         integ.keep_running = 0;
     
@@ -1219,6 +1510,13 @@ int return_to_integ(int failure, bool stop) {
             return finish_integ(); // too many
         
         goto loop1;
+
+    case 3:
+    case 4:
+    case 5:
+    case 6:
+        return tanh_sinh(failure);
+
     default:
         return ERR_INTERNAL_ERROR;
     }
@@ -32,11 +32,11 @@
 #endif
 
 
-phloat POS_HUGE_PHLOAT;
-phloat NEG_HUGE_PHLOAT;
-phloat POS_TINY_PHLOAT;
-phloat NEG_TINY_PHLOAT;
-phloat NAN_PHLOAT;
+CORE_THREAD phloat POS_HUGE_PHLOAT;
+CORE_THREAD phloat NEG_HUGE_PHLOAT;
+CORE_THREAD phloat POS_TINY_PHLOAT;
+CORE_THREAD phloat NEG_TINY_PHLOAT;
+CORE_THREAD phloat NAN_PHLOAT;
 
 
 /* Note: this function does not handle infinities or NaN */
@@ -985,11 +985,96 @@ double decimal2double(void *data, bool pin_magnitude /* = false */) {
 #endif // BCD_MATH
 
 
+static int phloat2string_uncached(phloat pd, char *buf, int buflen,
+                                  int base_mode, int digits, int dispmode,
+                                  int thousandssep, int max_mant_digits);
+
+/* Formatting a number, especially a decimal one, is not cheap, and the same
+ * few numbers are formatted over and over: X and Y on every redisplay, and
+ * again when they are printed or copied. So the most recent results are
+ * kept, keyed on the value's bits and on everything else that affects the
+ * output: the parameters, the base and word size, and the sign, wrap, and
+ * decimal point flags. A change of mode thus simply makes the old entries
+ * stop matching. Results are stored untruncated, and a request with a
+ * buffer too small for the cached text goes to the formatting code, so
+ * truncation works exactly as before.
+ */
+#define P2S_CACHE_SIZE 8
+#define P2S_CACHE_TEXT 100
+
+typedef struct {
+    phloat value;
+    int base_mode, digits, dispmode, thousandssep, max_mant_digits;
+    int base, wsize, flags;
+    int length;
+    char text[P2S_CACHE_TEXT];
+} p2s_entry;
+
+static CORE_THREAD p2s_entry p2s_cache[P2S_CACHE_SIZE];
+static CORE_THREAD int p2s_count = 0;
+static CORE_THREAD int p2s_next = 0;
+
 int phloat2string(phloat pd, char *buf, int buflen, int base_mode, int digits,
                          int dispmode, int thousandssep, int max_mant_digits) {
     if (pd == 0)
         pd = 0; // Suppress signed zero
 
+    int base = get_base();
+    int wsize = effective_wsize();
+    int fl = flags.f.base_signed | flags.f.base_wrap << 1
+                                 | flags.f.decimal_point << 2;
+    int i;
+    p2s_entry *e;
+    for (i = 0; i < p2s_count; i++) {
+        e = p2s_cache + i;
+        if (memcmp(&e->value, &pd, sizeof(phloat)) == 0
+                && e->base_mode == base_mode && e->digits == digits
+                && e->dispmode == dispmode && e->thousandssep == thousandssep
+                && e->max_mant_digits == max_mant_digits
+                && e->base == base && e->wsize == wsize && e->flags == fl)
+            goto found;
+    }
+
+    /* Format into a scratch buffer, not into the slot we're about to
+     * reuse: if the result turns out not to be cacheable, the slot must
+     * keep its old key and text together.
+     */
+    char text[P2S_CACHE_TEXT];
+    int length;
+    length = phloat2string_uncached(pd, text, P2S_CACHE_TEXT, base_mode,
+                            digits, dispmode, thousandssep, max_mant_digits);
+    if (length == P2S_CACHE_TEXT)
+        // Possibly truncated; don't keep it
+        return phloat2string_uncached(pd, buf, buflen, base_mode, digits,
+                                dispmode, thousandssep, max_mant_digits);
+    e = p2s_cache + p2s_next;
+    memcpy(e->text, text, length);
+    e->length = length;
+    e->value = pd;
+    e->base_mode = base_mode;
+    e->digits = digits;
+    e->dispmode = dispmode;
+    e->thousandssep = thousandssep;
+    e->max_mant_digits = max_mant_digits;
+    e->base = base;
+    e->wsize = wsize;
+    e->flags = fl;
+    if (p2s_count < P2S_CACHE_SIZE)
+        p2s_count++;
+    p2s_next = (p2s_next + 1) % P2S_CACHE_SIZE;
+
+    found:
+    if (e->length > buflen)
+        return phloat2string_uncached(pd, buf, buflen, base_mode, digits,
+                                dispmode, thousandssep, max_mant_digits);
+    memcpy(buf, e->text, e->length);
+    return e->length;
+}
+
+static int phloat2string_uncached(phloat pd, char *buf, int buflen,
+                                  int base_mode, int digits, int dispmode,
+                                  int thousandssep, int max_mant_digits) {
+
     int chars_so_far = 0;
 
     if (p_isnan(pd)) {
@@ -169,11 +169,11 @@ void update_decimal(BID_UINT128 *val);
 #endif // BCD_MATH
 
 
-extern phloat POS_HUGE_PHLOAT;
-extern phloat NEG_HUGE_PHLOAT;
-extern phloat POS_TINY_PHLOAT;
-extern phloat NEG_TINY_PHLOAT;
-extern phloat NAN_PHLOAT;
+extern CORE_THREAD phloat POS_HUGE_PHLOAT;
+extern CORE_THREAD phloat NEG_HUGE_PHLOAT;
+extern CORE_THREAD phloat POS_TINY_PHLOAT;
+extern CORE_THREAD phloat NEG_TINY_PHLOAT;
+extern CORE_THREAD phloat NAN_PHLOAT;
 
 void phloat_init();
 int phloat2string(phloat d, char *buf, int buflen,
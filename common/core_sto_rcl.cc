@@ -19,6 +19,7 @@
 
 #include "core_helpers.h"
 #include "core_linalg1.h"
+#include "core_linalg2.h"
 #include "core_sto_rcl.h"
 #include "core_variables.h"
 
@@ -26,7 +27,7 @@
 static int apply_sto_operation(char operation, vartype *oldval);
 static void generic_sto_completion(int error, vartype *res);
 
-static bool preserve_ij;
+static CORE_THREAD bool preserve_ij;
 
 
 static int apply_sto_operation(char operation, vartype *oldval) {
@@ -37,18 +38,18 @@ static int apply_sto_operation(char operation, vartype *oldval) {
     switch (operation) {
         case '/':
             preserve_ij = true;
-            return generic_div(reg_x, oldval, generic_sto_completion);
+            return generic_div(reg_x, oldval, generic_sto_completion, true);
         case '*':
             preserve_ij = false;
-            return generic_mul(reg_x, oldval, generic_sto_completion);
+            return generic_mul(reg_x, oldval, generic_sto_completion, true);
         case '-':
             preserve_ij = true;
-            error = generic_sub(reg_x, oldval, &newval);
+            error = generic_sub(reg_x, oldval, &newval, true);
             generic_sto_completion(error, newval);
             return error;
         case '+':
             preserve_ij = true;
-            error = generic_add(reg_x, oldval, &newval);
+            error = generic_add(reg_x, oldval, &newval, true);
             generic_sto_completion(error, newval);
             return error;
         default:
@@ -56,7 +57,8 @@ static int apply_sto_operation(char operation, vartype *oldval) {
     }
 }
 
-int generic_div(const vartype *px, const vartype *py, void (*completion)(int, vartype *)) {
+int generic_div(const vartype *px, const vartype *py,
+                void (*completion)(int, vartype *), bool reuse_y) {
     if (px->type == TYPE_STRING || py->type == TYPE_STRING) {
         completion(ERR_ALPHA_DATA_IS_INVALID, NULL);
         return ERR_ALPHA_DATA_IS_INVALID;
@@ -65,13 +67,15 @@ int generic_div(const vartype *px, const vartype *py, void (*completion)(int, va
         return linalg_div(py, px, completion);
     } else {
         vartype *dst;
-        int error = map_binary(px, py, &dst, div_rr, div_rc, div_cr, div_cc);
+        int error = map_binary(px, py, &dst, div_rr, div_rc, div_cr, div_cc,
+                               reuse_y);
         completion(error, dst);
         return error;
     }
 }
 
-int generic_mul(const vartype *px, const vartype *py, void (*completion)(int, vartype *)) {
+int generic_mul(const vartype *px, const vartype *py,
+                void (*completion)(int, vartype *), bool reuse_y) {
     if (px->type == TYPE_STRING || py->type == TYPE_STRING) {
         completion(ERR_ALPHA_DATA_IS_INVALID, NULL);
         return ERR_ALPHA_DATA_IS_INVALID;
@@ -80,13 +84,15 @@ int generic_mul(const vartype *px, const vartype *py, void (*completion)(int, va
         return linalg_mul(py, px, completion);
     } else {
         vartype *dst;
-        int error = map_binary(px, py, &dst, mul_rr, mul_rc, mul_cr, mul_cc);
+        int error = map_binary(px, py, &dst, mul_rr, mul_rc, mul_cr, mul_cc,
+                               reuse_y);
         completion(error, dst);
         return error;
     }
 }
 
-int generic_sub(const vartype *px, const vartype *py, vartype **dst) {
+int generic_sub(const vartype *px, const vartype *py, vartype **dst,
+                bool reuse_y) {
     if (px->type == TYPE_REAL && py->type == TYPE_REAL) {
         vartype_real *x = (vartype_real *) px;
         vartype_real *y = (vartype_real *) py;
@@ -165,10 +171,12 @@ int generic_sub(const vartype *px, const vartype *py, vartype **dst) {
     } else if (px->type == TYPE_STRING || py->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
-        return map_binary(px, py, dst, sub_rr, sub_rc, sub_cr, sub_cc);
+        return map_binary(px, py, dst, sub_rr, sub_rc, sub_cr, sub_cc,
+                          reuse_y);
 }
 
-int generic_add(const vartype *px, const vartype *py, vartype **dst) {
+int generic_add(const vartype *px, const vartype *py, vartype **dst,
+                bool reuse_y) {
     if (px->type == TYPE_REAL && py->type == TYPE_REAL) {
         vartype_real *x = (vartype_real *) px;
         vartype_real *y = (vartype_real *) py;
@@ -246,7 +254,8 @@ int generic_add(const vartype *px, const vartype *py, vartype **dst) {
     } else if (px->type == TYPE_STRING || py->type == TYPE_STRING)
         return ERR_ALPHA_DATA_IS_INVALID;
     else
-        return map_binary(px, py, dst, add_rr, add_rc, add_cr, add_cc);
+        return map_binary(px, py, dst, add_rr, add_rc, add_cr, add_cc,
+                          reuse_y);
 }
 
 int generic_rcl(arg_struct *arg, vartype **dst) {
@@ -323,7 +332,7 @@ int generic_rcl(arg_struct *arg, vartype **dst) {
     }
 }
 
-static arg_struct temp_arg;
+static CORE_THREAD arg_struct temp_arg;
 
 static void generic_sto_completion(int error, vartype *res) {
     if (error != ERR_NONE)
@@ -616,7 +625,270 @@ int generic_sto(arg_struct *arg, char operation) {
     }
 }
 
-int map_unary(const vartype *src, vartype **dst, mappable_r mr, mappable_c mc) {
+/* Bulk element-wise operations.
+ * For the most common operators on real data, map_unary() and map_binary()
+ * don't call the mappable functions once per element, but process the
+ * arrays in blocks, in simple loops that the compiler can vectorize; large
+ * arrays are split across threads. The results are the same either way:
+ * the elements are computed the same way, and the out-of-range handling is
+ * applied afterwards, by looking for infinities in each block.
+ */
+
+#define BULK_ADD 0
+#define BULK_SUB 1
+#define BULK_MUL 2
+#define BULK_DIV 3
+#define BULK_UNARY 4
+
+#define BULK_BLOCK 256
+
+typedef struct {
+    int op;
+    mappable_bulk_r fn;
+    const phloat *x;
+    int4 incx;
+    const phloat *y;
+    int4 incy;
+    phloat *z;
+    int4 n;
+    /* Copied from the calling thread; the pool threads don't have their
+     * own core state, and that includes the CORE_THREAD HUGE_PHLOATs.
+     */
+    bool range_error_ignore;
+    phloat pos_huge, neg_huge;
+    int error[LINALG_MAX_THREADS];
+} bulk_struct;
+
+/* z[j] = y[j] op x[j], where either x or y may be a scalar (increment 0) */
+#define BULK_LOOP(op)                       \
+    if (incx == 0) {                        \
+        phloat s = x[0];                    \
+        for (j = 0; j < len; j++)           \
+            z[j] = y[j] op s;               \
+    } else if (incy == 0) {                 \
+        phloat s = y[0];                    \
+        for (j = 0; j < len; j++)           \
+            z[j] = s op x[j];               \
+    } else {                                \
+        for (j = 0; j < len; j++)           \
+            z[j] = y[j] op x[j];            \
+    }
+
+static int bulk_block(bulk_struct *b, int4 i, int4 len, phloat *z) {
+    const phloat *x = b->x + i * b->incx;
+    const phloat *y = b->y + i * b->incy;
+    int4 incx = b->incx;
+    int4 incy = b->incy;
+    int4 j, k, zero = len;
+    int err;
+
+    switch (b->op) {
+        case BULK_ADD:
+            BULK_LOOP(+)
+            break;
+        case BULK_SUB:
+            BULK_LOOP(-)
+            break;
+        case BULK_MUL:
+            BULK_LOOP(*)
+            break;
+        case BULK_DIV:
+            for (j = 0; j < len; j++)
+                if (x[j * incx] == 0) {
+                    zero = j;
+                    break;
+                }
+            BULK_LOOP(/)
+            break;
+        case BULK_UNARY:
+            err = b->fn(x, z, len);
+            if (err != ERR_NONE)
+                return err;
+            break;
+    }
+
+    /* The mappable functions check each element for division by zero
+     * first, and then for overflow, so whichever comes first wins; when
+     * range errors are ignored, there are no overflows, just HUGE_PHLOATs.
+     */
+    k = linalg_find_inf(z, len);
+    if (zero < len && (zero <= k || b->range_error_ignore))
+        return ERR_DIVIDE_BY_0;
+    while (k < len) {
+        if (!b->range_error_ignore)
+            return ERR_OUT_OF_RANGE;
+        z[k] = p_isinf(z[k]) == 1 ? b->pos_huge : b->neg_huge;
+        k++;
+        k += linalg_find_inf(z + k, len - k);
+    }
+    return ERR_NONE;
+}
+
+static void bulk_worker(void *arg, int t, int nthreads) {
+    bulk_struct *b = (bulk_struct *) arg;
+    int4 i = (int4) ((int8) b->n * t / nthreads);
+    int4 end = (int4) ((int8) b->n * (t + 1) / nthreads);
+    int4 len;
+    phloat buf[BULK_BLOCK];
+    b->error[t] = ERR_NONE;
+    for (; i < end; i += len) {
+        len = end - i < BULK_BLOCK ? end - i : BULK_BLOCK;
+        /* Without a destination, only check that it would work */
+        int err = bulk_block(b, i, len, b->z == NULL ? buf : b->z + i);
+        if (err != ERR_NONE) {
+            b->error[t] = err;
+            return;
+        }
+    }
+}
+
+static int bulk_run(bulk_struct *b) {
+    int t, nthreads = linalg_threads((double) b->n);
+    b->range_error_ignore = flags.f.range_error_ignore;
+    b->pos_huge = POS_HUGE_PHLOAT;
+    b->neg_huge = NEG_HUGE_PHLOAT;
+    linalg_parallel(bulk_worker, b, nthreads);
+    /* The threads' ranges are in order, so the first error found is the
+     * one the element-by-element version would have returned.
+     */
+    for (t = 0; t < nthreads; t++)
+        if (b->error[t] != ERR_NONE)
+            return b->error[t];
+    return ERR_NONE;
+}
+
+/* Tries to do map_binary() using the bulk kernels. That works for the four
+ * basic operators on real matrices, combined with real scalars or with real
+ * matrices of the same size, and for the cases involving complex matrices
+ * that come down to the same thing: adding and subtracting complex
+ * matrices, and multiplying and dividing them by real scalars. For
+ * anything else, returns false.
+ * If reuse_src2 is set, and src2's array isn't shared, the result is
+ * computed in place. When errors are possible, that takes an extra pass,
+ * to make sure src2 is left untouched if the operation fails.
+ */
+static bool map_binary_bulk(const vartype *src1, const vartype *src2,
+                            vartype **dst, mappable_rr mrr, bool reuse_src2,
+                            int *err) {
+    bulk_struct b;
+    int t1 = src1->type;
+    int t2 = src2->type;
+    int4 rows, columns;
+    bool cpx;
+
+    if (mrr == add_rr)
+        b.op = BULK_ADD;
+    else if (mrr == sub_rr)
+        b.op = BULK_SUB;
+    else if (mrr == mul_rr)
+        b.op = BULK_MUL;
+    else if (mrr == div_rr)
+        b.op = BULK_DIV;
+    else
+        return false;
+
+    if (t1 == TYPE_REAL && (t2 == TYPE_REALMATRIX
+                || t2 == TYPE_COMPLEXMATRIX && b.op >= BULK_MUL)) {
+        b.x = &((vartype_real *) src1)->x;
+        b.incx = 0;
+        b.incy = 1;
+    } else if (t2 == TYPE_REAL && (t1 == TYPE_REALMATRIX
+                || t1 == TYPE_COMPLEXMATRIX && b.op == BULK_MUL)) {
+        b.y = &((vartype_real *) src2)->x;
+        b.incx = 1;
+        b.incy = 0;
+    } else if (t1 == TYPE_REALMATRIX && t2 == TYPE_REALMATRIX
+            || (t1 == TYPE_COMPLEXMATRIX && t2 == TYPE_COMPLEXMATRIX
+                                            && b.op <= BULK_SUB)) {
+        b.incx = 1;
+        b.incy = 1;
+    } else
+        return false;
+
+    /* Get the data, the result shape, and the number of phloats */
+    const vartype *m = b.incy == 0 ? src1 : src2;
+    if (m->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) m;
+        rows = rm->rows;
+        columns = rm->columns;
+        b.n = rows * columns;
+        cpx = false;
+    } else {
+        vartype_complexmatrix *cm = (vartype_complexmatrix *) m;
+        rows = cm->rows;
+        columns = cm->columns;
+        b.n = 2 * rows * columns;
+        cpx = true;
+    }
+    if (b.incx == 1 && b.incy == 1) {
+        int4 r1, c1;
+        if (cpx) {
+            r1 = ((vartype_complexmatrix *) src1)->rows;
+            c1 = ((vartype_complexmatrix *) src1)->columns;
+        } else {
+            r1 = ((vartype_realmatrix *) src1)->rows;
+            c1 = ((vartype_realmatrix *) src1)->columns;
+        }
+        if (r1 != rows || c1 != columns) {
+            *err = ERR_DIMENSION_ERROR;
+            return true;
+        }
+    }
+    if (b.incx == 1) {
+        if (!cpx && !contains_no_strings((vartype_realmatrix *) src1)) {
+            *err = ERR_ALPHA_DATA_IS_INVALID;
+            return true;
+        }
+        b.x = cpx ? ((vartype_complexmatrix *) src1)->array->data
+                  : ((vartype_realmatrix *) src1)->array->data;
+    }
+    if (b.incy == 1) {
+        if (!cpx && !contains_no_strings((vartype_realmatrix *) src2)) {
+            *err = ERR_ALPHA_DATA_IS_INVALID;
+            return true;
+        }
+        b.y = cpx ? ((vartype_complexmatrix *) src2)->array->data
+                  : ((vartype_realmatrix *) src2)->array->data;
+    }
+
+    vartype *res = NULL;
+    if (reuse_src2 && b.incy == 1) {
+        linalg_cache_release(src2);
+        int refcount = cpx ? ((vartype_complexmatrix *) src2)->array->refcount
+                           : ((vartype_realmatrix *) src2)->array->refcount;
+        if (refcount == 1) {
+            if (!flags.f.range_error_ignore || b.op == BULK_DIV) {
+                b.z = NULL;
+                *err = bulk_run(&b);
+                if (*err != ERR_NONE)
+                    return true;
+            }
+            /* The new object shares src2's array, which the caller is
+             * about to discard
+             */
+            res = dup_vartype(src2);
+        }
+    }
+    if (res == NULL) {
+        res = cpx ? new_complexmatrix(rows, columns)
+                  : new_realmatrix(rows, columns);
+        if (res == NULL) {
+            *err = ERR_INSUFFICIENT_MEMORY;
+            return true;
+        }
+    }
+    b.z = cpx ? ((vartype_complexmatrix *) res)->array->data
+              : ((vartype_realmatrix *) res)->array->data;
+    *err = bulk_run(&b);
+    if (*err != ERR_NONE)
+        free_vartype(res);
+    else
+        *dst = res;
+    return true;
+}
+
+int map_unary(const vartype *src, vartype **dst, mappable_r mr, mappable_c mc,
+              mappable_bulk_r mb) {
     int error;
     switch (src->type) {
         case TYPE_REAL: {
@@ -655,6 +927,22 @@ int map_unary(const vartype *src, vartype **dst, mappable_r mr, mappable_c mc) {
                     return ERR_ALPHA_DATA_IS_INVALID;
                 }
             }
+            if (mb != NULL) {
+                bulk_struct b;
+                b.op = BULK_UNARY;
+                b.fn = mb;
+                b.x = b.y = sm->array->data;
+                b.incx = b.incy = 1;
+                b.z = dm->array->data;
+                b.n = size;
+                error = bulk_run(&b);
+                if (error != ERR_NONE) {
+                    free_vartype((vartype *) dm);
+                    return error;
+                }
+                *dst = (vartype *) dm;
+                return ERR_NONE;
+            }
             for (i = 0; i < size; i++) {
                 error = mr(sm->array->data[i], &dm->array->data[i]);
                 if (error != ERR_NONE) {
@@ -693,8 +981,11 @@ int map_unary(const vartype *src, vartype **dst, mappable_r mr, mappable_c mc) {
 }
 
 int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
-        mappable_rr mrr, mappable_rc mrc, mappable_cr mcr, mappable_cc mcc) {
+        mappable_rr mrr, mappable_rc mrc, mappable_cr mcr, mappable_cc mcc,
+        bool reuse_src2) {
     int error;
+    if (map_binary_bulk(src1, src2, dst, mrr, reuse_src2, &error))
+        return error;
     switch (src1->type) {
         case TYPE_REAL:
             switch (src2->type) {
@@ -30,6 +30,12 @@
 
 typedef int (*mappable_r)(phloat x, phloat *z);
 typedef int (*mappable_c)(phloat xre, phloat xim, phloat *zre, phloat *zim);
+/* Optional whole-array version of a mappable_r, for real matrices. Returns
+ * a domain error if any element is out of range; overflows are left as
+ * infinities, for map_unary to handle. May run on a worker thread, so it
+ * must not use any core state.
+ */
+typedef int (*mappable_bulk_r)(const phloat *x, phloat *z, int4 n);
 
 
 /*************************************************/
@@ -48,14 +54,18 @@ typedef int (*mappable_cc)(phloat xre, phloat xim, phloat yre, phloat yim,
 /****************************************************************/
 /* Generic arithmetic operators, for use in the implementations */
 /* of +, -, *, /, STO+, STO-, etc...                            */
+/* Callers that are going to discard y anyway can set reuse_y,  */
+/* allowing a matrix result to be computed in y's storage.      */
 /****************************************************************/
 
 int generic_div(const vartype *x, const vartype *y,
-                            void (*completion)(int, vartype *));
+                void (*completion)(int, vartype *), bool reuse_y = false);
 int generic_mul(const vartype *x, const vartype *y,
-                            void (*completion)(int, vartype *));
-int generic_sub(const vartype *x, const vartype *y, vartype **res);
-int generic_add(const vartype *x, const vartype *y, vartype **res);
+                void (*completion)(int, vartype *), bool reuse_y = false);
+int generic_sub(const vartype *x, const vartype *y, vartype **res,
+                bool reuse_y = false);
+int generic_add(const vartype *x, const vartype *y, vartype **res,
+                bool reuse_y = false);
 int generic_rcl(arg_struct *arg, vartype **dst);
 int generic_sto(arg_struct *arg, char operation);
 
@@ -65,9 +75,11 @@ int generic_sto(arg_struct *arg, char operation);
 /* to arbitrary parameter types               */
 /**********************************************/
 
-int map_unary(const vartype *src, vartype **dst, mappable_r, mappable_c mc);
+int map_unary(const vartype *src, vartype **dst, mappable_r, mappable_c mc,
+            mappable_bulk_r mb = NULL);
 int map_binary(const vartype *src1, const vartype *src2, vartype **dst,
-            mappable_rr mrr, mappable_rc mrc, mappable_cr mcr, mappable_cc mcc);
+            mappable_rr mrr, mappable_rc mrc, mappable_cr mcr, mappable_cc mcc,
+            bool reuse_src2 = false);
 
 /**************************************************************/
 /* Operators that can be used by the mapping functions, above */
@@ -20,6 +20,7 @@
 #include "core_globals.h"
 #include "core_helpers.h"
 #include "core_display.h"
+#include "core_linalg1.h"
 #include "core_variables.h"
 
 
@@ -31,21 +32,29 @@ typedef struct pool_real {
     struct pool_real *next;
 } pool_real;
 
-static pool_real *realpool = NULL;
+static CORE_THREAD pool_real *realpool = NULL;
 
 typedef struct pool_complex {
     vartype_complex c;
     struct pool_complex *next;
 } pool_complex;
 
-static pool_complex *complexpool = NULL;
+static CORE_THREAD pool_complex *complexpool = NULL;
 
 typedef struct pool_string {
     vartype_string s;
     struct pool_string *next;
 } pool_string;
 
-static pool_string *stringpool = NULL;
+static CORE_THREAD pool_string *stringpool = NULL;
+
+// Deferred matrix copy for the matrix editor; see disentangle_row().
+
+static CORE_THREAD vartype *pending_var = NULL;
+static CORE_THREAD void *pending_md;
+static CORE_THREAD char *pending_saved;
+
+static void free_pending_copy();
 
 vartype *new_real(phloat value) {
     pool_real *r;
@@ -197,6 +206,8 @@ vartype *new_matrix_alias(vartype *m) {
 void free_vartype(vartype *v) {
     if (v == NULL)
         return;
+    if (v == pending_var)
+        free_pending_copy();
     switch (v->type) {
         case TYPE_REAL: {
             pool_real *r = (pool_real *) v;
@@ -307,6 +318,7 @@ int disentangle(vartype *v) {
     switch (v->type) {
         case TYPE_REALMATRIX: {
             vartype_realmatrix *rm = (vartype_realmatrix *) v;
+            linalg_cache_release(v);
             if (rm->array->refcount == 1)
                 return 1;
             else {
@@ -339,6 +351,7 @@ int disentangle(vartype *v) {
         }
         case TYPE_COMPLEXMATRIX: {
             vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
+            linalg_cache_release(v);
             if (cm->array->refcount == 1)
                 return 1;
             else {
@@ -369,18 +382,357 @@ int disentangle(vartype *v) {
     }
 }
 
+/* Copy-on-write by rows, for the matrix editor. After RCL and EDIT, the
+ * matrix under EDIT shares its data with the variable it came from. When
+ * that variable holds the only other reference, the edited matrix keeps
+ * writing to the shared array, and the first write to each row saves that
+ * row's old contents in pending_md first. The variable's value is then the
+ * shared array with the saved rows put back; finish_pending_copy() makes it
+ * so, by copying the rows that were not saved, or, if the array is no
+ * longer shared, by copying the saved ones back. recall_var(), and the few
+ * places that read vars[] directly, call it first. If the variable is freed
+ * before that, as in RCL, EDIT, STO, the rest of the copy is never made.
+ * There is only one such variable at a time.
+ */
+
+static bool same_array(const vartype *a, const vartype *b) {
+    if (a->type != b->type)
+        return false;
+    if (a->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *ra = (vartype_realmatrix *) a;
+        vartype_realmatrix *rb = (vartype_realmatrix *) b;
+        return ra->array == rb->array
+                && ra->rows == rb->rows && ra->columns == rb->columns;
+    } else if (a->type == TYPE_COMPLEXMATRIX) {
+        vartype_complexmatrix *ca = (vartype_complexmatrix *) a;
+        vartype_complexmatrix *cb = (vartype_complexmatrix *) b;
+        return ca->array == cb->array
+                && ca->rows == cb->rows && ca->columns == cb->columns;
+    } else
+        return false;
+}
+
+static void free_pending_copy() {
+    if (pending_var->type == TYPE_REALMATRIX) {
+        realmatrix_data *md = (realmatrix_data *) pending_md;
+        free(md->data);
+        free(md->is_string);
+    } else
+        free(((complexmatrix_data *) pending_md)->data);
+    free(pending_md);
+    free(pending_saved);
+    pending_var = NULL;
+}
+
+static bool start_pending_copy(vartype *v) {
+    int4 rows, sz;
+    if (v->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) v;
+        rows = rm->rows;
+        sz = rm->rows * rm->columns;
+        realmatrix_data *md = (realmatrix_data *)
+                                malloc(sizeof(realmatrix_data));
+        if (md == NULL)
+            return false;
+        md->data = (phloat *) malloc(sz * sizeof(phloat));
+        md->is_string = (char *) malloc(sz);
+        if (md->data == NULL || md->is_string == NULL) {
+            free(md->data);
+            free(md->is_string);
+            free(md);
+            return false;
+        }
+        pending_md = md;
+    } else {
+        vartype_complexmatrix *cm = (vartype_complexmatrix *) v;
+        rows = cm->rows;
+        sz = cm->rows * cm->columns * 2;
+        complexmatrix_data *md = (complexmatrix_data *)
+                                    malloc(sizeof(complexmatrix_data));
+        if (md == NULL)
+            return false;
+        md->data = (phloat *) malloc(sz * sizeof(phloat));
+        if (md->data == NULL) {
+            free(md);
+            return false;
+        }
+        pending_md = md;
+    }
+    pending_saved = (char *) calloc(rows, 1);
+    pending_var = v;
+    if (pending_saved == NULL) {
+        free_pending_copy();
+        return false;
+    }
+    return true;
+}
+
+/* Copies row 'row' of the shared array to or from pending_md */
+static void copy_pending_row(int4 row, bool save) {
+    int4 i, n, end;
+    if (pending_var->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) pending_var;
+        realmatrix_data *md = (realmatrix_data *) pending_md;
+        n = row * rm->columns;
+        end = n + rm->columns;
+        if (save)
+            for (i = n; i < end; i++) {
+                md->data[i] = rm->array->data[i];
+                md->is_string[i] = rm->array->is_string[i];
+            }
+        else
+            for (i = n; i < end; i++) {
+                rm->array->data[i] = md->data[i];
+                rm->array->is_string[i] = md->is_string[i];
+            }
+    } else {
+        vartype_complexmatrix *cm = (vartype_complexmatrix *) pending_var;
+        complexmatrix_data *md = (complexmatrix_data *) pending_md;
+        n = row * cm->columns * 2;
+        end = n + cm->columns * 2;
+        if (save)
+            for (i = n; i < end; i++)
+                md->data[i] = cm->array->data[i];
+        else
+            for (i = n; i < end; i++)
+                cm->array->data[i] = md->data[i];
+    }
+}
+
+void finish_pending_copy() {
+    if (pending_var == NULL)
+        return;
+    int4 rows, i;
+    int *refcount;
+    if (pending_var->type == TYPE_REALMATRIX) {
+        vartype_realmatrix *rm = (vartype_realmatrix *) pending_var;
+        rows = rm->rows;
+        refcount = &rm->array->refcount;
+    } else {
+        vartype_complexmatrix *cm = (vartype_complexmatrix *) pending_var;
+        rows = cm->rows;
+        refcount = &cm->array->refcount;
+    }
+    if (*refcount == 1) {
+        for (i = 0; i < rows; i++)
+            if (pending_saved[i])
+                copy_pending_row(i, false);
+        free_pending_copy();
+        return;
+    }
+    for (i = 0; i < rows; i++)
+        if (!pending_saved[i])
+            copy_pending_row(i, true);
+    (*refcount)--;
+    if (pending_var->type == TYPE_REALMATRIX) {
+        realmatrix_data *md = (realmatrix_data *) pending_md;
+        md->refcount = 1;
+        ((vartype_realmatrix *) pending_var)->array = md;
+    } else {
+        complexmatrix_data *md = (complexmatrix_data *) pending_md;
+        md->refcount = 1;
+        ((vartype_complexmatrix *) pending_var)->array = md;
+    }
+    free(pending_saved);
+    pending_var = NULL;
+}
+
+/* Like disentangle(), for storing into row 'row' of v, which may be the
+ * matrix under EDIT; see above.
+ */
+int disentangle_row(vartype *v, int4 row) {
+    int refcount;
+    if (v != matedit_x)
+        return disentangle(v);
+    linalg_cache_release(v);
+    if (v->type == TYPE_REALMATRIX)
+        refcount = ((vartype_realmatrix *) v)->array->refcount;
+    else if (v->type == TYPE_COMPLEXMATRIX)
+        refcount = ((vartype_complexmatrix *) v)->array->refcount;
+    else
+        return 1;
+    if (refcount != 2)
+        return disentangle(v);
+    if (pending_var == NULL || !same_array(pending_var, v)) {
+        vartype *owner = NULL;
+        for (int i = 0; i < vars_count; i++)
+            if (same_array(vars[i].value, v)) {
+                owner = vars[i].value;
+                break;
+            }
+        if (owner == NULL)
+            return disentangle(v);
+        finish_pending_copy();
+        if (!start_pending_copy(owner))
+            return disentangle(v);
+    }
+    if (!pending_saved[row]) {
+        copy_pending_row(row, true);
+        pending_saved[row] = 1;
+    }
+    return 1;
+}
+
+/* Variable index: a hash table over the names in vars[], with chains threaded
+ * through var_hash_next[] and linking variable indices in descending order,
+ * so the first visible match is the same one the old reverse linear search
+ * found. Hidden variables stay in their chains and are skipped on lookup.
+ * local_vars[] lists the indices of all local variables in creation order;
+ * since a subroutine's locals are always removed before its caller's, its
+ * top entries are the locals created by the current return level.
+ * Adding and removing variables are handled incrementally: a removed
+ * variable is unlinked from its chain, and the variables after it, which
+ * move down in vars[], are relinked under their new indices. That keeps the
+ * chains in descending order, and costs no more than moving the variables
+ * themselves. Anything else that moves entries around in vars[] just marks
+ * the index as invalid, and it is rebuilt on the next lookup.
+ */
+static CORE_THREAD bool var_index_valid = false;
+static CORE_THREAD int var_hash_size = 0;
+static CORE_THREAD int *var_hash_heads = NULL;
+static CORE_THREAD int var_hash_next_capacity = 0;
+static CORE_THREAD int *var_hash_next = NULL;
+static CORE_THREAD int local_vars_count = 0;
+static CORE_THREAD int local_vars_capacity = 0;
+static CORE_THREAD int *local_vars = NULL;
+
+static unsigned int var_hash(const char *name, int namelength) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < namelength; i++)
+        h = (h ^ (unsigned char) name[i]) * 16777619u;
+    return h;
+}
+
+void invalidate_var_index() {
+    var_index_valid = false;
+}
+
+static bool rebuild_var_index() {
+    int size = 64;
+    while (size < vars_count * 2)
+        size <<= 1;
+    if (size != var_hash_size) {
+        free(var_hash_heads);
+        var_hash_heads = (int *) malloc(size * sizeof(int));
+        var_hash_size = var_hash_heads == NULL ? 0 : size;
+    }
+    if (var_hash_next_capacity < vars_capacity) {
+        int nc = vars_capacity > size ? vars_capacity : size;
+        free(var_hash_next);
+        var_hash_next = (int *) malloc(nc * sizeof(int));
+        var_hash_next_capacity = var_hash_next == NULL ? 0 : nc;
+    }
+    int nlocals = 0;
+    for (int i = 0; i < vars_count; i++)
+        if (vars[i].level != -1)
+            nlocals++;
+    if (local_vars_capacity < nlocals) {
+        free(local_vars);
+        local_vars = (int *) malloc((nlocals + 16) * sizeof(int));
+        local_vars_capacity = local_vars == NULL ? 0 : nlocals + 16;
+    }
+    if (var_hash_heads == NULL || var_hash_next == NULL || local_vars == NULL)
+        return false;
+
+    for (int b = 0; b < var_hash_size; b++)
+        var_hash_heads[b] = -1;
+    local_vars_count = 0;
+    for (int i = 0; i < vars_count; i++) {
+        int b = var_hash(vars[i].name, vars[i].length) & (var_hash_size - 1);
+        var_hash_next[i] = var_hash_heads[b];
+        var_hash_heads[b] = i;
+        if (vars[i].level != -1)
+            local_vars[local_vars_count++] = i;
+    }
+    var_index_valid = true;
+    return true;
+}
+
+static void var_index_append(int varindex) {
+    /* Called after a new variable has been added at the end of vars[] */
+    if (!var_index_valid)
+        return;
+    if (varindex >= var_hash_next_capacity || vars_count > var_hash_size / 2) {
+        var_index_valid = false;
+        return;
+    }
+    if (vars[varindex].level != -1) {
+        if (local_vars_count == local_vars_capacity) {
+            int nc = local_vars_capacity + 16;
+            int *nl = (int *) realloc(local_vars, nc * sizeof(int));
+            if (nl == NULL) {
+                var_index_valid = false;
+                return;
+            }
+            local_vars = nl;
+            local_vars_capacity = nc;
+        }
+        local_vars[local_vars_count++] = varindex;
+    }
+    int b = var_hash(vars[varindex].name, vars[varindex].length) & (var_hash_size - 1);
+    var_hash_next[varindex] = var_hash_heads[b];
+    var_hash_heads[b] = varindex;
+}
+
+static void var_index_unlink(int varindex) {
+    int *pp = var_hash_heads + (var_hash(vars[varindex].name, vars[varindex].length) & (var_hash_size - 1));
+    while (*pp != varindex)
+        pp = var_hash_next + *pp;
+    *pp = var_hash_next[varindex];
+}
+
+static void var_index_move(int from, int to) {
+    /* Called before the variable at 'from' is moved down to 'to'. The
+     * variables between them must already have been moved or unlinked;
+     * since the moves are done in ascending order, the chains stay sorted.
+     */
+    int *pp = var_hash_heads + (var_hash(vars[from].name, vars[from].length) & (var_hash_size - 1));
+    while (*pp != from)
+        pp = var_hash_next + *pp;
+    *pp = to;
+    var_hash_next[to] = var_hash_next[from];
+}
+
+static void var_index_remove(int varindex) {
+    /* Called before the variable at 'varindex' is removed from vars[], and
+     * the ones after it are moved down to fill the gap.
+     */
+    if (!var_index_valid)
+        return;
+    var_index_unlink(varindex);
+    for (int i = varindex + 1; i < vars_count; i++)
+        var_index_move(i, i - 1);
+    /* local_vars[] is in ascending order, so the entries that move are at
+     * the top.
+     */
+    int j = local_vars_count;
+    while (j > 0 && local_vars[j - 1] > varindex)
+        j--;
+    int n = j;
+    if (n > 0 && local_vars[n - 1] == varindex)
+        n--;
+    while (j < local_vars_count)
+        local_vars[n++] = local_vars[j++] - 1;
+    local_vars_count = n;
+}
+
 int lookup_var(const char *name, int namelength) {
-    int i, j;
-    for (i = vars_count - 1; i >= 0; i--) {
-        if (vars[i].hidden)
-            continue;
-        if (vars[i].length == namelength) {
-            for (j = 0; j < namelength; j++)
-                if (vars[i].name[j] != name[j])
-                    goto nomatch;
-            return i;
+    int i;
+    if (!var_index_valid && !rebuild_var_index()) {
+        for (i = vars_count - 1; i >= 0; i--) {
+            if (vars[i].hidden)
+                continue;
+            if (string_equals(vars[i].name, vars[i].length, name, namelength))
+                return i;
         }
-        nomatch:;
+        return -1;
+    }
+    i = var_hash_heads[var_hash(name, namelength) & (var_hash_size - 1)];
+    while (i != -1) {
+        if (!vars[i].hidden
+                && string_equals(vars[i].name, vars[i].length, name, namelength))
+            return i;
+        i = var_hash_next[i];
     }
     return -1;
 }
@@ -389,8 +741,9 @@ vartype *recall_var(const char *name, int namelength) {
     int varindex = lookup_var(name, namelength);
     if (varindex == -1)
         return NULL;
-    else
-        return vars[varindex].value;
+    if (vars[varindex].value == pending_var)
+        finish_pending_copy();
+    return vars[varindex].value;
 }
 
 bool ensure_var_space(int n) {
@@ -424,6 +777,7 @@ int store_var(const char *name, int namelength, vartype *value, bool local) {
         vars[varindex].level = local ? get_rtn_level() : -1;
         vars[varindex].hidden = false;
         vars[varindex].hiding = false;
+        var_index_append(varindex);
     } else if (local && vars[varindex].level < get_rtn_level()) {
         if (vars_count == vars_capacity) {
             int nc = vars_capacity + 25;
@@ -441,6 +795,7 @@ int store_var(const char *name, int namelength, vartype *value, bool local) {
         vars[varindex].level = get_rtn_level();
         vars[varindex].hidden = false;
         vars[varindex].hiding = true;
+        var_index_append(varindex);
         push_indexed_matrix(name, namelength);
     } else {
         if (matedit_mode == 1 &&
@@ -475,6 +830,7 @@ void purge_var(const char *name, int namelength) {
             }
         pop_indexed_matrix(name, namelength);
     }
+    var_index_remove(varindex);
     for (int i = varindex; i < vars_count - 1; i++)
         vars[i] = vars[i + 1];
     vars_count--;
@@ -486,6 +842,84 @@ void purge_all_vars() {
     for (i = 0; i < vars_count; i++)
         free_vartype(vars[i].value);
     vars_count = 0;
+    var_index_valid = false;
+}
+
+static void unhide_var(int varindex) {
+    /* Makes the variable hidden by local 'varindex' visible again */
+    if (var_index_valid) {
+        for (int j = var_hash_next[varindex]; j != -1; j = var_hash_next[j])
+            if (vars[j].hidden && string_equals(vars[varindex].name, vars[varindex].length, vars[j].name, vars[j].length)) {
+                vars[j].hidden = false;
+                return;
+            }
+    } else {
+        for (int j = varindex - 1; j >= 0; j--)
+            if (vars[j].hidden && string_equals(vars[varindex].name, vars[varindex].length, vars[j].name, vars[j].length)) {
+                vars[j].hidden = false;
+                return;
+            }
+    }
+}
+
+static void remove_local_var(int i) {
+    if ((matedit_mode == 1 || matedit_mode == 3)
+            && string_equals(vars[i].name, vars[i].length, matedit_name, matedit_length)) {
+        if (matedit_mode == 3) {
+            set_appmenu_exitcallback(0);
+            set_menu(MENULEVEL_APP, MENU_NONE);
+        }
+        matedit_mode = 0;
+    }
+    if (vars[i].hiding)
+        unhide_var(i);
+    free_vartype(vars[i].value);
+    vars[i].length = 100;
+}
+
+void remove_local_vars(int level) {
+    /* Removes all local variables created at 'level' or deeper; called when
+     * returning from a subroutine.
+     */
+    int last = -1;
+    if (var_index_valid || rebuild_var_index()) {
+        while (local_vars_count > 0) {
+            int i = local_vars[local_vars_count - 1];
+            if (vars[i].level < level)
+                break;
+            local_vars_count--;
+            var_index_unlink(i);
+            remove_local_var(i);
+            last = i;
+        }
+    } else {
+        for (int i = vars_count - 1; i >= 0; i--) {
+            if (vars[i].level == -1)
+                continue;
+            if (vars[i].level < level)
+                break;
+            remove_local_var(i);
+            last = i;
+        }
+    }
+    if (last == -1)
+        return;
+    /* The locals being removed are all in local_vars[], and the ones that
+     * remain were all created before them, so only variables that aren't
+     * in local_vars[] move, and it doesn't need fixing up.
+     */
+    int from = last;
+    int to = last;
+    while (from < vars_count) {
+        if (vars[from].length != 100) {
+            if (var_index_valid)
+                var_index_move(from, to);
+            vars[to++] = vars[from];
+        }
+        from++;
+    }
+    vars_count -= from - to;
+    update_catalog();
 }
 
 int vars_exist(int real, int cpx, int matrix) {
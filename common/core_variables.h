@@ -30,12 +30,16 @@ void free_vartype(vartype *v);
 void clean_vartype_pools();
 vartype *dup_vartype(const vartype *v);
 int disentangle(vartype *v);
+int disentangle_row(vartype *v, int4 row);
+void finish_pending_copy();
 int lookup_var(const char *name, int namelength);
+void invalidate_var_index();
 vartype *recall_var(const char *name, int namelength);
 bool ensure_var_space(int n);
 int store_var(const char *name, int namelength, vartype *value, bool local = false);
 void purge_var(const char *name, int namelength);
 void purge_all_vars();
+void remove_local_vars(int level);
 int vars_exist(int real, int cpx, int matrix);
 int contains_no_strings(const vartype_realmatrix *rm);
 int matrix_copy(vartype *dst, const vartype *src);
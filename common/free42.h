@@ -68,6 +68,21 @@
 #endif
 
 
+/* When FREE42_REENTRANT is defined, all of the core's mutable state is
+ * thread-local, so every thread that calls core_init() gets a calculator of
+ * its own, and several of them can run concurrently in one process. All
+ * core_* calls for a given calculator must then be made from the thread that
+ * initialized it, and the shell_* callbacks must be safe to call from any of
+ * those threads. Without FREE42_REENTRANT, CORE_THREAD expands to nothing and
+ * the core is single-instance, as before.
+ */
+#ifdef FREE42_REENTRANT
+#define CORE_THREAD thread_local
+#else
+#define CORE_THREAD
+#endif
+
+
 /* Magic number "24kF" for the state file. */
 #define FREE42_MAGIC 0x466b3432
 #define FREE42_MAGIC_STR "24kF"
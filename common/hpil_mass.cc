@@ -26,6 +26,7 @@
 #include "core_display.h"
 #include "core_extensions.h"
 #include "core_globals.h"
+#include "core_linalg1.h"
 #include "core_main.h"
 #include "core_variables.h"
 #include "hpil_common.h"
@@ -893,6 +894,7 @@ static int defrd_wrtr(int error) {
 				}
 				else {
 					// all variables, only free42 format / point to first variable
+					finish_pending_copy();
 					s.varIndex = 0;
 					s.varCount = vars_count;
 					s.fType = 0xe0dc;
@@ -1710,6 +1712,8 @@ static void hpil_readrRefreshBuf(void) {
 
 	if (s.pBlocks++ == 0) {
 		if (s.fType == 0xe0d0 ) {
+			// reading into REGS, in place
+			linalg_cache_invalidate(s.r.reg);
 			s.index = 0;
 			s.varCount = s.r.rm->columns * s.r.rm->rows;
 			step = 2;
@@ -82,8 +82,6 @@ static unsigned char *print_text;
 static int print_text_top;
 static int print_text_bottom;
 static int print_text_pixel_height;
-static bool quit_flag = false;
-static int enqueued;
 
 
 /* Private globals */
@@ -112,13 +110,10 @@ static bool macro_is_name;
 static bool mouse_key;
 static guint16 active_keycode = 0;
 static bool just_pressed_shift = false;
-static guint timeout_id = 0;
-static guint timeout3_id = 0;
 
 static int keymap_length = 0;
 static keymap_entry *keymap = NULL;
 
-static guint reminder_id = 0;
 static FILE *statefile = NULL;
 static char statefilename[FILENAMELEN];
 static char printfilename[FILENAMELEN];
@@ -127,11 +122,85 @@ static int ann_updown = 0;
 static int ann_shift = 0;
 static int ann_print = 0;
 static int ann_run = 0;
-static int ann_battery = 0;
+static gint ann_battery = 0;
 static int ann_g = 0;
 static int ann_rad = 0;
 static guint ann_print_timeout_id = 0;
 
+#ifdef AUDIO_ALSA
+static bool local_display;
+#endif
+
+/* The emulator core runs on a thread of its own, so that programs never
+ * stall on drawing or input handling, and vice versa.
+ * Key events are passed to the core thread through a single-producer,
+ * single-consumer ring buffer; the core thread polls it through
+ * shell_wants_cpu(), which is cheap enough to be called after every
+ * instruction. When the ring is full, the GUI thread waits on space_cond
+ * until the core thread has taken an event out. The key repeat and timeout
+ * timers and the "keep running" state are owned by the core thread.
+ * The display and annunciators are passed back as immutable snapshots: the
+ * core thread fills in a new one and swaps it into pending_snapshot, and the
+ * main loop takes it out again in apply_snapshot(). Only the most recent one
+ * is kept, so a program that updates the display faster than we can paint
+ * it doesn't cause a backlog.
+ * Everything else the GUI needs from the core (copy and paste, importing and
+ * exporting, saving state) happens between shell_lock_core() and
+ * shell_unlock_core(). The core thread gives up the lock at the first
+ * opportunity while a lock is requested, again by way of shell_wants_cpu().
+ */
+
+#define EV_KEYDOWN 1
+#define EV_KEYUP 2
+#define EV_QUIT 3
+
+struct core_event {
+    int type;
+    int ckey;
+    bool has_macro;
+    bool macro_is_name;
+    unsigned char macro[1024];
+};
+
+#define EVQ_SIZE 32
+static core_event evq[EVQ_SIZE];
+static gint evq_head = 0; // Only written by the GUI thread
+static gint evq_tail = 0; // Only written by the core thread
+
+static GThread *core_thread = NULL;
+static GMutex core_mutex;
+static GMutex wake_mutex;
+static GCond wake_cond;
+static GCond space_cond;
+static gint gui_wants_core = 0;
+static gint core_thread_exited = 0;
+
+#define TIMER_NONE 0
+#define TIMER_REPEATER 1
+#define TIMER_TIMEOUT1 2
+#define TIMER_TIMEOUT2 3
+
+/* Core thread state; only accessed while holding core_mutex */
+static bool core_running = false;
+static bool core_key_down = false;
+static int enqueued;
+static bool quit_flag = false;
+static int key_timer = TIMER_NONE;
+static gint64 key_timer_time;
+static gint64 timeout3_time = 0;
+
+struct display_snapshot {
+    char bits[17 * 16];
+    int updn, shf, prt, run, g, rad;
+    bool menu, alpha_menu, hex_menu;
+};
+
+static display_snapshot core_disp;
+static bool publish_enabled = true;
+static gpointer pending_snapshot = NULL;
+// The snapshot currently shown; only accessed by the GUI thread
+static display_snapshot *gui_disp = NULL;
+
 
 /* Private functions */
 
@@ -171,15 +240,14 @@ static gboolean print_draw_cb(GtkWidget *w, cairo_t *cr, gpointer cd);
 static gboolean print_key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd);
 static gboolean button_cb(GtkWidget *w, GdkEventButton *event, gpointer cd);
 static gboolean key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd);
-static void enable_reminder();
-static void disable_reminder();
-static gboolean repeater(gpointer cd);
-static gboolean timeout1(gpointer cd);
-static gboolean timeout2(gpointer cd);
-static gboolean timeout3(gpointer cd);
+static void start_core_thread(bool running);
+static void stop_core_thread();
+static void post_core_event(int type);
+static void shell_lock_core();
+static void shell_unlock_core();
+static gboolean apply_snapshot(gpointer cd);
 static gboolean battery_checker(gpointer cd);
 static void repaint_printout(cairo_t *cr);
-static gboolean reminder(gpointer cd);
 static void txt_writer(const char *text, int length);
 static void txt_newliner();
 static void gif_seeker(int4 pos);
@@ -353,6 +421,7 @@ static const char *compactMenuOutroXml =
 
 static int use_compactmenu = 0;
 static char *skin_arg = NULL;
+static const char *trace_file_name = NULL;
 
 static bool decimal_point;
 
@@ -364,6 +433,20 @@ int main(int argc, char *argv[]) {
             skin_arg = ++i < argc ? argv[i] : NULL;
         else if (strcmp(argv[i], "-compactmenu") == 0)
             use_compactmenu = 1;
+        else if (strcmp(argv[i], "-profile") == 0)
+            core_settings.profile_file = ++i < argc ? argv[i] : NULL;
+        else if (strcmp(argv[i], "-trace") == 0) {
+            // Trace file; written on errors, and on SIGUSR1
+            trace_file_name = ++i < argc ? argv[i] : NULL;
+            core_settings.trace_size = 65536;
+            core_settings.trace_file = trace_file_name;
+        }
+        else if (strcmp(argv[i], "-slice") == 0)
+            // Run programs in batches of about this many milliseconds
+            core_settings.run_slice_ms = ++i < argc ? atoi(argv[i]) : 0;
+        else if (strcmp(argv[i], "-runstats") == 0)
+            // Log instruction rates and poll gaps to free42.log
+            core_settings.run_stats = true;
         else {
             fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
             exit(1);
@@ -745,9 +828,13 @@ static void activate(GtkApplication *theApp, gpointer userData) {
     gtk_widget_show_all(mainwindow);
     gtk_widget_show(mainwindow);
 
+#ifdef AUDIO_ALSA
+    const char *display_name = gdk_display_get_name(gdk_display_get_default());
+    local_display = display_name == NULL || display_name[0] == ':';
+#endif
+
     core_init(init_mode, version, core_state_file_name, core_state_file_offset);
-    if (core_powercycle())
-        enable_reminder();
+    start_core_thread(core_powercycle());
 
     /* Check if /proc/apm exists and is readable, and if so,
      * start the battery checker "thread" that keeps the battery
@@ -783,9 +870,11 @@ static void activate(GtkApplication *theApp, gpointer userData) {
         sigemptyset(&act.sa_mask);
         sigaddset(&act.sa_mask, SIGINT);
         sigaddset(&act.sa_mask, SIGTERM);
+        sigaddset(&act.sa_mask, SIGUSR1);
         act.sa_flags = 0;
         sigaction(SIGINT, &act, NULL);
         sigaction(SIGTERM, &act, NULL);
+        sigaction(SIGUSR1, &act, NULL);
     }
 }
 
@@ -953,7 +1042,13 @@ static void init_shell_state(int4 version) {
             state.old_repaint = true;
             /* fall through */
         case 7:
-            /* current version (SHELL_VERSION = 7),
+            core_settings.integ_tanh_sinh = false;
+            /* fall through */
+        case 8:
+            core_settings.solve_warm_start = false;
+            /* fall through */
+        case 9:
+            /* current version (SHELL_VERSION = 9),
              * so nothing to do here since everything
              * was initialized from the state file.
              */
@@ -997,6 +1092,10 @@ static int read_shell_state(int4 *ver) {
         core_settings.matrix_outofrange = state.matrix_outofrange;
         core_settings.auto_repeat = state.auto_repeat;
     }
+    if (state_version >= 8)
+        core_settings.integ_tanh_sinh = state.integ_tanh_sinh;
+    if (state_version >= 9)
+        core_settings.solve_warm_start = state.solve_warm_start;
 
     init_shell_state(state_version);
     *ver = version;
@@ -1020,6 +1119,8 @@ static int write_shell_state() {
     state.matrix_singularmatrix = core_settings.matrix_singularmatrix;
     state.matrix_outofrange = core_settings.matrix_outofrange;
     state.auto_repeat = core_settings.auto_repeat;
+    state.integ_tanh_sinh = core_settings.integ_tanh_sinh;
+    state.solve_warm_start = core_settings.solve_warm_start;
     if (fwrite(&state, 1, sizeof(state_type), statefile) != sizeof(int4))
         return 0;
 
@@ -1027,11 +1128,21 @@ static int write_shell_state() {
 }
 
 static void int_term_handler(int sig) {
-    write(pype[1], "1\n", 2);
+    write(pype[1], sig == SIGUSR1 ? "2\n" : "1\n", 2);
 }
 
 static gboolean gt_signal_handler(GIOChannel *source, GIOCondition condition,
                                                             gpointer data) {
+    char buf[2];
+    if (read(pype[0], buf, 2) == 2 && buf[0] == '2') {
+        // SIGUSR1: dump the execution trace
+        if (trace_file_name != NULL) {
+            shell_lock_core();
+            core_dump_trace(trace_file_name);
+            shell_unlock_core();
+        }
+        return TRUE;
+    }
     quit();
     return TRUE;
 }
@@ -1040,6 +1151,8 @@ static void quit() {
     FILE *printfile;
     int n, length;
 
+    stop_core_thread();
+
     printfile = fopen(printfilename, "w");
     if (printfile != NULL) {
         // Write bitmap
@@ -1310,7 +1423,9 @@ static bool switchTo(const char *selectedStateName) {
         gtk_widget_destroy(msg);
         if (cancelled)
             return false;
+        stop_core_thread();
     } else {
+        stop_core_thread();
         snprintf(path, FILENAMELEN, "%s/%s.f42", free42dirname, state.coreName);
         core_save_state(path);
     }
@@ -1319,8 +1434,7 @@ static bool switchTo(const char *selectedStateName) {
     state.coreName[FILENAMELEN - 1] = 0;
     snprintf(path, FILENAMELEN, "%s/%s.f42", free42dirname, state.coreName);
     core_init(1, 26, path, 0);
-    if (core_powercycle())
-        enable_reminder();
+    start_core_thread(core_powercycle());
     return true;
 }
 
@@ -1418,9 +1532,11 @@ static void states_menu_duplicate() {
     // one. If it is, we'll call core_save_state(), to make sure the duplicate
     // actually matches the most up-to-date state; otherwise, we can simply copy
     // the existing state file.
-    if (strcmp(state_names[selectedStateIndex], state.coreName) == 0)
+    if (strcmp(state_names[selectedStateIndex], state.coreName) == 0) {
+        shell_lock_core();
         core_save_state(finalName);
-    else {
+        shell_unlock_core();
+    } else {
         char origName[FILENAMELEN];
         snprintf(origName, FILENAMELEN, "%s/%s.f42", free42dirname, state_names[selectedStateIndex]);
         if (!copy_state(origName, finalName)) {
@@ -1559,9 +1675,11 @@ static void states_menu_export() {
             return;
     }
 
-    if (selectedStateIndex == currentStateIndex)
+    if (selectedStateIndex == currentStateIndex) {
+        shell_lock_core();
         core_save_state(export_file_name);
-    else {
+        shell_unlock_core();
+    } else {
         char orig_path[FILENAMELEN];
         snprintf(orig_path, FILENAMELEN, "%s/%s.f42", free42dirname, state_names[selectedStateIndex]);
         if (!copy_state(orig_path, export_file_name))
@@ -1818,7 +1936,9 @@ static void exportProgramCB() {
         gtk_widget_show_all(GTK_WIDGET(sel_dialog));
     }
 
+    shell_lock_core();
     char *buf = core_list_programs();
+    shell_unlock_core();
 
     GtkListStore *model = gtk_list_store_new(1, G_TYPE_STRING);
     if (buf != NULL) {
@@ -1897,7 +2017,9 @@ static void exportProgramCB() {
         i++;
     }
     g_list_free(rows);
+    shell_lock_core();
     core_export_programs(count, p2, export_file_name);
+    shell_unlock_core();
     free(p2);
 }
 
@@ -1964,8 +2086,10 @@ static void importProgramCB() {
                         GTK_FILE_CHOOSER(dialog))), "All", 3) != 0)
         appendSuffix(filenamebuf, ".raw");
 
+    shell_lock_core();
     core_import_programs(0, filenamebuf);
     redisplay();
+    shell_unlock_core();
 }
 
 static void paperAdvanceCB() {
@@ -2154,6 +2278,8 @@ static void preferencesCB() {
     static GtkWidget *matrixoutofrange;
     static GtkWidget *autorepeat;
     static GtkWidget *repaintwholedisplay;
+    static GtkWidget *integtanhsinh;
+    static GtkWidget *solvewarmstart;
     static GtkWidget *printtotext;
     static GtkWidget *textpath;
     static GtkWidget *printtogif;
@@ -2182,23 +2308,27 @@ static void preferencesCB() {
         gtk_grid_attach(GTK_GRID(grid), autorepeat, 0, 2, 4, 1);
         repaintwholedisplay = gtk_check_button_new_with_label("Always repaint entire display");
         gtk_grid_attach(GTK_GRID(grid), repaintwholedisplay, 0, 3, 4, 1);
+        integtanhsinh = gtk_check_button_new_with_label("Use tanh-sinh quadrature for INTEG");
+        gtk_grid_attach(GTK_GRID(grid), integtanhsinh, 0, 4, 4, 1);
+        solvewarmstart = gtk_check_button_new_with_label("Start SOLVE from the previous root and bracket");
+        gtk_grid_attach(GTK_GRID(grid), solvewarmstart, 0, 5, 4, 1);
         printtotext = gtk_check_button_new_with_label("Print to text file:");
-        gtk_grid_attach(GTK_GRID(grid), printtotext, 0, 4, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), printtotext, 0, 6, 1, 1);
         textpath = gtk_entry_new();
-        gtk_grid_attach(GTK_GRID(grid), textpath, 1, 4, 2, 1);
+        gtk_grid_attach(GTK_GRID(grid), textpath, 1, 6, 2, 1);
         GtkWidget *browse1 = gtk_button_new_with_label("Browse...");
-        gtk_grid_attach(GTK_GRID(grid), browse1, 3, 4, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), browse1, 3, 6, 1, 1);
         printtogif = gtk_check_button_new_with_label("Print to GIF file:");
-        gtk_grid_attach(GTK_GRID(grid), printtogif, 0, 5, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), printtogif, 0, 7, 1, 1);
         gifpath = gtk_entry_new();
-        gtk_grid_attach(GTK_GRID(grid), gifpath, 1, 5, 2, 1);
+        gtk_grid_attach(GTK_GRID(grid), gifpath, 1, 7, 2, 1);
         GtkWidget *browse2 = gtk_button_new_with_label("Browse...");
-        gtk_grid_attach(GTK_GRID(grid), browse2, 3, 5, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), browse2, 3, 7, 1, 1);
         GtkWidget *label = gtk_label_new("Maximum GIF height (pixels):");
-        gtk_grid_attach(GTK_GRID(grid), label, 1, 6, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), label, 1, 8, 1, 1);
         gifheight = gtk_entry_new();
         gtk_entry_set_max_length(GTK_ENTRY(gifheight), 5);
-        gtk_grid_attach(GTK_GRID(grid), gifheight, 2, 6, 1, 1);
+        gtk_grid_attach(GTK_GRID(grid), gifheight, 2, 8, 1, 1);
 
         g_signal_connect(G_OBJECT(browse1), "clicked", G_CALLBACK(browse_file),
                 (gpointer) new browse_file_info("Select Text File Name",
@@ -2215,6 +2345,8 @@ static void preferencesCB() {
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(singularmatrix), core_settings.matrix_singularmatrix);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(matrixoutofrange), core_settings.matrix_outofrange);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(autorepeat), core_settings.auto_repeat);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(integtanhsinh), core_settings.integ_tanh_sinh);
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(solvewarmstart), core_settings.solve_warm_start);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(printtotext), state.printerToTxtFile);
     gtk_entry_set_text(GTK_ENTRY(textpath), state.printerTxtFileName);
     gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(printtogif), state.printerToGifFile);
@@ -2226,9 +2358,13 @@ static void preferencesCB() {
 
     gtk_window_set_role(GTK_WINDOW(dialog), "Free42 Dialog");
     if (gtk_dialog_run(GTK_DIALOG(dialog)) == GTK_RESPONSE_ACCEPT) {
+        shell_lock_core();
         core_settings.matrix_singularmatrix = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(singularmatrix));
         core_settings.matrix_outofrange = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(matrixoutofrange));
         core_settings.auto_repeat = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(autorepeat));
+        core_settings.integ_tanh_sinh = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(integtanhsinh));
+        core_settings.solve_warm_start = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(solvewarmstart));
+        shell_unlock_core();
 
         state.printerToTxtFile = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(printtotext));
         char *old = strclone(state.printerTxtFileName);
@@ -2280,7 +2416,9 @@ static void appendSuffix(char *path, char *suffix) {
 }
 
 static void copyCB() {
+    shell_lock_core();
     char *buf = core_copy();
+    shell_unlock_core();
     GtkClipboard *clip = gtk_clipboard_get(GDK_SELECTION_CLIPBOARD);
     gtk_clipboard_set_text(clip, buf, -1);
     clip = gtk_clipboard_get(GDK_SELECTION_PRIMARY);
@@ -2290,8 +2428,10 @@ static void copyCB() {
 
 static void paste2(GtkClipboard *clip, const gchar *text, gpointer cd) {
     if (text != NULL) {
+        shell_lock_core();
         core_paste(text);
         redisplay();
+        shell_unlock_core();
         // GTK will free the text once the callback returns.
     }
 }
@@ -2447,62 +2587,10 @@ static gboolean print_key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd) {
 
 static void shell_keydown() {
     GdkWindow *win = gtk_widget_get_window(calc_widget);
-
-    int repeat, keep_running;
     if (skey == -1)
         skey = skin_find_skey(ckey);
     skin_invalidate_key(win, skey);
-    if (timeout3_id != 0 && (macro != NULL || ckey != 28 /* KEY_SHIFT */)) {
-        g_source_remove(timeout3_id);
-        timeout3_id = 0;
-        core_timeout3(0);
-    }
-
-    if (macro != NULL) {
-        if (macro_is_name) {
-            keep_running = core_keydown_command((const char *) macro, &enqueued, &repeat);
-        } else {
-            if (*macro == 0) {
-                squeak();
-                return;
-            }
-            bool one_key_macro = macro[1] == 0 || (macro[2] == 0 && macro[0] == 28);
-            if (!one_key_macro)
-                skin_display_set_enabled(false);
-            while (*macro != 0) {
-                keep_running = core_keydown(*macro++, &enqueued, &repeat);
-                if (*macro != 0 && !enqueued)
-                    core_keyup();
-            }
-            if (!one_key_macro) {
-                skin_display_set_enabled(true);
-                skin_invalidate_display(win);
-                skin_invalidate_annunciator(win, 1);
-                skin_invalidate_annunciator(win, 2);
-                skin_invalidate_annunciator(win, 3);
-                skin_invalidate_annunciator(win, 4);
-                skin_invalidate_annunciator(win, 5);
-                skin_invalidate_annunciator(win, 6);
-                skin_invalidate_annunciator(win, 7);
-                repeat = 0;
-            }
-        }
-    } else
-        keep_running = core_keydown(ckey, &enqueued, &repeat);
-
-    if (quit_flag)
-        quit();
-    if (keep_running)
-        enable_reminder();
-    else {
-        disable_reminder();
-        if (timeout_id != 0)
-            g_source_remove(timeout_id);
-        if (repeat != 0)
-            timeout_id = g_timeout_add(repeat == 1 ? 1000 : 500, repeater, NULL);
-        else if (!enqueued)
-            timeout_id = g_timeout_add(250, timeout1, NULL);
-    }
+    post_core_event(EV_KEYDOWN);
 }
 
 static void shell_keyup() {
@@ -2511,19 +2599,7 @@ static void shell_keyup() {
 
     ckey = 0;
     skey = -1;
-    if (timeout_id != 0) {
-        g_source_remove(timeout_id);
-        timeout_id = 0;
-    }
-    if (!enqueued) {
-        int keep_running = core_keyup();
-        if (quit_flag)
-            quit();
-        if (keep_running)
-            enable_reminder();
-        else
-            disable_reminder();
-    }
+    post_core_event(EV_KEYUP);
 }
 
 static gboolean button_cb(GtkWidget *w, GdkEventButton *event, gpointer cd) {
@@ -2531,7 +2607,8 @@ static gboolean button_cb(GtkWidget *w, GdkEventButton *event, gpointer cd) {
         if (ckey == 0) {
             int x = (int) event->x;
             int y = (int) event->y;
-            skin_find_key(x, y, ann_shift != 0, &skey, &ckey);
+            skin_find_key(x, y, ann_shift != 0,
+                          gui_disp != NULL && gui_disp->menu, &skey, &ckey);
             if (ckey != 0) {
                 macro = skin_find_macro(ckey, &macro_is_name);
                 shell_keydown();
@@ -2598,7 +2675,7 @@ static gboolean key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd) {
                 // for the ALPHA and A..F menus.
                 if (!ctrl && !alt) {
                     char c = event->string[0];
-                    if (printable && core_alpha_menu()) {
+                    if (printable && gui_disp != NULL && gui_disp->alpha_menu) {
                         if (c >= 'a' && c <= 'z')
                             c = c + 'A' - 'a';
                         else if (c >= 'A' && c <= 'Z')
@@ -2610,7 +2687,8 @@ static gboolean key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd) {
                         mouse_key = false;
                         active_keycode = event->hardware_keycode;
                         return TRUE;
-                    } else if (core_hex_menu() && ((c >= 'a' && c <= 'f')
+                    } else if (gui_disp != NULL && gui_disp->hex_menu
+                                            && ((c >= 'a' && c <= 'f')
                                                 || (c >= 'A' && c <= 'F'))) {
                         if (c >= 'a' && c <= 'f')
                             ckey = c - 'a' + 1;
@@ -2692,55 +2770,300 @@ static gboolean key_cb(GtkWidget *w, GdkEventKey *event, gpointer cd) {
     return TRUE;
 }
 
-static void enable_reminder() {
-    if (reminder_id == 0)
-        reminder_id = g_idle_add(reminder, NULL);
-    if (timeout_id != 0) {
-        g_source_remove(timeout_id);
-        timeout_id = 0;
-    }
+static void wake_core_thread() {
+    g_mutex_lock(&wake_mutex);
+    g_cond_signal(&wake_cond);
+    g_mutex_unlock(&wake_mutex);
+}
+
+static bool core_events_pending() {
+    return g_atomic_int_get(&evq_tail) != g_atomic_int_get(&evq_head);
 }
 
-static void disable_reminder() {
-    if (reminder_id != 0) {
-        g_source_remove(reminder_id);
-        reminder_id = 0;
+static void post_core_event(int type) {
+    gint head = g_atomic_int_get(&evq_head);
+    gint next = (head + 1) % EVQ_SIZE;
+    if (next == g_atomic_int_get(&evq_tail)) {
+        // Queue full. The core thread will catch up shortly, since
+        // shell_wants_cpu() is true while there are events pending;
+        // it signals space_cond each time it takes an event out.
+        // Key events can't be dropped, or we could lose a key release;
+        // the exception is when the core thread has exited after OFF,
+        // and isn't going to read them anyway.
+        g_mutex_lock(&wake_mutex);
+        while (next == g_atomic_int_get(&evq_tail)) {
+            if (g_atomic_int_get(&core_thread_exited)) {
+                g_mutex_unlock(&wake_mutex);
+                return;
+            }
+            g_cond_wait(&space_cond, &wake_mutex);
+        }
+        g_mutex_unlock(&wake_mutex);
+    }
+    core_event *ev = evq + head;
+    ev->type = type;
+    if (type == EV_KEYDOWN) {
+        ev->ckey = ckey;
+        ev->has_macro = macro != NULL;
+        ev->macro_is_name = macro_is_name;
+        if (macro != NULL) {
+            strncpy((char *) ev->macro, (const char *) macro, 1023);
+            ev->macro[1023] = 0;
+        }
     }
+    g_atomic_int_set(&evq_head, next);
+    wake_core_thread();
+}
+
+static void shell_lock_core() {
+    g_atomic_int_inc(&gui_wants_core);
+    g_mutex_lock(&core_mutex);
 }
 
-static gboolean repeater(gpointer cd) {
-    int repeat = core_repeat();
-    if (repeat != 0)
-        timeout_id = g_timeout_add(repeat == 1 ? 200 : 100, repeater, NULL);
+static void shell_unlock_core() {
+    g_mutex_unlock(&core_mutex);
+    g_atomic_int_add(&gui_wants_core, -1);
+    wake_core_thread();
+}
+
+static void set_key_timer(int which, int delay) {
+    key_timer = which;
+    key_timer_time = g_get_monotonic_time() + (gint64) delay * 1000;
+}
+
+static void publish_display() {
+    if (!publish_enabled)
+        return;
+    display_snapshot *snap = (display_snapshot *) malloc(sizeof(display_snapshot));
+    if (snap == NULL)
+        // Not fatal; core_disp is complete, so the next update will
+        // publish this one's changes as well.
+        return;
+    memcpy(snap, &core_disp, sizeof(display_snapshot));
+    snap->menu = core_menu() != 0;
+    snap->alpha_menu = core_alpha_menu() != 0;
+    snap->hex_menu = core_hex_menu() != 0;
+    gpointer old;
+    do {
+        old = g_atomic_pointer_get(&pending_snapshot);
+    } while (!g_atomic_pointer_compare_and_exchange(&pending_snapshot, old, snap));
+    if (old == NULL)
+        g_idle_add(apply_snapshot, NULL);
     else
-        timeout_id = g_timeout_add(250, timeout1, NULL);
+        // Superseded before the GUI got around to it
+        free(old);
+}
+
+static void apply_annunciators(int updn, int shf, int prt, int run, int g, int rad);
+
+static gboolean apply_snapshot(gpointer cd) {
+    gpointer p;
+    do {
+        p = g_atomic_pointer_get(&pending_snapshot);
+    } while (!g_atomic_pointer_compare_and_exchange(&pending_snapshot, p, NULL));
+    display_snapshot *snap = (display_snapshot *) p;
+    if (snap == NULL)
+        return FALSE;
+
+    if (state.old_repaint) {
+        GdkWindow *win = gtk_widget_get_window(calc_widget);
+        skin_display_invalidater(win, snap->bits, 17, 0, 0, 131, 16);
+        if (skey >= -7 && skey <= -2)
+            skin_invalidate_key(win, skey);
+    } else {
+        skin_display_invalidater(NULL, snap->bits, 17, 0, 0, 131, 16);
+    }
+    bool prt_changed = gui_disp == NULL || gui_disp->prt != snap->prt;
+    apply_annunciators(snap->updn, snap->shf, prt_changed ? snap->prt : -1,
+                       snap->run, snap->g, snap->rad);
+    free(gui_disp);
+    gui_disp = snap;
     return FALSE;
 }
 
-static gboolean timeout1(gpointer cd) {
-    if (ckey != 0) {
-        core_keytimeout1();
-        timeout_id = g_timeout_add(1750, timeout2, NULL);
+void repaint_display_snapshot() {
+    if (gui_disp != NULL)
+        skin_display_invalidater(NULL, gui_disp->bits, 17, 0, 0, 131, 16);
+}
+
+static void core_thread_keydown(core_event *ev) {
+    int repeat, keep_running;
+    core_key_down = true;
+    if (timeout3_time != 0 && (ev->has_macro || ev->ckey != 28 /* KEY_SHIFT */)) {
+        timeout3_time = 0;
+        core_timeout3(0);
+    }
+
+    if (ev->has_macro) {
+        unsigned char *m = ev->macro;
+        if (ev->macro_is_name) {
+            keep_running = core_keydown_command((const char *) m, &enqueued, &repeat);
+        } else {
+            if (*m == 0) {
+                squeak();
+                return;
+            }
+            bool one_key_macro = m[1] == 0 || (m[2] == 0 && m[0] == 28);
+            if (!one_key_macro)
+                publish_enabled = false;
+            while (*m != 0) {
+                keep_running = core_keydown(*m++, &enqueued, &repeat);
+                if (*m != 0 && !enqueued)
+                    core_keyup();
+            }
+            if (!one_key_macro) {
+                publish_enabled = true;
+                publish_display();
+                repeat = 0;
+            }
+        }
     } else
-        timeout_id = 0;
-    return FALSE;
+        keep_running = core_keydown(ev->ckey, &enqueued, &repeat);
+
+    if (keep_running) {
+        core_running = true;
+        key_timer = TIMER_NONE;
+    } else {
+        core_running = false;
+        if (repeat != 0)
+            set_key_timer(TIMER_REPEATER, repeat == 1 ? 1000 : 500);
+        else if (!enqueued)
+            set_key_timer(TIMER_TIMEOUT1, 250);
+        else
+            key_timer = TIMER_NONE;
+    }
 }
 
-static gboolean timeout2(gpointer cd) {
-    if (ckey != 0)
-        core_keytimeout2();
-    timeout_id = 0;
-    return FALSE;
+static void core_thread_keyup() {
+    core_key_down = false;
+    key_timer = TIMER_NONE;
+    if (!enqueued)
+        core_running = core_keyup() != 0;
+}
+
+static void core_thread_timers() {
+    gint64 now = g_get_monotonic_time();
+    if (key_timer != TIMER_NONE && now >= key_timer_time) {
+        int which = key_timer;
+        key_timer = TIMER_NONE;
+        if (which == TIMER_REPEATER) {
+            int repeat = core_repeat();
+            if (repeat != 0)
+                set_key_timer(TIMER_REPEATER, repeat == 1 ? 200 : 100);
+            else
+                set_key_timer(TIMER_TIMEOUT1, 250);
+        } else if (which == TIMER_TIMEOUT1) {
+            if (core_key_down) {
+                core_keytimeout1();
+                set_key_timer(TIMER_TIMEOUT2, 1750);
+            }
+        } else {
+            if (core_key_down)
+                core_keytimeout2();
+        }
+    }
+    if (timeout3_time != 0 && now >= timeout3_time) {
+        timeout3_time = 0;
+        if (core_timeout3(1)) {
+            core_running = true;
+            key_timer = TIMER_NONE;
+        }
+    }
 }
 
-static gboolean timeout3(gpointer cd) {
-    bool keep_running = core_timeout3(1);
-    timeout3_id = 0;
-    if (keep_running)
-        enable_reminder();
+static gboolean quit_idle(gpointer cd) {
+    quit();
     return FALSE;
 }
 
+static gpointer core_thread_main(gpointer cd) {
+    g_mutex_lock(&core_mutex);
+    while (!quit_flag) {
+        if (g_atomic_int_get(&gui_wants_core) != 0) {
+            g_mutex_unlock(&core_mutex);
+            g_mutex_lock(&wake_mutex);
+            while (g_atomic_int_get(&gui_wants_core) != 0)
+                g_cond_wait(&wake_cond, &wake_mutex);
+            g_mutex_unlock(&wake_mutex);
+            g_mutex_lock(&core_mutex);
+            continue;
+        }
+        if (core_events_pending()) {
+            gint tail = g_atomic_int_get(&evq_tail);
+            core_event *ev = evq + tail;
+            int type = ev->type;
+            if (type == EV_KEYDOWN)
+                core_thread_keydown(ev);
+            else if (type == EV_KEYUP)
+                core_thread_keyup();
+            g_mutex_lock(&wake_mutex);
+            g_atomic_int_set(&evq_tail, (tail + 1) % EVQ_SIZE);
+            g_cond_signal(&space_cond);
+            g_mutex_unlock(&wake_mutex);
+            if (type == EV_QUIT)
+                break;
+            continue;
+        }
+        core_thread_timers();
+        if (core_running) {
+            int dummy1, dummy2;
+            core_running = core_keydown(0, &dummy1, &dummy2) != 0;
+            continue;
+        }
+
+        /* Nothing to do until the next event or timer */
+        gint64 deadline = G_MAXINT64;
+        if (key_timer != TIMER_NONE)
+            deadline = key_timer_time;
+        if (timeout3_time != 0 && timeout3_time < deadline)
+            deadline = timeout3_time;
+        g_mutex_unlock(&core_mutex);
+        g_mutex_lock(&wake_mutex);
+        while (!core_events_pending() && g_atomic_int_get(&gui_wants_core) == 0) {
+            if (deadline == G_MAXINT64)
+                g_cond_wait(&wake_cond, &wake_mutex);
+            else if (!g_cond_wait_until(&wake_cond, &wake_mutex, deadline))
+                break;
+        }
+        g_mutex_unlock(&wake_mutex);
+        g_mutex_lock(&core_mutex);
+    }
+    g_mutex_unlock(&core_mutex);
+    g_mutex_lock(&wake_mutex);
+    g_atomic_int_set(&core_thread_exited, 1);
+    g_cond_signal(&space_cond);
+    g_mutex_unlock(&wake_mutex);
+    /* We defer the actual shutdown so the emulator core can
+     * return from core_keyup() or core_keydown() and isn't
+     * asked to save its state while still in the middle of
+     * executing the OFF instruction...
+     */
+    if (quit_flag)
+        g_idle_add(quit_idle, NULL);
+    return NULL;
+}
+
+static void start_core_thread(bool running) {
+    core_running = running;
+    core_key_down = false;
+    key_timer = TIMER_NONE;
+    quit_flag = false;
+    g_atomic_int_set(&core_thread_exited, 0);
+    core_thread = g_thread_new("core", core_thread_main, NULL);
+}
+
+static void stop_core_thread() {
+    if (core_thread == NULL)
+        return;
+    if (!quit_flag)
+        // Otherwise, the thread is already on its way out
+        post_core_event(EV_QUIT);
+    g_thread_join(core_thread);
+    core_thread = NULL;
+    key_timer = TIMER_NONE;
+    timeout3_time = 0;
+}
+
 static gboolean battery_checker(gpointer cd) {
     shell_low_battery();
     return TRUE;
@@ -2787,19 +3110,6 @@ static void repaint_printout(cairo_t *cr) {
     g_object_unref(G_OBJECT(buf));
 }
 
-static gboolean reminder(gpointer cd) {
-    int dummy1, dummy2;
-    int keep_running = core_keydown(0, &dummy1, &dummy2);
-    if (quit_flag)
-        quit();
-    if (keep_running)
-        return TRUE;
-    else {
-        reminder_id = 0;
-        return FALSE;
-    }
-}
-
 /* Callbacks used by shell_print() and shell_spool_txt() / shell_spool_gif() */
 
 static void txt_writer(const char *text, int length) {
@@ -2855,28 +3165,23 @@ static void gif_writer(const char *text, int length) {
 
 void shell_blitter(const char *bits, int bytesperline, int x, int y,
                                      int width, int height) {
-    if (state.old_repaint) {
-        GdkWindow *win = gtk_widget_get_window(calc_widget);
+    int n = bytesperline < 17 ? bytesperline : 17;
+    for (int v = y; v < y + height; v++)
+        memcpy(core_disp.bits + v * 17, bits + v * bytesperline, n);
+    publish_display();
+}
 
-        skin_display_invalidater(win, bits, bytesperline, x, y, width, height);
-        if (skey >= -7 && skey <= -2)
-            skin_invalidate_key(win, skey);
-    } else {
-        skin_display_invalidater(NULL, bits, bytesperline, x, y, width, height);
-    }
+static gboolean beep_idle(gpointer cd) {
+    gdk_display_beep(gdk_display_get_default());
+    return FALSE;
 }
 
 void shell_beeper(int frequency, int duration) {
 #ifdef AUDIO_ALSA
-    const char *display_name = gdk_display_get_name(gdk_display_get_default());
-    if (display_name == NULL || display_name[0] == ':') {
-        if (!alsa_beeper(frequency, duration))
-            gdk_display_beep(gdk_display_get_default());
-    } else
-        gdk_display_beep(gdk_display_get_default());
-#else
-    gdk_display_beep(gdk_display_get_default());
+    if (local_display && alsa_beeper(frequency, duration))
+        return;
 #endif
+    g_idle_add(beep_idle, NULL);
 }
 
 static gboolean ann_print_timeout(gpointer cd) {
@@ -2893,7 +3198,7 @@ const char *shell_platform() {
     return VERSION " " VERSION_PLATFORM;
 }
 
-void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
+static void apply_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
     GdkWindow *win = gtk_widget_get_window(calc_widget);
 
     if (updn != -1 && ann_updown != updn) {
@@ -2931,19 +3236,46 @@ void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
     }
 }
 
+void shell_annunciators(int updn, int shf, int prt, int run, int g, int rad) {
+    bool changed = false;
+    if (updn != -1 && core_disp.updn != updn) {
+        core_disp.updn = updn;
+        changed = true;
+    }
+    if (shf != -1 && core_disp.shf != shf) {
+        core_disp.shf = shf;
+        changed = true;
+    }
+    if (prt != -1 && core_disp.prt != prt) {
+        core_disp.prt = prt;
+        changed = true;
+    }
+    if (run != -1 && core_disp.run != run) {
+        core_disp.run = run;
+        changed = true;
+    }
+    if (g != -1 && core_disp.g != g) {
+        core_disp.g = g;
+        changed = true;
+    }
+    if (rad != -1 && core_disp.rad != rad) {
+        core_disp.rad = rad;
+        changed = true;
+    }
+    if (changed)
+        publish_display();
+}
+
 int shell_wants_cpu() {
-    return g_main_context_pending(NULL) ? 1 : 0;
+    return core_events_pending() || g_atomic_int_get(&gui_wants_core) != 0;
 }
 
 void shell_delay(int duration) {
-    gdk_display_flush(gdk_display_get_default());
     g_usleep(duration * 1000);
 }
 
 void shell_request_timeout3(int delay) {
-    if (timeout3_id != 0)
-        g_source_remove(timeout3_id);
-    timeout3_id = g_timeout_add(delay, timeout3, NULL);
+    timeout3_time = g_get_monotonic_time() + (gint64) delay * 1000;
 }
 
 uint4 shell_get_mem() { 
@@ -2964,6 +3296,14 @@ uint4 shell_get_mem() {
     return bytes;
 }
 
+static gboolean battery_changed(gpointer cd) {
+    if (allow_paint) {
+        GdkWindow *win = gtk_widget_get_window(calc_widget);
+        skin_invalidate_annunciator(win, 5);
+    }
+    return FALSE;
+}
+
 int shell_low_battery() {
          
     int lowbat = 0;
@@ -3025,27 +3365,29 @@ int shell_low_battery() {
             break;
         }
     }
-    if (lowbat != ann_battery) {
-        ann_battery = lowbat;
-        if (allow_paint) {
-            GdkWindow *win = gtk_widget_get_window(calc_widget);
-            skin_invalidate_annunciator(win, 5);
-        }
+    if (lowbat != g_atomic_int_get(&ann_battery)) {
+        g_atomic_int_set(&ann_battery, lowbat);
+        g_idle_add(battery_changed, NULL);
     }
     return lowbat;
 }
 
 void shell_powerdown() {
-    /* We defer the actual shutdown so the emulator core can
-     * return from core_keyup() or core_keydown() and isn't
-     * asked to save its state while still in the middle of
-     * executing the OFF instruction...
-     */
+    // Picked up by core_thread_main()
     quit_flag = true;
 }
 
-void shell_message(const char *message) {
+static gboolean message_idle(gpointer cd) {
+    char *message = (char *) cd;
     show_message("Core", message);
+    free(message);
+    return FALSE;
+}
+
+void shell_message(const char *message) {
+    char *copy = strclone(message);
+    if (copy != NULL)
+        g_idle_add(message_idle, copy);
 }
 
 int8 shell_random_seed() {
@@ -3085,9 +3427,9 @@ static gboolean print_widget_grew(GtkWidget *w, GdkEventConfigure *event,
     return FALSE;
 }
 
-void shell_print(const char *text, int length,
-                 const char *bits, int bytesperline,
-                 int x, int y, int width, int height) {
+static void do_print(const char *text, int length,
+                     const char *bits, int bytesperline,
+                     int x, int y, int width, int height) {
     int xx, yy;
     int oldlength, newlength;
 
@@ -3275,3 +3617,58 @@ void shell_get_time_date(uint4 *time, uint4 *date, int *weekday) {
     if (weekday != NULL)
         *weekday = tms.tm_wday;
 }
+
+/* shell_print() is called on the core thread, so the actual printing is
+ * handed to the main loop. Jobs are queued in order, and carry their own
+ * copies of the text and bitmap.
+ */
+struct print_job {
+    char *text;
+    int length;
+    char *bits;
+    int bytesperline;
+    int x, width, height;
+};
+
+static gboolean print_idle(gpointer cd) {
+    print_job *job = (print_job *) cd;
+    do_print(job->text, job->length, job->bits, job->bytesperline,
+             job->x, 0, job->width, job->height);
+    free(job->text);
+    free(job->bits);
+    free(job);
+    return FALSE;
+}
+
+void shell_print(const char *text, int length,
+                 const char *bits, int bytesperline,
+                 int x, int y, int width, int height) {
+    // If we run out of memory, the job is dropped, like a print
+    // job that fails to be written to the text or GIF file.
+    print_job *job = (print_job *) malloc(sizeof(print_job));
+    if (job == NULL)
+        return;
+    if (text == NULL)
+        job->text = NULL;
+    else {
+        job->text = (char *) malloc(length + 1);
+        if (job->text == NULL) {
+            free(job);
+            return;
+        }
+        memcpy(job->text, text, length);
+    }
+    job->length = length;
+    job->bits = (char *) malloc(bytesperline * height);
+    if (job->bits == NULL) {
+        free(job->text);
+        free(job);
+        return;
+    }
+    memcpy(job->bits, bits + y * bytesperline, bytesperline * height);
+    job->bytesperline = bytesperline;
+    job->x = x;
+    job->width = width;
+    job->height = height;
+    g_idle_add(print_idle, job);
+}
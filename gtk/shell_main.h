@@ -25,7 +25,7 @@
 extern GtkWidget *calc_widget;
 extern bool allow_paint;
 
-#define SHELL_VERSION 7
+#define SHELL_VERSION 9
 
 struct state_type {
     int extras;
@@ -44,6 +44,8 @@ struct state_type {
     bool matrix_outofrange;
     bool auto_repeat;
     bool old_repaint;
+    bool integ_tanh_sinh;
+    bool solve_warm_start;
 };
 
 extern state_type state;
@@ -63,4 +65,6 @@ typedef struct {
     
 keymap_entry *parse_keymap_entry(char *line, int lineno);
 
+void repaint_display_snapshot();
+
 #endif
@@ -155,7 +155,7 @@ static void selectSkinCB(GtkWidget *w, gpointer cd) {
         int w, h;
         strcpy(state.skinName, name);
         skin_load(&w, &h);
-        core_repaint_display();
+        repaint_display_snapshot();
         gtk_widget_set_size_request(calc_widget, w, h);
         gtk_widget_queue_draw(calc_widget);
     }
@@ -665,9 +665,9 @@ void skin_invalidate_annunciator(GdkWindow *win, int which) {
     gdk_window_invalidate_rect(win, &clip, FALSE);
 }
 
-void skin_find_key(int x, int y, bool cshift, int *skey, int *ckey) {
+void skin_find_key(int x, int y, bool cshift, bool menu, int *skey, int *ckey) {
     int i;
-    if (core_menu()
+    if (menu
             && x >= display_loc.x
             && x < display_loc.x + 131 * display_scale.x
             && y >= display_loc.y + 9 * display_scale.y
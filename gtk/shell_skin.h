@@ -42,7 +42,7 @@ void skin_finish_image();
 void skin_repaint(cairo_t *cr);
 void skin_repaint_annunciator(cairo_t *cr, int which, bool state);
 void skin_invalidate_annunciator(GdkWindow *win, int which);
-void skin_find_key(int x, int y, bool cshift, int *key, int *code);
+void skin_find_key(int x, int y, bool cshift, bool menu, int *key, int *code);
 int skin_find_skey(int ckey);
 unsigned char *skin_find_macro(int ckey, bool *is_name);
 unsigned char *skin_keymap_lookup(guint keyval, bool printable,
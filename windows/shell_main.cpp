@@ -446,6 +446,9 @@ static BOOL InitInstance(HINSTANCE hInstance, int nCmdShow)
     if (hMainWnd == NULL)
         return FALSE;
 
+    // shell_wants_cpu() calls PeekMessage(), which is too slow to call
+    // after every instruction
+    core_settings.run_slice_ms = 20;
     core_init(init_mode, version, core_state_file_name, core_state_file_offset);
 
     if (state.mainPlacementValid) {